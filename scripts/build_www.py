@@ -0,0 +1,129 @@
+"""Build the web interface part of the file system image.
+
+Every page and asset in data/ is gzipped into /w/<hash>.gz, named after the first 8 hex
+digits of the SHA-1 of its content, and listed in /w/assets.txt:
+
+    <hash> <i|r> <content type> <url>
+
+Assets are renamed after their hash (/js/Chart.min.js becomes /js/Chart.min.<hash>.js)
+and the references to them in the pages and style sheets are rewritten, so the browser
+can cache them forever ("i"). Entry points keep their name and are revalidated with
+their ETag on every load ("r"). Other files (config.json) are copied as they are.
+
+Used as a PlatformIO extra script for the buildfs/uploadfs targets, or by hand:
+    python scripts/build_www.py data out
+"""
+import gzip
+import hashlib
+import io
+import os
+import re
+import shutil
+import sys
+
+CONTENT_TYPES = {
+    ".html": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".png": "image/png",
+    ".jpg": "image/jpeg",
+    ".ico": "image/x-icon",
+    ".svg": "image/svg+xml",
+}
+
+# Files the browser asks for by name, with the URLs they answer to.
+ENTRY_POINTS = {
+    "index.html": ["/", "/index.html"],
+    "img/favicon.ico": ["/favicon.ico"],
+}
+
+# Files that may refer to other assets, rewritten after those got their name.
+REFERRING = (".html", ".css")
+
+HASH_LEN = 8
+# SPIFFS keeps 31 characters of a path, the firmware a 48 character URL.
+URL_MAX = 47
+
+
+def content_hash(data):
+    return hashlib.sha1(data).hexdigest()[:HASH_LEN]
+
+
+def hashed_url(rel, digest):
+    stem, ext = os.path.splitext(rel)
+    return "/%s.%s%s" % (stem, digest, ext)
+
+
+def rewrite(text, urls):
+    for rel, url in urls.items():
+        text = re.sub(r'(["\'(])/' + re.escape(rel) + r'(["\')])', r"\g<1>" + url + r"\g<2>", text)
+    return text
+
+
+def gzip_bytes(data):
+    # Fixed mtime so unchanged content gives the same image.
+    buf = io.BytesIO()
+    with gzip.GzipFile(fileobj=buf, mode="wb", compresslevel=9, mtime=0) as f:
+        f.write(data)
+    return buf.getvalue()
+
+
+def build(src, out):
+    if os.path.isdir(out):
+        shutil.rmtree(out)
+    os.makedirs(os.path.join(out, "w"))
+
+    web = []
+    for root, _, files in os.walk(src):
+        for name in sorted(files):
+            path = os.path.join(root, name)
+            rel = os.path.relpath(path, src).replace(os.sep, "/")
+            if os.path.splitext(name)[1].lower() in CONTENT_TYPES:
+                web.append(rel)
+            else:
+                dest = os.path.join(out, rel)
+                if not os.path.isdir(os.path.dirname(dest)):
+                    os.makedirs(os.path.dirname(dest))
+                shutil.copyfile(path, dest)
+
+    # Leaves first, then the style sheets and pages pointing at them.
+    web.sort(key=lambda rel: (rel.endswith(".html"), rel.endswith(".css"), rel))
+    urls = {}
+    manifest = []
+    raw_total = gz_total = 0
+    for rel in web:
+        with open(os.path.join(src, rel), "rb") as f:
+            data = f.read()
+        if rel.endswith(REFERRING):
+            data = rewrite(data.decode("utf-8"), urls).encode("utf-8")
+        digest = content_hash(data)
+        gz = gzip_bytes(data)
+        with open(os.path.join(out, "w", digest + ".gz"), "wb") as f:
+            f.write(gz)
+        raw_total += len(data)
+        gz_total += len(gz)
+
+        content_type = CONTENT_TYPES[os.path.splitext(rel)[1].lower()]
+        if rel in ENTRY_POINTS:
+            for url in ENTRY_POINTS[rel]:
+                manifest.append("%s r %s %s" % (digest, content_type, url))
+        else:
+            urls[rel] = hashed_url(rel, digest)
+            manifest.append("%s i %s %s" % (digest, content_type, urls[rel]))
+
+    for line in manifest:
+        if len(line.split(" ")[-1]) > URL_MAX:
+            sys.exit("build_www: URL too long: " + line)
+    with open(os.path.join(out, "w", "assets.txt"), "w", newline="\n") as f:
+        f.write("\n".join(manifest) + "\n")
+    print("build_www: %d assets, %d bytes gzipped from %d" % (len(web), gz_total, raw_total))
+
+
+if __name__ == "__main__":
+    build(sys.argv[1], sys.argv[2])
+else:
+    Import("env")  # noqa: F821
+    if any("fs" in target for target in COMMAND_LINE_TARGETS):  # noqa: F821
+        www = os.path.join(env.subst("$BUILD_DIR"), "www")  # noqa: F821
+        build(env.subst("$PROJECT_DATA_DIR"), www)  # noqa: F821
+        env.Replace(PROJECT_DATA_DIR=www)  # noqa: F821
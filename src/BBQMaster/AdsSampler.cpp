@@ -0,0 +1,126 @@
+#include "AdsSampler.h"
+#include <Wire.h>
+
+#define ADS_REG_CONVERSION 0x00
+#define ADS_REG_CONFIG 0x01
+
+// Config register bits
+#define ADS_OS_SINGLE 0x8000
+#define ADS_MUX_SINGLE_0 0x4000
+#define ADS_MODE_SINGLE 0x0100
+#define ADS_DR_128SPS 0x0080
+#define ADS_COMP_DISABLE 0x0003
+
+// One conversion at 128 SPS takes 7.8ms, do not bother polling before that.
+#define ADS_CONVERSION_US 8000
+#define ADS_TIMEOUT_US 50000
+
+AdsSampler::AdsSampler (uint8_t address, uint16_t gain) : m_address (address), m_gain (gain), m_channel (-1), m_mask (0), m_oversampling (1), m_samples (0), m_sum (0), m_startedMicros (0)
+{
+   for (int i = 0; i < ADS_CHANNELS; i++)
+      m_values[i] = ADS_INVALID_READING;
+}
+
+void AdsSampler::begin ()
+{
+   Wire.begin ();
+}
+
+void AdsSampler::setOversampling (uint8_t count)
+{
+   if (count < 1)
+      count = 1;
+   if (count > ADS_MAX_OVERSAMPLING)
+      count = ADS_MAX_OVERSAMPLING;
+   m_oversampling = count;
+}
+
+void AdsSampler::startSweep (uint8_t mask)
+{
+   if (busy ())
+      return;
+   m_mask = mask;
+   m_samples = 0;
+   m_sum = 0;
+   int channel = nextChannel (-1);
+   if (channel >= 0)
+      startConversion (channel);
+}
+
+int AdsSampler::nextChannel (int channel) const
+{
+   for (int next = channel + 1; next < ADS_CHANNELS; next++)
+   {
+      if (m_mask & (1 << next))
+         return next;
+   }
+   return -1;
+}
+
+bool AdsSampler::tick ()
+{
+   if (!busy ())
+      return false;
+
+   unsigned long elapsed = micros () - m_startedMicros;
+   if (elapsed < ADS_CONVERSION_US)
+      return false;
+
+   if (conversionDone ())
+   {
+      // Average the oversampled conversions of the channel.
+      m_sum += readRegister (ADS_REG_CONVERSION);
+      if (++m_samples < m_oversampling)
+      {
+         startConversion (m_channel);
+         return false;
+      }
+      m_values[m_channel] = (int16_t)((m_sum + m_samples / 2) / m_samples);
+   }
+   else if (elapsed < ADS_TIMEOUT_US)
+      return false;
+   else
+      m_values[m_channel] = ADS_INVALID_READING;
+
+   m_samples = 0;
+   m_sum = 0;
+   int next = nextChannel (m_channel);
+   if (next >= 0)
+   {
+      startConversion (next);
+      return false;
+   }
+   m_channel = -1;
+   return true;
+}
+
+void AdsSampler::startConversion (int channel)
+{
+   uint16_t config = ADS_OS_SINGLE | (ADS_MUX_SINGLE_0 + (channel << 12)) | m_gain | ADS_MODE_SINGLE | ADS_DR_128SPS | ADS_COMP_DISABLE;
+   Wire.beginTransmission (m_address);
+   Wire.write (ADS_REG_CONFIG);
+   Wire.write ((uint8_t)(config >> 8));
+   Wire.write ((uint8_t)(config & 0xFF));
+   Wire.endTransmission ();
+
+   m_channel = channel;
+   m_startedMicros = micros ();
+}
+
+// The OS bit reads back as 1 once the device is no longer converting.
+bool AdsSampler::conversionDone ()
+{
+   return readRegister (ADS_REG_CONFIG) & ADS_OS_SINGLE;
+}
+
+int16_t AdsSampler::readRegister (uint8_t reg)
+{
+   Wire.beginTransmission (m_address);
+   Wire.write (reg);
+   Wire.endTransmission ();
+   if (Wire.requestFrom (m_address, (uint8_t)2) != 2)
+      return 0;
+   uint16_t value = Wire.read () << 8;
+   value |= Wire.read ();
+   return (int16_t)value;
+}
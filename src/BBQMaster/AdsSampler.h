@@ -0,0 +1,53 @@
+#ifndef ADS_SAMPLER_H
+#define ADS_SAMPLER_H
+
+#include <Arduino.h>
+#include "Hal.h"
+
+#define ADS_CHANNELS 4
+// +/- 4.096V range, 1 bit = 0.125mV
+#define ADS_PGA_4_096V 0x0200
+// Reported when a conversion never completed, reads as an invalid probe.
+#define ADS_INVALID_READING INT16_MAX
+// Most conversions averaged into one reading
+#define ADS_MAX_OVERSAMPLING 16
+
+// Non blocking single shot sampling of the four ADS1115 inputs.
+// A sweep starts a conversion on one channel, returns, and on a later tick reads the
+// result and moves on to the next mux channel, so the caller never waits on the ADC.
+class AdsSampler : public ProbeAdc
+{
+public:
+   AdsSampler (uint8_t address, uint16_t gain = ADS_PGA_4_096V);
+
+   void begin () override;
+   // Number of conversions averaged into each reading, 1 to ADS_MAX_OVERSAMPLING.
+   void setOversampling (uint8_t count) override;
+   // Start converting the channels in mask. Ignored while a sweep is running.
+   void startSweep (uint8_t mask) override;
+   // Advance the sweep. Returns true once when the last channel has been read.
+   bool tick () override;
+
+   bool busy () const { return m_channel >= 0; }
+   int16_t value (int channel) const override { return m_values[channel]; }
+
+private:
+   void startConversion (int channel);
+   // Next channel of the sweep after channel, -1 when done
+   int nextChannel (int channel) const;
+   bool conversionDone ();
+   int16_t readRegister (uint8_t reg);
+
+   uint8_t m_address;
+   uint16_t m_gain;
+   // Channel being converted, -1 when idle
+   int m_channel;
+   uint8_t m_mask;
+   uint8_t m_oversampling;
+   uint8_t m_samples;
+   int32_t m_sum;
+   unsigned long m_startedMicros;
+   int16_t m_values[ADS_CHANNELS];
+};
+
+#endif
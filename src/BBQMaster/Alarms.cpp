@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <string.h>
+#include "Alarms.h"
+
+AlarmEngine g_alarms;
+SpscQueue<AlarmEdit, 8> g_alarmEdits;
+
+const char* const g_alarmTypeNames[ALARM_TYPE_COUNT] = {"target", "high", "low", "rise", "disconnect"};
+
+bool makeAlarmRule (const char* type, const char* channel, float value, float hysteresis, int window, AlarmRule& rule)
+{
+   rule.m_type = ALARM_TYPE_COUNT;
+   for (int i = 0; type && i < ALARM_TYPE_COUNT; i++)
+      if (!strcmp (type, g_alarmTypeNames[i]))
+         rule.m_type = i;
+   rule.m_channel = SENSOR_COUNT;
+   for (int i = 0; channel && i < SENSOR_COUNT; i++)
+      if (!strcmp (channel, g_channelNames[i]))
+         rule.m_channel = i;
+   if (rule.m_type == ALARM_TYPE_COUNT || rule.m_channel == SENSOR_COUNT)
+      return false;
+   if (hysteresis < 0 || window < ALARM_RATE_SLOTS || window > 3600)
+      return false;
+
+   rule.m_value = toTenths (value);
+   rule.m_hysteresis = toTenths (hysteresis);
+   rule.m_window = window;
+   return true;
+}
+
+AlarmEngine::AlarmEngine () : m_revision (0)
+{
+   clear ();
+}
+
+void AlarmEngine::resetState (size_t index)
+{
+   RuleState& state = m_state[index];
+   state.m_active = false;
+   state.m_armed = false;
+   state.m_missing = 0;
+   state.m_slotHead = 0;
+   state.m_slotCount = 0;
+}
+
+bool AlarmEngine::setRule (size_t index, const AlarmRule& rule)
+{
+   if (index >= ALARM_MAX)
+      return false;
+   m_rules[index] = rule;
+   m_used[index] = true;
+   resetState (index);
+   m_revision++;
+   return true;
+}
+
+void AlarmEngine::removeRule (size_t index)
+{
+   if (index < ALARM_MAX)
+      m_used[index] = false;
+   m_revision++;
+}
+
+void AlarmEngine::clear ()
+{
+   for (size_t i = 0; i < ALARM_MAX; i++)
+   {
+      m_used[i] = false;
+      resetState (i);
+   }
+   m_revision++;
+}
+
+int16_t AlarmEngine::target (int channel) const
+{
+   for (size_t i = 0; i < ALARM_MAX; i++)
+      if (m_used[i] && m_rules[i].m_type == ALARM_TARGET && m_rules[i].m_channel == channel)
+         return m_rules[i].m_value;
+   return INT16_MIN;
+}
+
+bool AlarmEngine::measure (size_t index, const HistPoint& point, int16_t& value)
+{
+   const AlarmRule& rule = m_rules[index];
+   RuleState& state = m_state[index];
+   if (rule.m_type != ALARM_RISE)
+   {
+      value = point.m_temp[rule.m_channel];
+      return true;
+   }
+
+   // Keep one sample per step of the window and compare the newest reading with the oldest one.
+   int32_t step = rule.m_window / ALARM_RATE_SLOTS;
+   uint8_t newest = (state.m_slotHead + state.m_slotCount + ALARM_RATE_SLOTS - 1) % ALARM_RATE_SLOTS;
+   if (!state.m_slotCount || point.m_time - state.m_slotTime[newest] >= step)
+   {
+      if (state.m_slotCount == ALARM_RATE_SLOTS)
+         state.m_slotHead = (state.m_slotHead + 1) % ALARM_RATE_SLOTS;
+      else
+         state.m_slotCount++;
+      newest = (state.m_slotHead + state.m_slotCount - 1) % ALARM_RATE_SLOTS;
+      state.m_slotTime[newest] = point.m_time;
+      state.m_slotTemp[newest] = point.m_temp[rule.m_channel];
+   }
+
+   int32_t elapsed = point.m_time - state.m_slotTime[state.m_slotHead];
+   if (elapsed < rule.m_window - step)
+      return false;
+   int32_t perMinute = (int32_t)(point.m_temp[rule.m_channel] - state.m_slotTemp[state.m_slotHead]) * 60 / elapsed;
+   value = perMinute > INT16_MAX ? INT16_MAX : perMinute < INT16_MIN ? INT16_MIN : perMinute;
+   return true;
+}
+
+void AlarmEngine::raise (size_t index, bool active, int32_t time, int16_t value)
+{
+   m_state[index].m_active = active;
+   AlarmEvent event;
+   event.m_time = time;
+   event.m_rule = index;
+   event.m_active = active;
+   event.m_value = value;
+   // A full queue loses its oldest event rather than the newest.
+   if (m_events.full ())
+      m_events.popFront ();
+   m_events.push (event);
+}
+
+void AlarmEngine::evaluate (const HistPoint& point)
+{
+   for (size_t i = 0; i < ALARM_MAX; i++)
+   {
+      if (!m_used[i])
+         continue;
+      const AlarmRule& rule = m_rules[i];
+      RuleState& state = m_state[i];
+
+      if (!point.available (rule.m_channel))
+      {
+         // Readings of the other rules resume from scratch when the probe comes back.
+         state.m_slotCount = 0;
+         if (state.m_missing < ALARM_DISCONNECT_READINGS)
+            state.m_missing++;
+         if (rule.m_type == ALARM_DISCONNECT && state.m_armed && !state.m_active && state.m_missing == ALARM_DISCONNECT_READINGS)
+            raise (i, true, point.m_time, 0);
+         continue;
+      }
+      state.m_missing = 0;
+
+      if (rule.m_type == ALARM_DISCONNECT)
+      {
+         // Only a probe that was plugged in can be lost.
+         state.m_armed = true;
+         if (state.m_active)
+            raise (i, false, point.m_time, point.m_temp[rule.m_channel]);
+         continue;
+      }
+
+      int16_t value;
+      if (!measure (i, point, value))
+         continue;
+
+      bool on, off;
+      if (rule.m_type == ALARM_LOW)
+      {
+         if (value > rule.m_value + rule.m_hysteresis)
+            state.m_armed = true;
+         on = state.m_armed && value <= rule.m_value;
+         off = value > rule.m_value + rule.m_hysteresis;
+      }
+      else
+      {
+         on = value >= rule.m_value;
+         off = value < rule.m_value - rule.m_hysteresis;
+      }
+      if (!state.m_active && on)
+         raise (i, true, point.m_time, value);
+      else if (state.m_active && off)
+         raise (i, false, point.m_time, value);
+   }
+}
+
+bool AlarmEngine::applyEdits ()
+{
+   bool changed = false;
+   AlarmEdit edit;
+   while (g_alarmEdits.pop (edit))
+   {
+      if (edit.m_remove)
+         removeRule (edit.m_index);
+      else
+         setRule (edit.m_index, edit.m_rule);
+      changed = true;
+   }
+   return changed;
+}
+
+bool AlarmEngine::popEvent (AlarmEvent& event)
+{
+   if (m_events.empty ())
+      return false;
+   event = m_events.front ();
+   m_events.popFront ();
+   return true;
+}
+
+static int tenthsFraction (int16_t tenths)
+{
+   return tenths < 0 ? -tenths % 10 : tenths % 10;
+}
+
+// Tenths as a decimal number, keeping the sign of values between -1 and 0.
+static int formatTenths (char* buf, size_t size, int16_t tenths)
+{
+   return snprintf (buf, size, "%s%d.%d", tenths < 0 && tenths > -10 ? "-" : "", tenths / 10, tenthsFraction (tenths));
+}
+
+size_t formatAlarmEvent (char* buf, size_t size, const AlarmEvent& event, const AlarmRule& rule)
+{
+   char value[12], limit[12];
+   formatTenths (value, sizeof (value), event.m_value);
+   formatTenths (limit, sizeof (limit), rule.m_value);
+   int len = snprintf (buf, size, "{\"t\":%ld,\"rule\":%u,\"type\":\"%s\",\"n\":\"%s\",\"active\":%s,\"v\":%s,\"limit\":%s}",
+                       (long)event.m_time, (unsigned)event.m_rule, g_alarmTypeNames[rule.m_type], g_channelNames[rule.m_channel],
+                       event.m_active ? "true" : "false", value, limit);
+   return len < 0 ? 0 : (size_t)len < size ? len : size - 1;
+}
+
+size_t formatAlarmRules (char* buf, size_t size, const AlarmEngine& engine)
+{
+   size_t len = snprintf (buf, size, "{\"rules\":[");
+   bool first = true;
+   for (size_t i = 0; i < ALARM_MAX && len < size; i++)
+   {
+      if (!engine.used (i))
+         continue;
+      const AlarmRule& rule = engine.rule (i);
+      char value[12], hysteresis[12];
+      formatTenths (value, sizeof (value), rule.m_value);
+      formatTenths (hysteresis, sizeof (hysteresis), rule.m_hysteresis);
+      len += snprintf (buf + len, size - len, "%s{\"rule\":%u,\"type\":\"%s\",\"n\":\"%s\",\"value\":%s,\"hyst\":%s,\"window\":%u,\"active\":%s}",
+                       first ? "" : ",", (unsigned)i, g_alarmTypeNames[rule.m_type], g_channelNames[rule.m_channel], value, hysteresis,
+                       (unsigned)rule.m_window, engine.active (i) ? "true" : "false");
+      first = false;
+   }
+   if (len < size)
+      len += snprintf (buf + len, size - len, "]}");
+   return len < size ? len : size - 1;
+}
@@ -0,0 +1,133 @@
+#ifndef ALARMS_H
+#define ALARMS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "History.h"
+#include "SpscQueue.h"
+
+#define ALARM_MAX 16
+// Samples kept per rate rule, the window is split in as many steps
+#define ALARM_RATE_SLOTS 8
+// Consecutive readings without a probe before it counts as disconnected
+#define ALARM_DISCONNECT_READINGS 3
+// Events waiting to be sent to MQTT and the browsers
+#define ALARM_EVENT_QUEUE 16
+// Default hysteresis in 0.1 F (0.1 F per minute for rate rules)
+#define ALARM_DEFAULT_HYSTERESIS 20
+#define ALARM_DEFAULT_WINDOW 300
+// Largest JSON text of one event and of the rule list
+#define ALARM_EVENT_JSON_MAX 160
+#define ALARM_RULES_JSON_MAX (ALARM_MAX * 112 + 16)
+
+enum AlarmType
+{
+   // Probe reached its target, e.g. the meat is done
+   ALARM_TARGET,
+   // Above the top of a band
+   ALARM_HIGH,
+   // Below the bottom of a band, only once the probe has been above it
+   ALARM_LOW,
+   // Rising faster than the threshold over the window
+   ALARM_RISE,
+   // Probe unplugged or out of range
+   ALARM_DISCONNECT,
+   ALARM_TYPE_COUNT
+};
+
+extern const char* const g_alarmTypeNames[ALARM_TYPE_COUNT];
+
+struct AlarmRule
+{
+   uint8_t m_type;
+   uint8_t m_channel;
+   // Threshold in 0.1 F, or 0.1 F per minute for rate rules
+   int16_t m_value;
+   // How far back past the threshold the reading has to go to clear the alarm, same unit
+   int16_t m_hysteresis;
+   // Rate window in seconds
+   uint16_t m_window;
+};
+
+// Fill a rule from its configuration. Returns false when a field is invalid.
+bool makeAlarmRule (const char* type, const char* channel, float value, float hysteresis, int window, AlarmRule& rule);
+
+// An alarm went on or off.
+struct AlarmEvent
+{
+   int32_t m_time;
+   uint8_t m_rule;
+   bool m_active;
+   // Reading that triggered it, in the unit of the rule
+   int16_t m_value;
+};
+
+// Change of one rule requested by the web server, applied by the loop.
+struct AlarmEdit
+{
+   uint8_t m_index;
+   // Clear the slot instead of setting it
+   bool m_remove;
+   AlarmRule m_rule;
+};
+
+// Rules evaluated on every reading. O(rules) per reading, fixed memory.
+class AlarmEngine
+{
+public:
+   AlarmEngine ();
+
+   // Replace the rule at index, resetting its state. Returns false when index is out of range.
+   bool setRule (size_t index, const AlarmRule& rule);
+   void removeRule (size_t index);
+   void clear ();
+   bool used (size_t index) const { return m_used[index]; }
+   const AlarmRule& rule (size_t index) const { return m_rules[index]; }
+   bool active (size_t index) const { return m_state[index].m_active; }
+   // Value of the first target rule of a channel in 0.1 F, INT16_MIN when it has none.
+   int16_t target (int channel) const;
+   // Changes whenever a rule is set or removed.
+   uint32_t revision () const { return m_revision; }
+
+   // Feed one reading, queueing an event for every alarm that went on or off.
+   void evaluate (const HistPoint& point);
+   // Apply the edits queued by the web server. Returns true when a rule changed.
+   bool applyEdits ();
+   bool popEvent (AlarmEvent& event);
+
+private:
+   struct RuleState
+   {
+      bool m_active;
+      // Low rules only arm once the reading was above the band
+      bool m_armed;
+      uint8_t m_missing;
+      // Rate rules: samples every window / ALARM_RATE_SLOTS
+      int32_t m_slotTime[ALARM_RATE_SLOTS];
+      int16_t m_slotTemp[ALARM_RATE_SLOTS];
+      uint8_t m_slotHead;
+      uint8_t m_slotCount;
+   };
+
+   void resetState (size_t index);
+   // Current value of a rule, false when it cannot be computed yet.
+   bool measure (size_t index, const HistPoint& point, int16_t& value);
+   void raise (size_t index, bool active, int32_t time, int16_t value);
+
+   AlarmRule m_rules[ALARM_MAX];
+   bool m_used[ALARM_MAX];
+   RuleState m_state[ALARM_MAX];
+   RingBuffer<AlarmEvent, ALARM_EVENT_QUEUE> m_events;
+   uint32_t m_revision;
+};
+
+// Format an event as JSON. Returns the length written.
+size_t formatAlarmEvent (char* buf, size_t size, const AlarmEvent& event, const AlarmRule& rule);
+// Format the rules with their state as JSON. Returns the length written.
+size_t formatAlarmRules (char* buf, size_t size, const AlarmEngine& engine);
+
+extern AlarmEngine g_alarms;
+// Edits from the web server to the loop
+extern SpscQueue<AlarmEdit, 8> g_alarmEdits;
+
+#endif
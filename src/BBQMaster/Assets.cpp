@@ -0,0 +1,93 @@
+#include "Assets.h"
+#include <stdio.h>
+#include <string.h>
+
+AssetTable g_assets;
+
+void Asset::path (char* out) const
+{
+   snprintf (out, ASSET_PATH_MAX, "/w/%s.gz", m_hash);
+}
+
+void Asset::etag (char* out) const
+{
+   snprintf (out, ASSET_ETAG_MAX, "\"%s\"", m_hash);
+}
+
+const char* Asset::cacheControl () const
+{
+   return m_immutable ? "public, max-age=31536000, immutable" : "no-cache";
+}
+
+bool Asset::matches (const char* ifNoneMatch) const
+{
+   // A list of quoted tags, possibly weak (W/"..."), or "*".
+   for (const char* p = ifNoneMatch; *p; p++)
+   {
+      if (*p == '*')
+         return true;
+      if (*p == '"')
+      {
+         const char* end = strchr (p + 1, '"');
+         if (!end)
+            return false;
+         if (end - p - 1 == ASSET_HASH_LEN && !strncmp (p + 1, m_hash, ASSET_HASH_LEN))
+            return true;
+         p = end;
+      }
+   }
+   return false;
+}
+
+// Copy the next space separated field of line into out. Returns false when it is missing or too long.
+static bool nextField (char*& line, char* out, size_t size)
+{
+   while (*line == ' ')
+      line++;
+   size_t len = strcspn (line, " ");
+   if (!len || len >= size)
+      return false;
+   memcpy (out, line, len);
+   out[len] = '\0';
+   line += len;
+   return true;
+}
+
+bool AssetTable::load (FileSystem& fs)
+{
+   m_count = 0;
+   char text[ASSET_MANIFEST_MAX + 1];
+   size_t len = fs.read (ASSET_MANIFEST, 0, (uint8_t*)text, ASSET_MANIFEST_MAX);
+   text[len] = '\0';
+
+   char* line = text;
+   while (*line && m_count < ASSET_MAX)
+   {
+      char* next = strchr (line, '\n');
+      if (next)
+         *next++ = '\0';
+      else
+         next = line + strlen (line);
+
+      // <hash> <i|r> <content type> <url>
+      Asset& asset = m_assets[m_count];
+      char cache[2];
+      if (nextField (line, asset.m_hash, sizeof (asset.m_hash)) && strlen (asset.m_hash) == ASSET_HASH_LEN &&
+          nextField (line, cache, sizeof (cache)) && nextField (line, asset.m_type, ASSET_TYPE_MAX) &&
+          nextField (line, asset.m_url, ASSET_URL_MAX))
+      {
+         asset.m_immutable = cache[0] == 'i';
+         m_count++;
+      }
+      line = next;
+   }
+   return m_count > 0;
+}
+
+const Asset* AssetTable::find (const char* url) const
+{
+   for (size_t i = 0; i < m_count; i++)
+      if (!strcmp (m_assets[i].m_url, url))
+         return &m_assets[i];
+   return nullptr;
+}
@@ -0,0 +1,54 @@
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include "Hal.h"
+
+// Manifest written by scripts/build_www.py next to the gzipped files
+#define ASSET_MANIFEST "/w/assets.txt"
+#define ASSET_MANIFEST_MAX 1536
+#define ASSET_MAX 24
+#define ASSET_URL_MAX 48
+#define ASSET_TYPE_MAX 32
+#define ASSET_HASH_LEN 8
+// "/w/<hash>.gz" and "\"<hash>\""
+#define ASSET_PATH_MAX (ASSET_HASH_LEN + 7)
+#define ASSET_ETAG_MAX (ASSET_HASH_LEN + 3)
+
+// One pre-compressed page or asset on flash.
+struct Asset
+{
+   char m_url[ASSET_URL_MAX];
+   char m_type[ASSET_TYPE_MAX];
+   // Content hash, also used as the ETag and the file name
+   char m_hash[ASSET_HASH_LEN + 1];
+   // Hashed URL, the content behind it never changes
+   bool m_immutable;
+
+   // Gzipped content on the file system.
+   void path (char* out) const;
+   // Strong ETag, quoted.
+   void etag (char* out) const;
+   const char* cacheControl () const;
+   // Whether an If-None-Match header names this version.
+   bool matches (const char* ifNoneMatch) const;
+};
+
+// Static assets listed in the manifest. Loaded once at boot, read only afterwards.
+class AssetTable
+{
+public:
+   AssetTable () : m_count (0) {}
+
+   // Returns false when there is no usable manifest, e.g. data/ was uploaded as is.
+   bool load (FileSystem& fs);
+   const Asset* find (const char* url) const;
+   size_t size () const { return m_count; }
+
+private:
+   Asset m_assets[ASSET_MAX];
+   size_t m_count;
+};
+
+extern AssetTable g_assets;
+
+#endif
@@ -1,6 +1,5 @@
 #include <FS.h>
 #include <SPIFFS.h>
-#include <Adafruit_ADS1015.h>
 #include <DNSServer.h>
 #include <OneWire.h>
 #include <WiFi.h>
@@ -9,111 +8,96 @@
 #include <ESPAsyncWiFiManager.h>
 #include <Wire.h>
 #include <ArduinoJson.h>
-#include <SimpleList.h>
 #include <DallasTemperature.h>
 #include <ArduinoOTA.h>
 #include <NtpClientLib.h>
 #include <PubSubClient.h>
+#include <esp_wifi.h>
+#include <esp_pm.h>
+#include <Preferences.h>
+#include "Debug.h"
+#include "Sensors.h"
+#include "Network.h"
+#include "ResponseCache.h"
+#include "Metrics.h"
+#include "MqttPublisher.h"
+#include "MqttConnection.h"
+#include "Assets.h"
+#include "Alarms.h"
+#include "PitController.h"
+#include "Power.h"
+#include "Config.h"
+#include "WifiConnection.h"
+#include "AdsSampler.h"
+#include "EspHal.h"
 
-// #define DEBUG_SERIAL
-// #define DEBUG_TELNET
-// #define DEBUG_EXTRA_OUTPUT
-
-// Macros for debugging
 #ifdef DEBUG_TELNET
-   #define     DEBUG_TELNET_PORT 23
    WiFiServer  telnetServer(DEBUG_TELNET_PORT);
    WiFiClient  telnetClient;
-   #define     DEBUG_PRINT(x)    telnetClient.print(x)
-   #define     DEBUG_PRINT_WITH_FMT(x, fmt)    telnetClient.printf(x, fmt)
-   #define     DEBUG_PRINTLN(x)  telnetClient.println(x)
-   #define     DEBUG_PRINTLN_WITH_FMT(x, fmt)  telnetClient.println(x, fmt)
-#elif defined(DEBUG_SERIAL)
-   #define     DEBUG_PRINT(x)    Serial.print(x)
-   #define     DEBUG_PRINT_WITH_FMT(x, fmt)    Serial.printf(x, fmt)
-   #define     DEBUG_PRINTLN(x)  Serial.println(x)
-   #define     DEBUG_PRINTLN_WITH_FMT(x, fmt)  Serial.println(x, fmt)
-#else
-   #define     DEBUG_PRINT(x)
-   #define     DEBUG_PRINT_WITH_FMT(x, fmt)
-   #define     DEBUG_PRINTLN(x)
-   #define     DEBUG_PRINTLN_WITH_FMT(x, fmt)
 #endif
 
 #define I2C_SDA_PIN 23
 #define I2C_SCL_PIN 22
 #define BATTERY_V_PIN 35
+// Pit blower PWM
+#define FAN_PWM_PIN 25
+#define FAN_LEDC_CHANNEL 0
 
 #define BAT_RATIO 0.0017240449438202
-#define NTC_MAX_ADC 27550.00
-#define NTC_REF_RES 62000
-#define NTC_SMP_TMP 25.81
-#define NTC_SMP_RES 52250
-#define NTC_BCOEFFICIENT 4200 //3950
-#define HIST_SIZE 20
-#define HIST_INT 5000
-#define SENSOR_READ_INT 1500
-#define MQTT_PUBLISH_PERIOD 10000
-
-Adafruit_ADS1115 g_ads (0x49); /* Use this for the 16-bit version */
+// Settings imported from /config.json into the NVS record
+#define CONFIG_JSON_CAPACITY 4096
+// Where /config.json is moved while it is imported
+#define CONFIG_IMPORT_PATH "/config.import"
+#define NVS_NAMESPACE "bbqmaster"
+// Sensor acquisition task. On the application core with loop (), away from the Wi-Fi and lwIP
+// tasks on core 0; its priority above loop () lets it cut into the network work when it is due.
+#define SENSOR_TASK_CORE 1
+#define SENSOR_TASK_PRIORITY 5
+#define SENSOR_TASK_STACK 6144
+
+AdsSampler g_adsSampler (0x49); /* ADS1115 16-bit ADC */
 AsyncWebServer g_server (80);
+AsyncEventSource g_events ("/events");
 OneWire g_oneWireTemp (17);
-DallasTemperature g_thermoCouples (&g_oneWireTemp);
 DNSServer dns;
 
 // MAX31850KATB+-ND sensors
-DeviceAddress g_sensor1 = {0x3B, 0x45, 0x21, 0x18, 0x00, 0x00, 0x00, 0x2D};
-DeviceAddress g_sensor2 = {0x3B, 0xF1, 0x22, 0x18, 0x00, 0x00, 0x00, 0xB8};
-DeviceAddress g_sensor3 = {0x3B, 0xF3, 0x22, 0x18, 0x00, 0x00, 0x00, 0xD6};
-DeviceAddress g_sensor4 = {0x3B, 0x43, 0x21, 0x18, 0x00, 0x00, 0x00, 0x9F};
-
-double g_batteryVoltage = 0;
-double g_batteryLevel = 0;
-short g_maxWorkingSensors = 0;
-bool firmwareUpdating = false;
-bool g_shouldSaveConfig = false;
+const DeviceAddress g_sensorAddresses[4] = {
+   {0x3B, 0x45, 0x21, 0x18, 0x00, 0x00, 0x00, 0x2D},
+   {0x3B, 0xF1, 0x22, 0x18, 0x00, 0x00, 0x00, 0xB8},
+   {0x3B, 0xF3, 0x22, 0x18, 0x00, 0x00, 0x00, 0xD6},
+   {0x3B, 0x43, 0x21, 0x18, 0x00, 0x00, 0x00, 0x9F}};
+DallasThermocouples g_dallas (&g_oneWireTemp, g_sensorAddresses);
+
+ArduinoClock g_arduinoClock;
+AnalogBattery g_analogBattery (BATTERY_V_PIN, BAT_RATIO);
+LedcFan g_ledcFan (FAN_PWM_PIN, FAN_LEDC_CHANNEL);
+ArduinoFileSystem g_spiffs (SPIFFS);
+EspWifi g_espWifi;
+// Config record and cached access point
+Preferences g_prefs;
 
-// Host name of the device.
-const char* g_hostName= "BBQ_Master";
+bool g_shouldSaveConfig = false;
+// The config portal ran since power up, it is offered once for a network that cannot be joined
+bool g_portalOpened = false;
+// Pit control settings changed from the web page, saved by the loop
+std::atomic<bool> g_pidChanged (false);
+// NTP set the clock, the offset for the sensor task is taken by the loop
+std::atomic<bool> g_ntpSynced (false);
 
 // MQTT stuff
 WiFiClient g_espClient;
 PubSubClient g_mqttClient(g_espClient);
+PubSubTransport g_pubSubTransport (g_mqttClient);
 
 // MQTT configs
-#define MQTT_HOME_ASSISTANT_DISCOVERY_PREFIX  "homeassistant"
 char g_mqtt_server[40] = "example.com";
 char g_mqtt_port[6] = "1883";
-char g_topicMQTTHeader[22 + 11];
-char g_uniqueId[5];
-
-// Representation of one temperature probe
-struct Sensor
-{
-   // Availability flag
-   bool m_ind;
-   // Temperature
-   double m_tempF;
-   // Name of the sensor
-   String m_name;
-
-public:
-   Sensor (bool ind, double tempF, String name) : m_ind (ind), m_tempF (tempF), m_name (name) {}
-   Sensor () : m_ind (false), m_tempF (0), m_name ("N/A") {}
-};
-
-// Data point completed with multiple probes
-struct DataPoint
-{
-   int m_time;
-   Sensor m_sensors[8];
-};
 
-// Current data set
-DataPoint g_lastSenUpdate;
+static const char* const s_filterModes[] = {"none", "ema", "kalman"};
 
-// Saving the history for the histogram
-SimpleList<DataPoint> g_tempHist;
+// Copy of the history on flash, replayed at boot
+CookLog g_cookLog (g_spiffs);
 
 // Handle telnet debuging
 #if defined(DEBUG_TELNET)
@@ -131,11 +115,19 @@ void handleTelnet(void) {
 }
 #endif
 
+// Have the sensor task write out the pending cook log page, waiting at most until the next history point.
+void flushCookLog ()
+{
+   g_cookLogFlush = true;
+   for (int i = 0; g_cookLogFlush && i < HIST_INT / SENSOR_TASK_PERIOD + 2; i++)
+      delay (SENSOR_TASK_PERIOD);
+}
+
 // Setup OTA
 void setupOTA(const char *hostname)
 {
   // Config OTA updates
-  ArduinoOTA.onStart([]() { DEBUG_PRINTLN("Start. Disbling regular work!"); firmwareUpdating=true;});
+  ArduinoOTA.onStart([]() { DEBUG_PRINTLN("Start. Disbling regular work!"); firmwareUpdating=true; flushCookLog ();});
   ArduinoOTA.onEnd([]() { DEBUG_PRINTLN("\nEnd"); firmwareUpdating = false;});
   ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) { DEBUG_PRINT_WITH_FMT("Progress: %u%%\r", (progress / (total / 100))); });
   ArduinoOTA.onError([](ota_error_t error) {
@@ -151,29 +143,29 @@ void setupOTA(const char *hostname)
   ArduinoOTA.begin();  
 }
 
-// Saving the config to SPIFF
-void saveConfig () {
-  DynamicJsonDocument json (256);
-  json["mqtt_server"] = g_mqtt_server;
-  json["mqtt_port"] = g_mqtt_port;
-
-  File configFile = SPIFFS.open("/config.json", "w");
-  if (!configFile) {
-    DEBUG_PRINTLN("failed to open config file for writing");
-  }
-  serializeJson(json, configFile);
-  configFile.close();
+// Save the config record to NVS.
+void saveConfig ()
+{
+   StoredConfig config;
+   captureConfig (config);
+   strncpy (config.m_mqttServer, g_mqtt_server, CONFIG_MQTT_SERVER_MAX - 1);
+   strncpy (config.m_mqttPort, g_mqtt_port, CONFIG_MQTT_PORT_MAX - 1);
+   uint8_t record[CONFIG_RECORD_SIZE];
+   size_t len = encodeConfig (config, record, sizeof (record));
+   if (g_prefs.putBytes ("config", record, len) != len)
+      DEBUG_PRINTLN("failed to save the config");
 }
 
-// Reading the config from SPIFF
-void readConfig ()
+// Read a JSON config file into the settings. Returns false when there is none or it does not parse.
+bool readJsonConfig (const char* path)
 {
+  bool found = false;
   if (SPIFFS.begin()) {
       DEBUG_PRINTLN("SPIFFS started");
-      if (SPIFFS.exists("/config.json")) {
+      if (SPIFFS.exists(path)) {
          //file exists, reading and loading
          DEBUG_PRINTLN("reading config file");
-         File configFile = SPIFFS.open("/config.json", "r");
+         File configFile = SPIFFS.open(path, "r");
          if (configFile) {
             DEBUG_PRINTLN("opened config file");
             size_t size = configFile.size();
@@ -181,32 +173,130 @@ void readConfig ()
             std::unique_ptr<char[]> buf(new char[size]);
 
             configFile.readBytes(buf.get(), size);
-            DynamicJsonDocument json (size+1);
-            DeserializationError error = deserializeJson(json, buf.get());
+            DynamicJsonDocument json (CONFIG_JSON_CAPACITY);
+            DeserializationError error = deserializeJson(json, buf.get(), size);
             if (!error) {
+               found = true;
                DEBUG_PRINT("parsed json config: ");
                serializeJson(json, Serial);
                DEBUG_PRINTLN();
-               strcpy(g_mqtt_server, json["mqtt_server"]);
-               strcpy(g_mqtt_port, json["mqtt_port"]);
+               // Missing keys keep the current values.
+               const char* server = json["mqtt_server"] | "";
+               if (*server)
+                  strlcpy(g_mqtt_server, server, sizeof(g_mqtt_server));
+               const char* port = json["mqtt_port"] | "";
+               if (*port)
+                  strlcpy(g_mqtt_port, port, sizeof(g_mqtt_port));
+
+               // Steinhart-Hart coefficients of each probe, the defaults stay for the missing ones.
+               JsonArray ntc = json["ntc"];
+               for (int i = 0; i < NTC_CHANNELS && i < (int)ntc.size (); i++)
+               {
+                  g_ntcCalibration[i].m_a = ntc[i]["a"] | g_ntcCalibration[i].m_a;
+                  g_ntcCalibration[i].m_b = ntc[i]["b"] | g_ntcCalibration[i].m_b;
+                  g_ntcCalibration[i].m_c = ntc[i]["c"] | g_ntcCalibration[i].m_c;
+               }
+
+               // Acquisition filters
+               g_adsOversampling = json["oversample"] | g_adsOversampling;
+               PowerMode power;
+               if (parsePowerMode (json["power"] | "auto", power))
+                  g_samplePlanner.setSetting (power);
+               JsonArray filter = json["filter"];
+               for (int i = 0; i < SENSOR_COUNT && i < (int)filter.size (); i++)
+               {
+                  g_filterConfig[i].m_median = filter[i]["median"] | g_filterConfig[i].m_median;
+                  const char* mode = filter[i]["mode"] | s_filterModes[g_filterConfig[i].m_mode];
+                  for (int m = 0; m < 3; m++)
+                     if (strcmp (mode, s_filterModes[m]) == 0)
+                        g_filterConfig[i].m_mode = (FilterMode)m;
+                  g_filterConfig[i].m_alpha = filter[i]["alpha"] | g_filterConfig[i].m_alpha;
+                  g_filterConfig[i].m_q = filter[i]["q"] | g_filterConfig[i].m_q;
+                  g_filterConfig[i].m_r = filter[i]["r"] | g_filterConfig[i].m_r;
+               }
+
+               // Pit control
+               JsonObject pid = json["pid"];
+               if (!pid.isNull ())
+               {
+                  PidConfig pidConfig = defaultPidConfig ();
+                  const char* channel = pid["n"] | g_channelNames[pidConfig.m_channel];
+                  for (int i = 0; i < SENSOR_COUNT; i++)
+                     if (strcmp (channel, g_channelNames[i]) == 0)
+                        pidConfig.m_channel = i;
+                  pidConfig.m_kp = pid["kp"] | pidConfig.m_kp;
+                  pidConfig.m_ki = pid["ki"] | pidConfig.m_ki;
+                  pidConfig.m_kd = pid["kd"] | pidConfig.m_kd;
+                  pidConfig.m_lidDrop = pid["lid_drop"] | pidConfig.m_lidDrop;
+                  pidConfig.m_lidHold = pid["lid_hold"] | pidConfig.m_lidHold;
+                  g_pitController.configure (pidConfig);
+                  g_pitController.setSetpoint (pid["setpoint"] | PID_DEFAULT_SETPOINT);
+                  g_pitController.setEnabled (pid["enabled"] | false);
+               }
+
+               // Alarm rules
+               JsonArray alarms = json["alarms"];
+               for (int i = 0; i < (int)alarms.size (); i++)
+               {
+                  AlarmRule rule;
+                  if (makeAlarmRule (alarms[i]["type"], alarms[i]["n"], alarms[i]["value"] | 0.0f, alarms[i]["hyst"] | ALARM_DEFAULT_HYSTERESIS / 10.0f,
+                                     alarms[i]["window"] | ALARM_DEFAULT_WINDOW, rule))
+                     g_alarms.setRule (alarms[i]["rule"] | i, rule);
+               }
 
             } else {
                DEBUG_PRINTLN("failed to load json config");
-               saveConfig ();
             }
          }
       }
-      else
-         saveConfig ();
   } else {
       DEBUG_PRINTLN("Formatting the flash...");
       SPIFFS.format();
       DEBUG_PRINTLN("SPIFFS Mount failed");
   }
+  return found;
+}
+
+// Load the config record from NVS: a copy and a CRC, no file system or JSON on the boot path.
+void readConfig ()
+{
+   uint8_t record[CONFIG_RECORD_SIZE];
+   size_t len = g_prefs.getBytesLength ("config") == sizeof (record) ? g_prefs.getBytes ("config", record, sizeof (record)) : 0;
+   StoredConfig config;
+   if (!decodeConfig (record, len, config))
+   {
+      DEBUG_PRINTLN("No config record, using the defaults");
+      return;
+   }
+   applyConfig (config);
+   strcpy (g_mqtt_server, config.m_mqttServer);
+   strcpy (g_mqtt_port, config.m_mqttPort);
+}
+
+// A /config.json uploaded with the file system image, or left by older firmware, replaces the
+// record. Sampling stops while it is read, then the board restarts with the new settings.
+// The file is moved aside first, so one that crashes the parser is only tried once.
+void importJsonConfig ()
+{
+   SPIFFS.remove (CONFIG_IMPORT_PATH);
+   if (!SPIFFS.exists ("/config.json"))
+      return;
+   if (!SPIFFS.rename ("/config.json", CONFIG_IMPORT_PATH))
+   {
+      SPIFFS.remove ("/config.json");
+      return;
+   }
+   firmwareUpdating = true;
+   delay (2 * SENSOR_TASK_PERIOD);
+   if (readJsonConfig (CONFIG_IMPORT_PATH))
+      saveConfig ();
+   SPIFFS.remove (CONFIG_IMPORT_PATH);
+   ESP.restart ();
 }
 
-// Manages wifi portal
-void manageWifi (bool reset_config = false)
+// Config portal, for a device without a WiFi network or one that cannot join it. Blocks the
+// setup until it is done or times out, the sensor task keeps sampling.
+void runConfigPortal ()
 {
   // The extra parameters to be configured (can be either global or just in the setup)
   AsyncWiFiManagerParameter custom_mqtt_server("server", "MQTT server", g_mqtt_server, 39);
@@ -221,11 +311,8 @@ void manageWifi (bool reset_config = false)
   wifiManager.setSaveConfigCallback([](){
      g_shouldSaveConfig = true;
   });
-  
-  if (reset_config)
-    wifiManager.startConfigPortal(g_hostName);
-  else
-    wifiManager.autoConnect(g_hostName); // This will hold the connection till it get a connection
+
+  wifiManager.startConfigPortal(g_hostName);
 
   if (g_shouldSaveConfig)
   {
@@ -236,350 +323,347 @@ void manageWifi (bool reset_config = false)
   }
 }
 
-// Calculate NTC temp using steinhart equation
-float calculateNTCTemp (int16_t adcValue)
+// Services started once the network is up
+void onWifiOnline ()
 {
-  if (adcValue < NTC_MAX_ADC)
-  {
-    float steinhart;
-    // Resistance calculation
-    steinhart = (NTC_MAX_ADC / adcValue) - 1;
-    steinhart = NTC_REF_RES / steinhart;
-
-    // Rest of the steinhart equation
-    steinhart = steinhart / NTC_SMP_RES;
-    steinhart = log(steinhart);                  // ln(R/Ro)
-    steinhart /= NTC_BCOEFFICIENT;                   // 1/B * ln(R/Ro)
-    steinhart += 1.0 / (NTC_SMP_TMP + 273.15); // + (1/To)
-    steinhart = 1.0 / steinhart;                 // Invert
-    steinhart -= 273.15;
-    return DallasTemperature::toFahrenheit(steinhart);
-  }
-  else
-    return 0.0;
+   // OTA stuff
+   setupOTA (g_hostName);
+
+   // Real time
+   NTP.onNTPSyncEvent ([](NTPSyncEvent_t error) {
+      if (error)
+      {
+         if (error == noResponse)
+            DEBUG_PRINTLN("NTP server not reachable");
+         else if (error == invalidAddress)
+            DEBUG_PRINTLN("Invalid NTP server address");
+      }
+      else
+      {
+         DEBUG_PRINT("Got NTP time: ");
+         DEBUG_PRINTLN(NTP.getTimeDateString (NTP.getLastNTPSync ()));
+         g_ntpSynced = true;
+      }
+   });
+   // NTP Server, time offset, daylight
+   NTP.begin ("pool.ntp.org", -1, true);
+   NTP.setInterval (240);
 }
 
-// Check whether temperature is valid.
-bool isValidTemp (float temp)
+// Hand the wall clock to the sensor task as an offset from the uptime. now () and the uptime
+// tick over at different times, so the offset is only taken after an NTP sync and never goes
+// back: the history and cook log stamps must not repeat or decrease.
+void shareWallClock ()
 {
-   if (temp <= 32.0 || temp > 1000.00)
-      return false;
-   else
-      return true;
+   int32_t offset = (int32_t)(now () - millis () / 1000);
+   if (offset > g_epochOffset.load ())
+      g_epochOffset = offset;
+   markBoot (BOOT_TIME, millis ());
 }
 
-// Battery precentage calculator
-float batteryLevel()
+// Turn a request away while too many responses are in flight or there is no memory for one.
+void sendBusy (AsyncWebServerRequest *request)
 {
-   g_batteryVoltage = analogRead (BATTERY_V_PIN) * BAT_RATIO;
-
-   float output = 0.0;             //output value
-   const float battery_max = 4.20; //maximum voltage of battery
-   const float battery_min = 3.5;  //minimum voltage of battery before shutdown
-
-   output = ((g_batteryVoltage - battery_min) / (battery_max - battery_min)) * 100;
-   if (output < 100)
-      return output;
-   else
-      return 100.0f;
+   AsyncWebServerResponse *response = request->beginResponse (503);
+   response->addHeader ("Retry-After", RESPONSE_RETRY_AFTER);
+   request->send (response);
 }
 
-
-// Read all the sensors
-void readSensors ()
+// Value of the optional "since" parameter of the history endpoints.
+int32_t sinceParam (AsyncWebServerRequest *request)
 {
-   int16_t adc0, adc1, adc2, adc3;
-   float ntc0, ntc1, ntc2, ntc3;
-   // NTC readings
-   adc0 = g_ads.readADC_SingleEnded (0);
-   adc1 = g_ads.readADC_SingleEnded (1);
-   adc2 = g_ads.readADC_SingleEnded (2);
-   adc3 = g_ads.readADC_SingleEnded (3);
-
-   ntc0 = calculateNTCTemp (adc0);
-   ntc1 = calculateNTCTemp (adc1);
-   ntc2 = calculateNTCTemp (adc2);
-   ntc3 = calculateNTCTemp (adc3);
-
-   float tcp0, tcp1, tcp2, tcp3;
-   tcp0 = g_thermoCouples.getTempF (g_sensor1);
-   tcp1 = g_thermoCouples.getTempF (g_sensor2);
-   tcp2 = g_thermoCouples.getTempF (g_sensor3);
-   tcp3 = g_thermoCouples.getTempF (g_sensor4);
-
-   long int tps = now ();
-   if (tps > 0)
-   {
-      g_lastSenUpdate.m_time = tps;
-      g_lastSenUpdate.m_sensors[0] = Sensor (isValidTemp (ntc0), ntc0, "NTC1");
-      g_lastSenUpdate.m_sensors[1] = Sensor (isValidTemp (ntc1), ntc1, "NTC2");
-      g_lastSenUpdate.m_sensors[2] = Sensor (isValidTemp (ntc2), ntc2, "NTC3");
-      g_lastSenUpdate.m_sensors[3] = Sensor (isValidTemp (ntc3), ntc3, "NTC4");
-
-      // Thermocouple readings
-      g_lastSenUpdate.m_sensors[4] = Sensor (isValidTemp (tcp0), tcp0, "TC1");
-      g_lastSenUpdate.m_sensors[5] = Sensor (isValidTemp (tcp1), tcp1, "TC2");
-      g_lastSenUpdate.m_sensors[6] = Sensor (isValidTemp (tcp2), tcp2, "TC3");
-      g_lastSenUpdate.m_sensors[7] = Sensor (isValidTemp (tcp3), tcp3, "TC4");
-   }
-
-   g_batteryLevel = batteryLevel ();
-
-   // Request thermo couple data
-   g_thermoCouples.setWaitForConversion(false);  // makes it async
-   g_thermoCouples.requestTemperatures();
-   g_thermoCouples.setWaitForConversion(true);
-
-#ifdef DEBUG_EXTRA_OUTPUT
-   DEBUG_PRINT("AIN0: ");
-   DEBUG_PRINTLN(adc0);
-
-   DEBUG_PRINT("Temp NTC 0 F: ");
-   DEBUG_PRINTLN(g_lastSenUpdate.m_sensors[0].m_tempF);
-   DEBUG_PRINT("Temp NTC 1 F: ");
-   DEBUG_PRINTLN(g_lastSenUpdate.m_sensors[1].m_tempF);
-   DEBUG_PRINT("Temp NTC 2 F: ");
-   DEBUG_PRINTLN(g_lastSenUpdate.m_sensors[2].m_tempF);
-   DEBUG_PRINT("Temp NTC 3 F: ");
-   DEBUG_PRINTLN(g_lastSenUpdate.m_sensors[3].m_tempF);
-
-   DEBUG_PRINT("Temp 0 F: ");
-   DEBUG_PRINTLN(tcp0);
-   DEBUG_PRINT("Temp 1 F: ");
-   DEBUG_PRINTLN(tcp1);
-   DEBUG_PRINT("Temp 2 F: ");
-   DEBUG_PRINTLN(tcp2);
-   DEBUG_PRINT("Temp 3 F: ");
-   DEBUG_PRINTLN(tcp3);
-
-#endif
+   if (request->hasParam ("since"))
+      return request->getParam ("since")->value ().toInt ();
+   return INT32_MIN;
 }
 
-// Send the last sensor data reading in json format.
-DynamicJsonDocument jsonSensorData ()
+// Send a document from the response cache. Serialized once per data change, the body is
+// shared by every client asking for it and freed once the last response is sent.
+void sendCached (AsyncWebServerRequest *request, CachedDocument doc, int32_t since, const char* type)
 {
-   DynamicJsonDocument json(1024);  // Current JSON static buffer
-   json["bat"] = g_batteryLevel;
-   json["t"] = g_lastSenUpdate.m_time;
-   JsonArray sensors = json.createNestedArray ("sensors");
-
-   for (int i = 0; i < 8; ++i)
+   std::shared_ptr<ResponseTicket> ticket = ResponseTicket::take ();
+   BodyRef body = ticket ? g_responseCache.get (doc, since) : BodyRef ();
+   if (!body)
    {
-      JsonObject tempS = sensors.createNestedObject ();
-      tempS["i"] = g_lastSenUpdate.m_sensors[i].m_ind;
-      tempS["v"] = int(g_lastSenUpdate.m_sensors[i].m_tempF);
-      tempS["n"] = g_lastSenUpdate.m_sensors[i].m_name;
+      sendBusy (request);
+      return;
    }
-
-   return json;
+   AsyncWebServerResponse *response = request->beginResponse (type, body->length (), [body, ticket](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      return body->read (index, buffer, maxLen);
+   });
+   request->send (response);
 }
 
 // Send the last sensor data reading in json format.
 void sendMeasures (AsyncWebServerRequest *request)
 {
-   char tempJson[1024];
-   serializeJson(jsonSensorData (), tempJson);
-   request->send (200, "application/json", tempJson);  // Send history data to the web client
+   countMetric (g_httpRequests[HTTP_MEASURES]);
+   sendCached (request, DOC_MEASURES, 0, "application/json");
 }
 
-// Send the history in JSON format.
+// Push the last sensor data reading to every browser subscribed to /events.
+void pushMeasures ()
+{
+   if (g_events.count () == 0)
+      return;
+   // Serialized once and shared by all the subscribers.
+   char tempJson[SENSOR_JSON_MAX];
+   formatSensorJson (tempJson, SENSOR_JSON_MAX);
+   g_events.send (tempJson, "measures", millis ());
+}
+
+// Send the history in JSON format. Only points newer than the optional "since" parameter are sent.
 void sendHistory (AsyncWebServerRequest *request)
 {
+   countMetric (g_httpRequests[HTTP_HISTORY]);
    DEBUG_PRINTLN("Sending History");
-   DynamicJsonDocument json(5560 + 100);  // Current JSON static buffer
-   JsonArray hist = json.createNestedArray ("hist");
-
-   for (SimpleList<DataPoint>::iterator it = g_tempHist.begin (); it != g_tempHist.end (); ++it)
+   int32_t since = sinceParam (request);
+   // The polls for the last few points are cached, the whole cook is streamed.
+   if (historyJsonCacheable (since))
    {
-      JsonObject item = hist.createNestedObject ();
-      item["t"] = it->m_time;
-      JsonArray jsonSens = item.createNestedArray ("sensors");
+      sendCached (request, DOC_HISTORY_JSON, since, "application/json");
+      return;
+   }
 
-      for (int i = 0; i < 8; i++)
-      {
-         if (it->m_sensors[i].m_ind)
-         {
-            JsonObject sensor = jsonSens.createNestedObject ();
-            sensor["n"] = it->m_sensors[i].m_name;
-            sensor["v"] = int(it->m_sensors[i].m_tempF);  // Lose the decimal places for space saving.
-         }
-      }
+   std::shared_ptr<ResponseTicket> ticket = ResponseTicket::take ();
+   if (!ticket)
+   {
+      sendBusy (request);
+      return;
    }
-   char tempJson[5560 + 100];
-   serializeJson(json, tempJson); // Export JSON object as a String
-   request->send (200, "application/json", tempJson);  // Send history data to the web client
+   std::shared_ptr<HistoryJsonStream> stream (new HistoryJsonStream ());
+   stream->m_lastTime = since;
+
+   // Generated as the TCP window opens, so memory use does not depend on the history length.
+   AsyncWebServerResponse *response = request->beginChunkedResponse ("application/json", [stream, ticket](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      size_t len = fillHistoryChunk (*stream, buffer, maxLen);
+      return len == HIST_CHUNK_RETRY ? RESPONSE_TRY_AGAIN : len;
+   });
+   request->send (response);  // Send history data to the web client
 }
 
-// Add a data point to the history
-void addDataPointToHistory ()
+// Send the history in the compact binary format described in HistoryCodec.h.
+void sendHistoryBin (AsyncWebServerRequest *request)
 {
-  short validSensors = 0;
-  bool validData = false;
-  for (int i = 0; i < 8; i++)
-  {
-     if (g_lastSenUpdate.m_sensors[i].m_ind)
-     {
-       validSensors++;
-       validData = true;
-     }
-  }
-  // Clear the history if the count does not match.
-  if (g_maxWorkingSensors != validSensors)
-  {
-    g_tempHist.clear ();
-    g_maxWorkingSensors = validSensors;
-  }
-
-  if (validData)
-  {
-   g_tempHist.push_back (g_lastSenUpdate);
-   if (g_tempHist.size () > HIST_SIZE)
-   {
-      g_tempHist.erase (g_tempHist.begin ());
-   }
-  }
+   countMetric (g_httpRequests[HTTP_HISTORY_BIN]);
+   sendCached (request, DOC_HISTORY_BIN, sinceParam (request), "application/octet-stream");
+}
 
-#ifdef DEBUG_EXTRA_OUTPUT
-   DEBUG_PRINT ("size g_tempHist ");
-   DEBUG_PRINTLN(g_tempHist.size ());
-#endif
+// Send the cook log stored on flash.
+void sendCookLog (AsyncWebServerRequest *request)
+{
+   countMetric (g_httpRequests[HTTP_COOK_LOG]);
+   // The segments as the request starts, the sensor task keeps logging meanwhile.
+   CookLogSegments segments = g_cookLog.segments ();
+   AsyncWebServerResponse *response = request->beginResponse ("application/octet-stream", CookLog::size (segments), [segments](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      return g_cookLog.read (segments, index, buffer, maxLen);
+   });
+   response->addHeader ("Content-Disposition", "attachment; filename=cook.log");
+   request->send (response);
 }
 
-// Publish the MQTT payload.
-void publishToMQTT(const char* p_topic,const char* p_payload) {
-  if (g_mqttClient.publish(p_topic, p_payload, true)) {
-    DEBUG_PRINT(F("INFO: MQTT message published successfully, topic: "));
-    DEBUG_PRINT(p_topic);
-    DEBUG_PRINT(F(", payload: "));
-    DEBUG_PRINTLN(p_payload);
-  } else {
-    DEBUG_PRINTLN(F("ERROR: MQTT message not published, either connection lost, or message too large. Topic: "));
-    DEBUG_PRINT(p_topic);
-    DEBUG_PRINT(F(" , payload: "));
-    DEBUG_PRINTLN(p_payload);
-  }
+// Send the runtime counters in the Prometheus text format.
+void sendMetrics (AsyncWebServerRequest *request)
+{
+   countMetric (g_httpRequests[HTTP_METRICS]);
+   HeapStats heap;
+   heap.m_free = ESP.getFreeHeap ();
+   heap.m_minFree = ESP.getMinFreeHeap ();
+   heap.m_largestBlock = ESP.getMaxAllocHeap ();
+   // Web handlers all run on the async TCP task, one at a time.
+   static char text[METRICS_TEXT_MAX];
+   formatMetrics (text, METRICS_TEXT_MAX, heap, millis () / 1000);
+   request->send (200, "text/plain; version=0.0.4", text);
 }
 
-// Function that publishes birthMessage
-void publishAvailability() 
+// Send the alarm rules and whether they are on.
+void sendAlarms (AsyncWebServerRequest *request)
 {
-   char topicAvailability[22 + 11 + 10];
-   snprintf(topicAvailability, 22 + 11 + 10, "%s/avail",g_topicMQTTHeader);
-   g_mqttClient.publish(topicAvailability, "online", true);
+   countMetric (g_httpRequests[HTTP_ALARMS]);
+   // Web handlers all run on the async TCP task, one at a time.
+   static char text[ALARM_RULES_JSON_MAX];
+   formatAlarmRules (text, ALARM_RULES_JSON_MAX, g_alarms);
+   request->send (200, "application/json", text);
 }
 
-// Function that publishes availability of each sensor
-void publishSensorAvailability() 
+// Set or remove (type "none") one alarm rule. The loop applies it and saves the config.
+void setAlarm (AsyncWebServerRequest *request)
 {
-   for (int i = 0; i < 8; i++)
+   countMetric (g_httpRequests[HTTP_ALARMS]);
+   if (!request->hasParam ("rule", true) || !request->hasParam ("type", true))
    {
-      char availabilitySensorTopic[22 + 11 + 20];
-      snprintf(availabilitySensorTopic, 22 + 11 + 20, "%s/%s/avail", g_topicMQTTHeader, g_lastSenUpdate.m_sensors[i].m_name.c_str());
-      if (g_lastSenUpdate.m_sensors[i].m_ind)
-         publishToMQTT(availabilitySensorTopic, "online");
-      else
-         publishToMQTT(availabilitySensorTopic, "offline");
+      request->send (400);
+      return;
+   }
+   AlarmEdit edit;
+   long index = request->getParam ("rule", true)->value ().toInt ();
+   String type = request->getParam ("type", true)->value ();
+   edit.m_index = index;
+   edit.m_remove = type == "none";
+   if (index < 0 || index >= ALARM_MAX)
+   {
+      request->send (400);
+      return;
+   }
+   if (!edit.m_remove)
+   {
+      String channel = request->hasParam ("n", true) ? request->getParam ("n", true)->value () : String ();
+      float value = request->hasParam ("value", true) ? request->getParam ("value", true)->value ().toFloat () : 0;
+      float hysteresis = request->hasParam ("hyst", true) ? request->getParam ("hyst", true)->value ().toFloat () : ALARM_DEFAULT_HYSTERESIS / 10.0f;
+      int window = request->hasParam ("window", true) ? request->getParam ("window", true)->value ().toInt () : ALARM_DEFAULT_WINDOW;
+      if (!makeAlarmRule (type.c_str (), channel.c_str (), value, hysteresis, window, edit.m_rule))
+      {
+         request->send (400);
+         return;
+      }
    }
+   request->send (g_alarmEdits.push (edit) ? 200 : 503);
+}
+
+// Send the pit control state.
+void sendPid (AsyncWebServerRequest *request)
+{
+   countMetric (g_httpRequests[HTTP_PID]);
+   char json[128];
+   snprintf (json, sizeof (json), "{\"enabled\":%s,\"n\":\"%s\",\"setpoint\":%.1f,\"fan\":%d,\"lid\":%s}", g_pitController.enabled () ? "true" : "false",
+             g_channelNames[g_pitController.channel ()], (double)g_pitController.setpoint (), (int)(g_pitController.duty () * 100 + 0.5f),
+             g_pitController.lidOpen () ? "true" : "false");
+   request->send (200, "application/json", json);
 }
 
-// Publish MQTT discovery config to let hassio auto discover the sensors.
-void publishDiscovery(void) 
+// Change the pit control from the web page: "enabled" (0/1), "setpoint" and "n" (pit probe).
+void setPid (AsyncWebServerRequest *request)
 {
-   // Create json config for battery level.
-   char uniqueId[15];
-   snprintf(uniqueId, 15, "%sbat", g_uniqueId);
-   char batDiscoverTopic[22 + 11 + 10];
-   snprintf(batDiscoverTopic, 22 + 11 + 10, "%s/bat/config", g_topicMQTTHeader);
-
-   StaticJsonDocument<500> root;
-   root["~"] = g_topicMQTTHeader;
-   root["dev_cla"] = "battery";
-   root["uniq_id"] = uniqueId;
-   root["name"] = "Battery";
-   root["avty_t"] = "~/avail";
-   root["stat_t"] = "~/state";
-   root["unit_of_meas"] = "%";
-   root["val_tpl"] = "{{value_json.bat}}";
-   root["device"]["ids"] = g_uniqueId;
-   root["device"]["name"] = g_hostName;
-   root["device"]["mf"] = "DIY";
-   root["device"]["mdl"] = "DIY";
-   root["device"]["sw"] = "1.1";
-   char outgoingJsonBuffer[500];
-   serializeJson(root, outgoingJsonBuffer);
-   publishToMQTT(batDiscoverTopic, outgoingJsonBuffer);
-
-   // Create json config for each sensor.
-   for (int i = 0; i < 8; i++)
+   countMetric (g_httpRequests[HTTP_PID]);
+   if (request->hasParam ("n", true))
+   {
+      String channel = request->getParam ("n", true)->value ();
+      int found = -1;
+      for (int i = 0; i < SENSOR_COUNT; i++)
+         if (channel == g_channelNames[i])
+            found = i;
+      if (found < 0)
+      {
+         request->send (400);
+         return;
+      }
+      g_pitController.setChannel (found);
+   }
+   if (request->hasParam ("setpoint", true))
    {
-      char sensorConfigTopic[22 + 11 + 20];
-      snprintf(sensorConfigTopic, 22 + 11 + 20, "%s/%s/config", g_topicMQTTHeader, g_lastSenUpdate.m_sensors[i].m_name.c_str());
-      char availabilitySensorTopic[15];
-      snprintf(availabilitySensorTopic, 15, "~/%s/avail", g_lastSenUpdate.m_sensors[i].m_name.c_str());
-
-      char sensorId[15];
-      snprintf(sensorId, 15, "%s%s", g_uniqueId, g_lastSenUpdate.m_sensors[i].m_name.c_str());
-      char sensorName[30];
-      snprintf(sensorName, 30, "%s Temperature.", g_lastSenUpdate.m_sensors[i].m_name.c_str());
-      String jsonTemplate = "{{value_json.sensors[" + String(i) + "].v}}";
-
-      StaticJsonDocument<500> sensorRoot;
-      sensorRoot["~"] = g_topicMQTTHeader;
-      sensorRoot["dev_cla"] = "temperature";
-      sensorRoot["uniq_id"] = sensorId;
-      sensorRoot["name"] = sensorName;
-      sensorRoot["avty_t"] = availabilitySensorTopic;
-      sensorRoot["stat_t"] = "~/state";
-      sensorRoot["unit_of_meas"] = "°F";
-      sensorRoot["val_tpl"] = jsonTemplate;
-      sensorRoot["exp_aft"] = MQTT_PUBLISH_PERIOD/1000 + 5; // Invalidate the data if there is no data for 15seconds.
-      sensorRoot["device"]["ids"] = g_uniqueId;
-      sensorRoot["device"]["name"] = g_hostName;
-      sensorRoot["device"]["mf"] = "DIY";
-      sensorRoot["device"]["mdl"] = "DIY";
-      sensorRoot["device"]["sw"] = "1.1";
-
-      char sensorDisBuffer[500];
-      serializeJson(sensorRoot, sensorDisBuffer);
-      publishToMQTT(sensorConfigTopic, sensorDisBuffer);
+      float setpoint = request->getParam ("setpoint", true)->value ().toFloat ();
+      if (!isValidTemp (setpoint))
+      {
+         request->send (400);
+         return;
+      }
+      g_pitController.setSetpoint (setpoint);
    }
+   if (request->hasParam ("enabled", true))
+      g_pitController.setEnabled (request->getParam ("enabled", true)->value ().toInt () != 0);
+   g_pidChanged = true;
+   sendPid (request);
 }
 
-// MQTT Connect.
-void connectToMqtt() 
+// Serves the gzipped pages and assets of the manifest built by scripts/build_www.py.
+class AssetHandler : public AsyncWebHandler
 {
-   DEBUG_PRINT("Connecting to MQTT with client id ");
-   String clientId = "BBQMaster_";
-   clientId += String(random(0xffff), HEX);
-   DEBUG_PRINT(clientId);
-   DEBUG_PRINTLN("...");
-   char topicAvailability[22 + 11 + 10];
-   snprintf(topicAvailability, 22 + 11 + 10, "%s/avail",g_topicMQTTHeader);
-
-   // Attempt to connect
-   if (g_mqttClient.connect(clientId.c_str(), "", "", topicAvailability, 0, true, "offline"))
+public:
+   bool canHandle (AsyncWebServerRequest *request) override
    {
-      publishAvailability();
-      publishDiscovery();
+      if (request->method () != HTTP_GET || !g_assets.find (request->url ().c_str ()))
+         return false;
+      // Headers are only kept when a handler asks for them.
+      request->addInterestingHeader ("If-None-Match");
+      return true;
    }
-   else
+
+   void handleRequest (AsyncWebServerRequest *request) override
    {
-      DEBUG_PRINT("Failed to connect to MQTT! ");
-      DEBUG_PRINT(g_mqttClient.state());
-      DEBUG_PRINTLN(" Trying again in 60 seconds");
+      countMetric (g_httpRequests[HTTP_STATIC]);
+      const Asset* asset = g_assets.find (request->url ().c_str ());
+      char etag[ASSET_ETAG_MAX];
+      asset->etag (etag);
+
+      AsyncWebServerResponse *response;
+      if (request->hasHeader ("If-None-Match") && asset->matches (request->header ("If-None-Match").c_str ()))
+      {
+         countMetric (g_httpNotModified);
+         response = request->beginResponse (304);
+      }
+      else
+      {
+         char path[ASSET_PATH_MAX];
+         asset->path (path);
+         File file = SPIFFS.open (path, "r");
+         if (!file)
+         {
+            request->send (404);
+            return;
+         }
+         // A .gz file served under another name gets Content-Encoding: gzip.
+         response = request->beginResponse (file, request->url (), asset->m_type);
+      }
+      response->addHeader ("ETag", etag);
+      response->addHeader ("Cache-Control", asset->cacheControl ());
+      request->send (response);
    }
+};
+
+AssetHandler g_assetHandler;
+
+// Let the subscribed browsers extend their chart.
+void pushHistPoint (const HistPoint& point)
+{
+   if (g_events.count () == 0)
+      return;
+   char tempJson[HIST_JSON_RECORD_MAX];
+   formatHistRecord (tempJson, HIST_JSON_RECORD_MAX, toRecord (point), true);
+   g_events.send (tempJson, "hist", millis ());
 }
 
-// Publish MQTT states
-void publishDataToMqtt()
+// Send an alarm that went on or off to MQTT and the browsers.
+void pushAlarm (const AlarmEvent& event)
 {
-   char topicState[22 + 11 + 10];
-   snprintf(topicState, 22 + 11 + 10, "%s/state", g_topicMQTTHeader);
+   char json[ALARM_EVENT_JSON_MAX];
+   formatAlarmEvent (json, ALARM_EVENT_JSON_MAX, event, g_alarms.rule (event.m_rule));
+   DEBUG_PRINT("Alarm: ");
+   DEBUG_PRINTLN(json);
+   if (g_mqttConnection.online ())
+      publishAlarm (json);
+   if (g_events.count ())
+      g_events.send (json, "alarm", millis ());
+}
+
+// Sensor acquisition task. Runs at a fixed period above loop () so network stalls do not disturb sampling.
+// Between sweeps it sleeps through the ticks with nothing to do, so the core can idle.
+void sensorTask (void *)
+{
+   DataPoint reading;
+   uint32_t ticks = 0;
+   TickType_t lastWake = xTaskGetTickCount ();
+   for (;;)
+   {
+      sensorTick (ticks, reading);
+      uint32_t step = 1 + sensorIdleTicks (ticks);
+      ticks += step;
+      vTaskDelayUntil (&lastWake, pdMS_TO_TICKS (SENSOR_TASK_PERIOD * step));
+   }
+}
 
-   char tempJson[1024];
-   serializeJson(jsonSensorData (), tempJson);
-   publishToMQTT (topicState, tempJson);
-   publishSensorAvailability();
+// Set when the build supports automatic light sleep, the CPU clock is then left to the power manager.
+bool g_autoLightSleep = false;
+
+// Radio and CPU settings of a power mode. Full keeps the radio listening all the time,
+// balanced lets the modem sleep between beacons, saver also skips beacons and slows the CPU.
+void applyPowerMode (PowerMode mode)
+{
+   esp_wifi_set_ps (mode == POWER_FULL ? WIFI_PS_NONE : mode == POWER_SAVER ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM);
+   if (!g_autoLightSleep)
+      setCpuFrequencyMhz (mode == POWER_SAVER ? 80 : 240);
+   g_mqttPublisher.setBatchPeriod (powerBatchPeriod (mode));
+   DEBUG_PRINT("Power mode ");
+   DEBUG_PRINTLN(g_powerModeNames[mode]);
 }
 
 void setup (void)
@@ -590,21 +674,57 @@ void setup (void)
    analogReadResolution (12);
    analogSetAttenuation (ADC_11db);  // For all pins
 
-   // Temp probes
-   g_ads.setGain (GAIN_ONE);  // 1x gain   +/- 4.096V  1 bit = 2mV      0.125mV
-   g_ads.begin ();
-   g_thermoCouples.begin ();
-   g_thermoCouples.requestTemperatures ();
-   g_thermoCouples.setResolution (12);
+   // Hardware used by the sensor and network code
+   g_clock = &g_arduinoClock;
+   g_probeAdc = &g_adsSampler;
+   g_thermoCouples = &g_dallas;
+   g_battery = &g_analogBattery;
+   g_fan = &g_ledcFan;
+   g_mqtt = &g_pubSubTransport;
+   g_wifi = &g_espWifi;
 
-   // Read mqtt config from SPIFF
+   // Temp probes
+   g_adsSampler.begin ();  // 1x gain   +/- 4.096V  1 bit = 2mV      0.125mV
+   g_thermoCouples->begin ();
+   g_fan->begin ();
+
+   // Read mqtt config, probe calibration, filters, pit control and alarms from NVS
+   g_prefs.begin (NVS_NAMESPACE);
+   defaultNtcCalibration ();
+   defaultFilterConfigs ();
    readConfig ();
+   buildNtcTables ();
+   applyFilterConfigs ();
+   markBoot (BOOT_CONFIG, millis ());
+
+   // Start sampling right away. Readings are stamped with the uptime until
+   // NTP answers, and the history points wait for the cook log to be restored.
+   g_holdHistory = true;
+   xTaskCreatePinnedToCore (sensorTask, "sensors", SENSOR_TASK_STACK, nullptr, SENSOR_TASK_PRIORITY, nullptr, SENSOR_TASK_CORE);
+
+   // Light sleep whenever both cores are idle, where the SDK was built with tickless idle.
+#if CONFIG_PM_ENABLE && CONFIG_FREERTOS_USE_TICKLESS_IDLE
+   esp_pm_config_esp32_t pm = {240, 80, true};
+   g_autoLightSleep = esp_pm_configure (&pm) == ESP_OK;
+#endif
 
-   // WIFI connect
+   // WIFI connect in the background, straight to the access point of the last connection.
    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
    WiFi.setHostname(g_hostName);
    WiFi.mode(WIFI_STA);
-   manageWifi ();
+   // No network stored yet, or the loop could not join the stored one and restarted for the portal.
+   bool portalRequested = g_prefs.getBool ("portal", false);
+   if (portalRequested)
+      g_prefs.remove ("portal");
+   if (!g_wifi->hasCredentials () || portalRequested)
+   {
+      runConfigPortal ();
+      g_portalOpened = true;
+   }
+   WifiAccessPoint ap;
+   if (g_prefs.getBytes ("ap", &ap, sizeof (ap)) != sizeof (ap))
+      ap.m_channel = 0;
+   g_wifiConnection.begin (ap, millis ());
 
    // Start the telnet server
 #if defined(DEBUG_TELNET)
@@ -614,9 +734,6 @@ void setup (void)
    DEBUG_PRINT("Starting ");
    DEBUG_PRINTLN(g_hostName);
 
-   // OTA stuff
-   setupOTA (g_hostName);
-
    // Get a unique ID using the mac address
    byte mac[7];
    WiFi.macAddress(mac);
@@ -626,48 +743,39 @@ void setup (void)
    // Web server stuff
    if (!SPIFFS.begin ())
       DEBUG_PRINTLN("SPIFFS Mount failed");  // Problème avec le stockage SPIFFS - Serious problem with SPIFFS
+   importJsonConfig ();
+
+   // Restore the cook that was running before the restart, then let the new points in.
+   g_cookLog.begin ();
+   g_cookLog.replay ([](const HistPoint& point) { g_tempHist.add (point); });
+   g_holdHistory = false;
+   markBoot (BOOT_HISTORY, millis ());
+
    g_server.on ("/measures.json", sendMeasures);
    g_server.on ("/history.json", sendHistory);
-
-   g_server.serveStatic ("/js/bootstrap.min.js", SPIFFS, "/js/bootstrap.min.js", "max-age=86400");
-   g_server.serveStatic ("/js/jquery.min.js", SPIFFS, "/js/jquery-3.3.1.min.js", "max-age=86400");
-   g_server.serveStatic ("/js/Chart.min.js", SPIFFS, "/js/Chart.min.js", "max-age=86400");
-   g_server.serveStatic ("/js/moment.min.js", SPIFFS, "/js/moment.min.js", "max-age=86400");
-   g_server.serveStatic ("/js/popper.min.js", SPIFFS, "/js/popper.min.js", "max-age=86400");
-   g_server.serveStatic ("/css/custom.css", SPIFFS, "/css/custom.css");
-   g_server.serveStatic ("/css/cover.css", SPIFFS, "/css/cover.css", "max-age=86400");
-   g_server.serveStatic ("/css/bootstrap.min.css", SPIFFS, "/css/bootstrap.min.css", "max-age=86400");
-   g_server.serveStatic ("/img/logo.png", SPIFFS, "/img/android-icon-72x72.png", "max-age=86400");
+   g_server.on ("/history.bin", sendHistoryBin);
+   g_server.on ("/cook.log", sendCookLog);
+   g_server.on ("/metrics", sendMetrics);
+   g_server.on ("/alarms", HTTP_GET, sendAlarms);
+   g_server.on ("/alarms", HTTP_POST, setAlarm);
+   g_server.on ("/pid", HTTP_GET, sendPid);
+   g_server.on ("/pid", HTTP_POST, setPid);
+   g_server.addHandler (&g_events);
+
+   // Pre-compressed web interface, with the plain files of data/ as the fallback.
+   if (g_assets.load (g_spiffs))
+      g_server.addHandler (&g_assetHandler);
+   else
+      DEBUG_PRINTLN("No asset manifest, serving uncompressed files");
    g_server.serveStatic ("/favicon.ico", SPIFFS, "/img/favicon.ico", "max-age=86400");
-   g_server.serveStatic ("/index.html", SPIFFS, "/index.html");
    g_server.serveStatic ("/", SPIFFS, "/").setDefaultFile("index.html");
    g_server.begin ();
    DEBUG_PRINTLN("HTTP server started");
 
-   // Real time
-   NTP.onNTPSyncEvent ([](NTPSyncEvent_t error) {
-      if (error)
-      {
-         if (error == noResponse)
-            DEBUG_PRINTLN("NTP server not reachable");
-         else if (error == invalidAddress)
-            DEBUG_PRINTLN("Invalid NTP server address");
-      }
-      else
-      {
-         DEBUG_PRINT("Got NTP time: ");
-         DEBUG_PRINTLN(NTP.getTimeDateString (NTP.getLastNTPSync ()));
-      }
-   });
-   // NTP Server, time offset, daylight
-   NTP.begin ("pool.ntp.org", -1, true);
-   NTP.setInterval (240);
-
    // MQTT Config
-   snprintf(g_topicMQTTHeader, 22 + 11, "%s/sensor/%s", MQTT_HOME_ASSISTANT_DISCOVERY_PREFIX, g_hostName);
-   g_mqttClient.setServer(g_mqtt_server, atoi(g_mqtt_port));
-   g_mqttClient.setBufferSize(512);
-   // connectToMqtt ();
+   setupMqttTopics ();
+   g_pubSubTransport.setServer(g_mqtt_server, atoi(g_mqtt_port));
+   g_mqttClient.setBufferSize(1024);
 
    randomSeed(micros());
 }
@@ -678,49 +786,88 @@ void loop (void)
 #if defined(DEBUG_TELNET)
    handleTelnet();
 #endif
+   unsigned long loopStartMicros = micros ();
    unsigned long currentMillis = millis ();  // Time now
+
+   // Join the WiFi network in the background, OTA and NTP start with the first connection.
+   static bool networkStarted = false;
+   g_wifiConnection.service (currentMillis);
+   if (g_wifiConnection.online () && !networkStarted)
+   {
+      onWifiOnline ();
+      networkStarted = true;
+   }
+   WifiAccessPoint ap;
+   if (g_wifiConnection.takeNewAccessPoint (ap))
+      g_prefs.putBytes ("ap", &ap, sizeof (ap));
+
+   // The stored network is not there any more, or its password changed. The portal shares the
+   // web server, which only takes it before the routes are set up, so restart into it. The
+   // sensor task samples through the portal and the cook log keeps the history.
+   if (!g_portalOpened && !firmwareUpdating && g_wifiConnection.failures () >= WIFI_PORTAL_FAILURES)
+   {
+      DEBUG_PRINTLN("WiFi network not joined, restarting into the config portal");
+      g_prefs.putBool ("portal", true);
+      flushCookLog ();
+      ESP.restart ();
+   }
+
    // Handle server requests
-   ArduinoOTA.handle ();
+   if (networkStarted)
+      ArduinoOTA.handle ();
 
    if (!firmwareUpdating)
    {
-      // Connect to MQTT server
-      if (!g_mqttClient.connected())
-      {
-         static unsigned long mqttConnectWaitPeriod;
-         if (currentMillis - mqttConnectWaitPeriod >= 30000)
-         {
-            mqttConnectWaitPeriod = currentMillis;
-            connectToMqtt ();
-         }
-      }   
-      g_mqttClient.loop();
+      // Connect to MQTT server in the background
+      if (g_wifiConnection.online ())
+         g_mqttConnection.service (currentMillis);
+      g_mqtt->loop ();
+
+      // timeStatus () runs the periodic NTP sync. Share the wall clock after each one.
+      if (networkStarted && timeStatus () != timeNotSet && g_ntpSynced.exchange (false))
+         shareWallClock ();
+
+      // Alarm rules and pit control changed from the web page, kept in the config.
+      bool alarmsChanged = g_alarms.applyEdits ();
+      if (alarmsChanged || g_pidChanged.exchange (false))
+         saveConfig ();
 
-      // Add a point to the history over time.
-      static unsigned long histPreviousMillis;
-      if (currentMillis - histPreviousMillis > HIST_INT)
+      // Take the readings completed by the sensor task.
+      if (takeReadings ())
       {
-         histPreviousMillis = currentMillis;
-         addDataPointToHistory ();
+         pushMeasures ();
+         g_mqttPublisher.offer (g_lastSenUpdate, g_batteryLevel, currentMillis);
       }
 
-      // Read the sensor data.
-      static unsigned long prevMilForInputRead;
-      if (currentMillis - prevMilForInputRead >= SENSOR_READ_INT)
-      {
-         prevMilForInputRead = currentMillis;
-         readSensors ();
-      }
+      HistPoint point;
+      while (g_histPoints.pop (point))
+         pushHistPoint (point);
 
-      // Send MQTT state.
-      static unsigned long prevMilForMqttPublish;
-      if (currentMillis - prevMilForMqttPublish >= MQTT_PUBLISH_PERIOD)
-      {
-         prevMilForMqttPublish = currentMillis;
-         if (g_mqttClient.connected())
-            publishDataToMqtt ();
-      }
+      AlarmEvent event;
+      while (g_alarms.popEvent (event))
+         pushAlarm (event);
+
+      // Send the MQTT states that are due.
+      if (g_mqttConnection.online ())
+         g_mqttPublisher.service ();
    }
+
+   // Follow the power mode the sensor task settled on.
+   static PowerMode appliedMode = POWER_MODE_COUNT;
+   PowerMode mode = g_samplePlanner.mode ();
+   if (mode != appliedMode)
+   {
+      applyPowerMode (mode);
+      appliedMode = mode;
+   }
+
+   // Keep track of how long an iteration takes.
+   g_stageStats[STAGE_LOOP].record (micros () - loopStartMicros);
+
+   // Give the rest of the slice to the idle task, the web server runs on its own task.
+   uint32_t idle = powerLoopIdle (mode);
+   if (idle && !firmwareUpdating)
+      delay (idle);
 }
 
 
@@ -0,0 +1,97 @@
+#include <string.h>
+#include "Config.h"
+#include "Power.h"
+
+uint32_t crc32 (const uint8_t* data, size_t len)
+{
+   // Bitwise, the record is a few hundred bytes read once per boot.
+   uint32_t crc = 0xFFFFFFFF;
+   for (size_t i = 0; i < len; i++)
+   {
+      crc ^= data[i];
+      for (int bit = 0; bit < 8; bit++)
+         crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+   }
+   return ~crc;
+}
+
+void captureConfig (StoredConfig& config)
+{
+   // Zeroed padding keeps the CRC the same for the same settings.
+   memset (&config, 0, sizeof (config));
+   config.m_oversampling = g_adsOversampling;
+   config.m_power = g_samplePlanner.setting ();
+   for (int i = 0; i < NTC_CHANNELS; i++)
+      config.m_ntc[i] = g_ntcCalibration[i];
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      config.m_filter[i] = g_filterConfig[i];
+   config.m_pid = g_pitController.config ();
+   config.m_pid.m_channel = g_pitController.channel ();
+   config.m_pidEnabled = g_pitController.enabled ();
+   config.m_setpoint = g_pitController.setpoint ();
+   for (int i = 0; i < ALARM_MAX; i++)
+   {
+      config.m_alarmUsed[i] = g_alarms.used (i);
+      if (config.m_alarmUsed[i])
+         config.m_alarms[i] = g_alarms.rule (i);
+   }
+}
+
+void applyConfig (const StoredConfig& config)
+{
+   g_adsOversampling = config.m_oversampling;
+   if (config.m_power < POWER_MODE_COUNT)
+      g_samplePlanner.setSetting ((PowerMode)config.m_power);
+   for (int i = 0; i < NTC_CHANNELS; i++)
+      g_ntcCalibration[i] = config.m_ntc[i];
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      g_filterConfig[i] = config.m_filter[i];
+   PidConfig pid = config.m_pid;
+   if (pid.m_channel >= SENSOR_COUNT)
+      pid.m_channel = defaultPidConfig ().m_channel;
+   g_pitController.configure (pid);
+   g_pitController.setSetpoint (config.m_setpoint);
+   g_pitController.setEnabled (config.m_pidEnabled);
+   for (int i = 0; i < ALARM_MAX; i++)
+   {
+      if (config.m_alarmUsed[i])
+         g_alarms.setRule (i, config.m_alarms[i]);
+      else
+         g_alarms.removeRule (i);
+   }
+}
+
+static void putU32 (uint8_t* out, uint32_t value)
+{
+   for (int i = 0; i < 4; i++)
+      out[i] = value >> (8 * i);
+}
+
+static uint32_t getU32 (const uint8_t* in)
+{
+   return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+size_t encodeConfig (const StoredConfig& config, uint8_t* buf, size_t size)
+{
+   if (size < CONFIG_RECORD_SIZE)
+      return 0;
+   putU32 (buf, CONFIG_MAGIC);
+   putU32 (buf + 4, CONFIG_VERSION | (uint32_t)sizeof (StoredConfig) << 16);
+   memcpy (buf + CONFIG_HEADER_SIZE, &config, sizeof (StoredConfig));
+   putU32 (buf + CONFIG_HEADER_SIZE + sizeof (StoredConfig), crc32 (buf, CONFIG_HEADER_SIZE + sizeof (StoredConfig)));
+   return CONFIG_RECORD_SIZE;
+}
+
+bool decodeConfig (const uint8_t* buf, size_t len, StoredConfig& config)
+{
+   if (len != CONFIG_RECORD_SIZE || getU32 (buf) != CONFIG_MAGIC || getU32 (buf + 4) != (CONFIG_VERSION | (uint32_t)sizeof (StoredConfig) << 16))
+      return false;
+   if (getU32 (buf + CONFIG_HEADER_SIZE + sizeof (StoredConfig)) != crc32 (buf, CONFIG_HEADER_SIZE + sizeof (StoredConfig)))
+      return false;
+   memcpy (&config, buf + CONFIG_HEADER_SIZE, sizeof (StoredConfig));
+   // The strings are terminated whatever the record says.
+   config.m_mqttServer[CONFIG_MQTT_SERVER_MAX - 1] = '\0';
+   config.m_mqttPort[CONFIG_MQTT_PORT_MAX - 1] = '\0';
+   return true;
+}
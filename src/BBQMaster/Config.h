@@ -0,0 +1,50 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "Sensors.h"
+#include "Alarms.h"
+#include "PitController.h"
+
+// "BBQC", then the version of StoredConfig. Bump the version when the layout changes.
+#define CONFIG_MAGIC 0x43514242
+#define CONFIG_VERSION 1
+// Magic, version and struct size
+#define CONFIG_HEADER_SIZE 8
+#define CONFIG_RECORD_SIZE (CONFIG_HEADER_SIZE + sizeof (StoredConfig) + 4)
+#define CONFIG_MQTT_SERVER_MAX 40
+#define CONFIG_MQTT_PORT_MAX 6
+
+// Everything kept across reboots, stored as one binary record: a header, the struct as it
+// is in memory and a CRC-32. Loading it is a copy, no parsing at boot. A record from a build
+// with another layout fails the header check and the defaults stay.
+struct StoredConfig
+{
+   char m_mqttServer[CONFIG_MQTT_SERVER_MAX];
+   char m_mqttPort[CONFIG_MQTT_PORT_MAX];
+   uint8_t m_oversampling;
+   uint8_t m_power;
+   NtcCalibration m_ntc[NTC_CHANNELS];
+   FilterConfig m_filter[SENSOR_COUNT];
+   PidConfig m_pid;
+   bool m_pidEnabled;
+   float m_setpoint;
+   bool m_alarmUsed[ALARM_MAX];
+   AlarmRule m_alarms[ALARM_MAX];
+};
+
+// Copy the settings of the sensor, power, pit control and alarm code. The MQTT fields are
+// left empty for the caller.
+void captureConfig (StoredConfig& config);
+// Apply the settings, before the sensor task starts.
+void applyConfig (const StoredConfig& config);
+
+// Serialize into buf, which holds CONFIG_RECORD_SIZE bytes. Returns the length written.
+size_t encodeConfig (const StoredConfig& config, uint8_t* buf, size_t size);
+// Returns false when the record is truncated, corrupted or from another layout.
+bool decodeConfig (const uint8_t* buf, size_t len, StoredConfig& config);
+
+uint32_t crc32 (const uint8_t* data, size_t len);
+
+#endif
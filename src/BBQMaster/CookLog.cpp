@@ -0,0 +1,279 @@
+#include "CookLog.h"
+#include <stdio.h>
+#include <string.h>
+
+static const uint8_t s_segmentMagic[4] = {'B', 'B', 'Q', 'L'};
+
+static void packPoint (const HistPoint& point, uint8_t* out)
+{
+   uint32_t time = (uint32_t)point.m_time;
+   out[0] = time;
+   out[1] = time >> 8;
+   out[2] = time >> 16;
+   out[3] = time >> 24;
+   out[4] = point.m_avail;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      uint16_t temp = (uint16_t)point.m_temp[i];
+      out[5 + 2 * i] = temp;
+      out[6 + 2 * i] = temp >> 8;
+   }
+}
+
+static void unpackPoint (const uint8_t* in, HistPoint& point)
+{
+   point.m_time = (int32_t)(in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24));
+   point.m_avail = in[4];
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      point.m_temp[i] = (int16_t)(in[5 + 2 * i] | (in[6 + 2 * i] << 8));
+}
+
+static void segmentHeader (uint32_t seq, uint8_t* header)
+{
+   memcpy (header, s_segmentMagic, 4);
+   header[4] = seq;
+   header[5] = seq >> 8;
+   header[6] = seq >> 16;
+   header[7] = seq >> 24;
+}
+
+// Slots in use ordered from oldest to newest, returns how many.
+static int orderedSlots (const uint32_t* seq, int* slots)
+{
+   int count = 0;
+   for (int slot = 0; slot < COOK_LOG_SEGMENTS; slot++)
+   {
+      if (!seq[slot])
+         continue;
+      int pos = count++;
+      while (pos > 0 && seq[slots[pos - 1]] > seq[slot])
+      {
+         slots[pos] = slots[pos - 1];
+         pos--;
+      }
+      slots[pos] = slot;
+   }
+   return count;
+}
+
+static uint8_t checksum (const uint8_t* data, size_t len)
+{
+   uint8_t sum = 0;
+   for (size_t i = 0; i < len; i++)
+      sum += data[i];
+   return sum;
+}
+
+CookLog::CookLog (FileSystem& fs) : m_fs (fs), m_active (-1), m_lastTime (0), m_pageCount (0), m_bytesWritten (0)
+{
+   for (int slot = 0; slot < COOK_LOG_SEGMENTS; slot++)
+   {
+      m_seq[slot] = 0;
+      m_segmentSize[slot] = 0;
+   }
+}
+
+void CookLog::slotPath (int slot, char* path) const
+{
+   snprintf (path, COOK_LOG_PATH_MAX, "/cook%d.log", slot);
+}
+
+uint32_t CookLog::segmentSeq (const char* path) const
+{
+   uint8_t header[COOK_LOG_SEGMENT_HEADER];
+   if (m_fs.read (path, 0, header, COOK_LOG_SEGMENT_HEADER) != COOK_LOG_SEGMENT_HEADER || memcmp (header, s_segmentMagic, 4) != 0)
+      return 0;
+   return header[4] | (header[5] << 8) | (header[6] << 16) | ((uint32_t)header[7] << 24);
+}
+
+void CookLog::publish ()
+{
+   CookLogSegments segments;
+   for (int slot = 0; slot < COOK_LOG_SEGMENTS; slot++)
+   {
+      segments.m_seq[slot] = m_seq[slot];
+      segments.m_size[slot] = m_segmentSize[slot];
+   }
+   m_segments.publish (segments);
+}
+
+void CookLog::begin ()
+{
+   m_active = -1;
+   for (int slot = 0; slot < COOK_LOG_SEGMENTS; slot++)
+   {
+      m_seq[slot] = 0;
+      m_segmentSize[slot] = 0;
+
+      char path[COOK_LOG_PATH_MAX];
+      slotPath (slot, path);
+      if (!m_fs.exists (path))
+         continue;
+
+      m_seq[slot] = segmentSeq (path);
+      if (m_seq[slot])
+      {
+         m_segmentSize[slot] = m_fs.size (path);
+         if (m_active < 0 || m_seq[slot] > m_seq[m_active])
+            m_active = slot;
+      }
+   }
+   publish ();
+}
+
+void CookLog::replay (void (*onPoint) (const HistPoint&))
+{
+   int slots[COOK_LOG_SEGMENTS];
+   int count = orderedSlots (m_seq, slots);
+   for (int s = 0; s < count; s++)
+   {
+      char path[COOK_LOG_PATH_MAX];
+      slotPath (slots[s], path);
+
+      uint8_t pages[COOK_LOG_REPLAY_PAGES * COOK_LOG_PAGE_SIZE];
+      size_t offset = COOK_LOG_SEGMENT_HEADER;
+      size_t read;
+      do
+      {
+         read = m_fs.read (path, offset, pages, sizeof (pages));
+         offset += read;
+         // A page cut short by a power loss ends the segment.
+         for (size_t p = 0; p + COOK_LOG_PAGE_SIZE <= read; p += COOK_LOG_PAGE_SIZE)
+         {
+            const uint8_t* page = pages + p;
+            uint8_t records = page[0];
+            if (records > COOK_LOG_PAGE_RECORDS || checksum (page + COOK_LOG_PAGE_HEADER, records * COOK_LOG_RECORD_SIZE) != page[1])
+               continue;
+            for (uint8_t r = 0; r < records; r++)
+            {
+               HistPoint point;
+               unpackPoint (page + COOK_LOG_PAGE_HEADER + r * COOK_LOG_RECORD_SIZE, point);
+               m_lastTime = point.m_time;
+               onPoint (point);
+            }
+         }
+      } while (read == sizeof (pages));
+   }
+}
+
+bool CookLog::isNewCook (int32_t time) const
+{
+   return m_lastTime != 0 && time - m_lastTime > COOK_LOG_NEW_COOK_GAP;
+}
+
+void CookLog::clear ()
+{
+   for (int slot = 0; slot < COOK_LOG_SEGMENTS; slot++)
+   {
+      char path[COOK_LOG_PATH_MAX];
+      slotPath (slot, path);
+      if (m_seq[slot] && m_fs.exists (path))
+         m_fs.remove (path);
+      m_seq[slot] = 0;
+      m_segmentSize[slot] = 0;
+   }
+   m_active = -1;
+   m_lastTime = 0;
+   m_pageCount = 0;
+   publish ();
+}
+
+void CookLog::append (const HistPoint& point)
+{
+   packPoint (point, m_page + COOK_LOG_PAGE_HEADER + m_pageCount * COOK_LOG_RECORD_SIZE);
+   m_pageCount++;
+   m_lastTime = point.m_time;
+   if (m_pageCount == COOK_LOG_PAGE_RECORDS)
+      flush ();
+}
+
+void CookLog::flush ()
+{
+   if (m_pageCount == 0)
+      return;
+
+   size_t used = COOK_LOG_PAGE_HEADER + m_pageCount * COOK_LOG_RECORD_SIZE;
+   m_page[0] = m_pageCount;
+   m_page[1] = checksum (m_page + COOK_LOG_PAGE_HEADER, m_pageCount * COOK_LOG_RECORD_SIZE);
+   memset (m_page + used, 0, COOK_LOG_PAGE_SIZE - used);
+   m_pageCount = 0;
+
+   // A page cut short by a power loss would shift every later one, they go into a new segment.
+   if (m_active < 0 || m_segmentSize[m_active] >= COOK_LOG_SEGMENT_HEADER + COOK_LOG_SEGMENT_PAGES * COOK_LOG_PAGE_SIZE ||
+       (m_segmentSize[m_active] - COOK_LOG_SEGMENT_HEADER) % COOK_LOG_PAGE_SIZE)
+      startSegment ();
+   if (m_active < 0)
+      return;
+
+   char path[COOK_LOG_PATH_MAX];
+   slotPath (m_active, path);
+   size_t written = m_fs.append (path, m_page, COOK_LOG_PAGE_SIZE);
+   m_bytesWritten += written;
+   m_segmentSize[m_active] += written;
+   publish ();
+}
+
+void CookLog::startSegment ()
+{
+   uint32_t seq = m_active < 0 ? 1 : m_seq[m_active] + 1;
+   int slot = m_active < 0 ? 0 : (m_active + 1) % COOK_LOG_SEGMENTS;
+
+   // Reusing a slot truncates the oldest segment.
+   char path[COOK_LOG_PATH_MAX];
+   slotPath (slot, path);
+   uint8_t header[COOK_LOG_SEGMENT_HEADER];
+   segmentHeader (seq, header);
+   if (m_fs.write (path, header, COOK_LOG_SEGMENT_HEADER) != COOK_LOG_SEGMENT_HEADER)
+      return;
+   m_bytesWritten += COOK_LOG_SEGMENT_HEADER;
+
+   m_seq[slot] = seq;
+   m_segmentSize[slot] = COOK_LOG_SEGMENT_HEADER;
+   m_active = slot;
+}
+
+size_t CookLog::size (const CookLogSegments& segments)
+{
+   size_t total = 0;
+   for (int slot = 0; slot < COOK_LOG_SEGMENTS; slot++)
+      total += segments.m_size[slot];
+   return total;
+}
+
+size_t CookLog::read (const CookLogSegments& segments, size_t offset, uint8_t* buf, size_t len) const
+{
+   int slots[COOK_LOG_SEGMENTS];
+   int count = orderedSlots (segments.m_seq, slots);
+   for (int s = 0; s < count; s++)
+   {
+      int slot = slots[s];
+      size_t segmentSize = segments.m_size[slot];
+      if (offset >= segmentSize)
+      {
+         offset -= segmentSize;
+         continue;
+      }
+      if (len > segmentSize - offset)
+         len = segmentSize - offset;
+
+      // The header is known from the snapshot.
+      if (offset < COOK_LOG_SEGMENT_HEADER)
+      {
+         uint8_t header[COOK_LOG_SEGMENT_HEADER];
+         segmentHeader (segments.m_seq[slot], header);
+         if (len > COOK_LOG_SEGMENT_HEADER - offset)
+            len = COOK_LOG_SEGMENT_HEADER - offset;
+         memcpy (buf, header + offset, len);
+         return len;
+      }
+
+      // Pages read while the sensor task reused the slot are replaced by empty ones, a
+      // zero record count with a zero checksum.
+      char path[COOK_LOG_PATH_MAX];
+      slotPath (slot, path);
+      if (m_fs.read (path, offset, buf, len) != len || segmentSeq (path) != segments.m_seq[slot])
+         memset (buf, 0, len);
+      return len;
+   }
+   return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef COOK_LOG_H
+#define COOK_LOG_H
+
+#include "Hal.h"
+#include "History.h"
+#include "Snapshot.h"
+
+// Size of one log page. Records are batched in RAM and written a page at a time.
+#define COOK_LOG_PAGE_SIZE 256
+// Pages per segment file and number of segment files kept in rotation (17 to 21 hours at HIST_INT).
+#define COOK_LOG_SEGMENT_PAGES 256
+#define COOK_LOG_SEGMENTS 5
+// Room for the name of a segment file, "/cook<slot>.log" with any int
+#define COOK_LOG_PATH_MAX 24
+// A sample this long after the last logged one starts a new cook.
+#define COOK_LOG_NEW_COOK_GAP (6 * 3600)
+
+// Bytes of one serialized HistPoint
+#define COOK_LOG_RECORD_SIZE (4 + 1 + 2 * SENSOR_COUNT)
+#define COOK_LOG_PAGE_HEADER 2
+#define COOK_LOG_PAGE_RECORDS ((COOK_LOG_PAGE_SIZE - COOK_LOG_PAGE_HEADER) / COOK_LOG_RECORD_SIZE)
+#define COOK_LOG_SEGMENT_HEADER 8
+// Pages read from flash at once during the replay
+#define COOK_LOG_REPLAY_PAGES 4
+
+// Sequence number and size of each segment file, 0 for the unused slots
+struct CookLogSegments
+{
+   uint32_t m_seq[COOK_LOG_SEGMENTS];
+   uint32_t m_size[COOK_LOG_SEGMENTS];
+};
+
+// Append only log of the history samples on flash, so a cook survives reboots and OTA updates.
+//
+// The log is a ring of segment files "/cook<slot>.log". Each starts with "BBQL" and a
+// 32 bit sequence number, followed by pages of u8 record count, u8 checksum and the records.
+// The log belongs to the sensor task. Other tasks read it through a snapshot of its segments.
+class CookLog
+{
+public:
+   explicit CookLog (FileSystem& fs);
+
+   // Find the existing segments. Call once the file system is mounted.
+   void begin ();
+   // Feed every logged sample, oldest first, to the callback.
+   void replay (void (*onPoint) (const HistPoint&));
+
+   // Whether a sample taken at time belongs to a new cook rather than the logged one.
+   bool isNewCook (int32_t time) const;
+   // Drop the whole log.
+   void clear ();
+
+   // Buffer a sample, writing out the page once it is full.
+   void append (const HistPoint& point);
+   // Write out the partially filled page, e.g. before a restart.
+   void flush ();
+
+   // Segments as of the last page written, from any task.
+   CookLogSegments segments () const { return m_segments.read (); }
+   // Total size of the segments on flash.
+   static size_t size (const CookLogSegments& segments);
+   // Read from the concatenation of the segments, oldest first, from any task. Returns the bytes
+   // read. A segment reused for newer records since reads as empty pages, so the data keeps the
+   // size and layout of the snapshot.
+   size_t read (const CookLogSegments& segments, size_t offset, uint8_t* buf, size_t len) const;
+
+   // Bytes written to flash since boot.
+   uint32_t bytesWritten () const { return m_bytesWritten; }
+
+private:
+   void slotPath (int slot, char* path) const;
+   void startSegment ();
+   // Sequence number in the header of a segment file, 0 when there is none.
+   uint32_t segmentSeq (const char* path) const;
+   void publish ();
+
+   FileSystem& m_fs;
+   uint32_t m_seq[COOK_LOG_SEGMENTS];
+   size_t m_segmentSize[COOK_LOG_SEGMENTS];
+   int m_active;
+   int32_t m_lastTime;
+   uint8_t m_page[COOK_LOG_PAGE_SIZE];
+   uint8_t m_pageCount;
+   uint32_t m_bytesWritten;
+   Snapshot<CookLogSegments> m_segments;
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+// #define DEBUG_SERIAL
+// #define DEBUG_TELNET
+// #define DEBUG_EXTRA_OUTPUT
+
+// Macros for debugging
+#ifdef DEBUG_TELNET
+   #include <WiFi.h>
+   #define     DEBUG_TELNET_PORT 23
+   extern WiFiServer  telnetServer;
+   extern WiFiClient  telnetClient;
+   #define     DEBUG_PRINT(x)    telnetClient.print(x)
+   #define     DEBUG_PRINT_WITH_FMT(x, fmt)    telnetClient.printf(x, fmt)
+   #define     DEBUG_PRINTLN(x)  telnetClient.println(x)
+   #define     DEBUG_PRINTLN_WITH_FMT(x, fmt)  telnetClient.println(x, fmt)
+#elif defined(DEBUG_SERIAL)
+   #include <Arduino.h>
+   #define     DEBUG_PRINT(x)    Serial.print(x)
+   #define     DEBUG_PRINT_WITH_FMT(x, fmt)    Serial.printf(x, fmt)
+   #define     DEBUG_PRINTLN(x)  Serial.println(x)
+   #define     DEBUG_PRINTLN_WITH_FMT(x, fmt)  Serial.println(x, fmt)
+#else
+   #define     DEBUG_PRINT(x)
+   #define     DEBUG_PRINT_WITH_FMT(x, fmt)
+   #define     DEBUG_PRINTLN(x)
+   #define     DEBUG_PRINTLN_WITH_FMT(x, fmt)
+#endif
+
+#endif
@@ -0,0 +1,160 @@
+#include <esp_wifi.h>
+#include "EspHal.h"
+
+DallasThermocouples::DallasThermocouples (OneWire* oneWire, const DeviceAddress* addresses) : m_sensors (oneWire), m_addresses (addresses)
+{
+}
+
+void DallasThermocouples::begin ()
+{
+   m_sensors.begin ();
+   m_sensors.requestTemperatures ();
+   m_sensors.setResolution (12);
+}
+
+void DallasThermocouples::requestTemperatures ()
+{
+   m_sensors.setWaitForConversion (false);  // makes it async
+   m_sensors.requestTemperatures ();
+   m_sensors.setWaitForConversion (true);
+}
+
+float DallasThermocouples::tempF (int channel)
+{
+   return m_sensors.getTempF (m_addresses[channel]);
+}
+
+size_t ArduinoFileSystem::size (const char* path)
+{
+   File file = m_fs.open (path, "r");
+   if (!file)
+      return 0;
+   size_t size = file.size ();
+   file.close ();
+   return size;
+}
+
+size_t ArduinoFileSystem::read (const char* path, size_t offset, uint8_t* buf, size_t len)
+{
+   File file = m_fs.open (path, "r");
+   if (!file)
+      return 0;
+   size_t read = 0;
+   if (file.seek (offset))
+      read = file.read (buf, len);
+   file.close ();
+   return read;
+}
+
+size_t ArduinoFileSystem::append (const char* path, const uint8_t* buf, size_t len)
+{
+   File file = m_fs.open (path, "a");
+   if (!file)
+      return 0;
+   size_t written = file.write (buf, len);
+   file.close ();
+   return written;
+}
+
+size_t ArduinoFileSystem::write (const char* path, const uint8_t* buf, size_t len)
+{
+   File file = m_fs.open (path, "w");
+   if (!file)
+      return 0;
+   size_t written = file.write (buf, len);
+   file.close ();
+   return written;
+}
+
+bool EspWifi::hasCredentials ()
+{
+   wifi_config_t config;
+   return esp_wifi_get_config (WIFI_IF_STA, &config) == ESP_OK && config.sta.ssid[0];
+}
+
+void EspWifi::begin (const uint8_t* bssid, uint8_t channel)
+{
+   wifi_config_t config;
+   if (esp_wifi_get_config (WIFI_IF_STA, &config) != ESP_OK)
+      return;
+   // The stored fields are not terminated when they fill the whole array.
+   char ssid[sizeof (config.sta.ssid) + 1];
+   char password[sizeof (config.sta.password) + 1];
+   memcpy (ssid, config.sta.ssid, sizeof (config.sta.ssid));
+   ssid[sizeof (config.sta.ssid)] = '\0';
+   memcpy (password, config.sta.password, sizeof (config.sta.password));
+   password[sizeof (config.sta.password)] = '\0';
+
+   WiFi.setAutoReconnect (false);
+   WiFi.disconnect ();
+   // Same credentials, so nothing to write to flash.
+   WiFi.persistent (false);
+   WiFi.begin (ssid, password, channel, bssid);
+   WiFi.persistent (true);
+}
+
+void EspWifi::accessPoint (uint8_t* bssid, uint8_t& channel)
+{
+   memcpy (bssid, WiFi.BSSID (), 6);
+   channel = WiFi.channel ();
+}
+
+// Connection helper task
+#define MQTT_CONNECT_TASK_STACK 4096
+#define MQTT_CONNECT_TASK_PRIORITY 1
+#define MQTT_CONNECT_TASK_CORE 1
+
+PubSubTransport::PubSubTransport (PubSubClient& client) : m_client (client), m_task (nullptr), m_busy (false), m_status (CONNECT_FAILED), m_port (0)
+{
+   m_host[0] = '\0';
+}
+
+void PubSubTransport::setServer (const char* host, uint16_t port)
+{
+   strncpy (m_host, host, sizeof (m_host) - 1);
+   m_host[sizeof (m_host) - 1] = '\0';
+   m_port = port;
+}
+
+bool PubSubTransport::startConnect (const char* clientId, const char* willTopic, const char* willMessage)
+{
+   if (m_busy)
+      return false;
+   if (!m_task && xTaskCreatePinnedToCore (connectTask, "mqtt", MQTT_CONNECT_TASK_STACK, this, MQTT_CONNECT_TASK_PRIORITY, &m_task, MQTT_CONNECT_TASK_CORE) != pdPASS)
+   {
+      m_task = nullptr;
+      return false;
+   }
+
+   snprintf (m_clientId, sizeof (m_clientId), "%s", clientId);
+   snprintf (m_willTopic, sizeof (m_willTopic), "%s", willTopic);
+   snprintf (m_willMessage, sizeof (m_willMessage), "%s", willMessage);
+   m_status = CONNECT_PENDING;
+   m_busy = true;
+   xTaskNotifyGive (m_task);
+   return true;
+}
+
+void PubSubTransport::connectTask (void* param)
+{
+   PubSubTransport* transport = (PubSubTransport*)param;
+   for (;;)
+   {
+      ulTaskNotifyTake (pdTRUE, portMAX_DELAY);
+      transport->connect ();
+   }
+}
+
+void PubSubTransport::connect ()
+{
+   bool done = false;
+   IPAddress address;
+   if (WiFi.isConnected () && WiFi.hostByName (m_host, address))
+   {
+      m_client.setServer (address, m_port);
+      done = m_client.connect (m_clientId, "", "", m_willTopic, 0, true, m_willMessage);
+   }
+   // Hand the client back before reporting, pollConnect () callers use it right away.
+   m_busy = false;
+   m_status = done ? CONNECT_DONE : CONNECT_FAILED;
+}
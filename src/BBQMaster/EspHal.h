@@ -0,0 +1,131 @@
+#ifndef ESP_HAL_H
+#define ESP_HAL_H
+
+#include <FS.h>
+#include <OneWire.h>
+#include <DallasTemperature.h>
+#include <PubSubClient.h>
+#include <WiFi.h>
+#include "Hal.h"
+
+// Arduino time base
+class ArduinoClock : public Clock
+{
+public:
+   uint32_t millis () override { return ::millis (); }
+   uint32_t micros () override { return ::micros (); }
+};
+
+// MAX31850 thermocouple amplifiers on a OneWire bus, channel i is the i-th address.
+class DallasThermocouples : public ThermocoupleBus
+{
+public:
+   DallasThermocouples (OneWire* oneWire, const DeviceAddress* addresses);
+
+   void begin () override;
+   void requestTemperatures () override;
+   float tempF (int channel) override;
+
+   DallasTemperature& sensors () { return m_sensors; }
+
+private:
+   DallasTemperature m_sensors;
+   const DeviceAddress* m_addresses;
+};
+
+// Battery voltage divider on an analog pin
+class AnalogBattery : public BatteryMonitor
+{
+public:
+   AnalogBattery (uint8_t pin, float ratio) : m_pin (pin), m_ratio (ratio) {}
+   float voltage () override { return analogRead (m_pin) * m_ratio; }
+
+private:
+   uint8_t m_pin;
+   float m_ratio;
+};
+
+// Blower on a LEDC PWM channel. 25 kHz suits 4 wire PC fans and is above hearing.
+class LedcFan : public FanOutput
+{
+public:
+   LedcFan (uint8_t pin, uint8_t channel) : m_pin (pin), m_channel (channel) {}
+
+   void begin () override
+   {
+      ledcSetup (m_channel, 25000, 10);
+      ledcAttachPin (m_pin, m_channel);
+      ledcWrite (m_channel, 0);
+   }
+   void setDuty (float duty) override { ledcWrite (m_channel, (uint32_t)(duty * 1023 + 0.5f)); }
+
+private:
+   uint8_t m_pin;
+   uint8_t m_channel;
+};
+
+// Arduino file system, SPIFFS on the board
+class ArduinoFileSystem : public FileSystem
+{
+public:
+   explicit ArduinoFileSystem (fs::FS& fs) : m_fs (fs) {}
+
+   bool exists (const char* path) override { return m_fs.exists (path); }
+   bool remove (const char* path) override { return m_fs.remove (path); }
+   size_t size (const char* path) override;
+   size_t read (const char* path, size_t offset, uint8_t* buf, size_t len) override;
+   size_t append (const char* path, const uint8_t* buf, size_t len) override;
+   size_t write (const char* path, const uint8_t* buf, size_t len) override;
+
+private:
+   fs::FS& m_fs;
+};
+
+// Arduino WiFi station on the credentials stored by the config portal. Joins are driven by
+// WifiConnection, the core's own reconnect is turned off.
+class EspWifi : public WifiLink
+{
+public:
+   bool hasCredentials () override;
+   void begin (const uint8_t* bssid, uint8_t channel) override;
+   bool connected () override { return WiFi.status () == WL_CONNECTED; }
+   void accessPoint (uint8_t* bssid, uint8_t& channel) override;
+};
+
+// PubSubClient connection. DNS, TCP connect and the MQTT CONNECT block, so they run on a
+// helper task. The client is left alone by the other calls while an attempt is running.
+class PubSubTransport : public MqttTransport
+{
+public:
+   explicit PubSubTransport (PubSubClient& client);
+
+   // Broker host name or address, resolved on every attempt.
+   void setServer (const char* host, uint16_t port);
+
+   bool connected () override { return !m_busy && m_client.connected (); }
+   bool startConnect (const char* clientId, const char* willTopic, const char* willMessage) override;
+   ConnectStatus pollConnect () override { return m_status; }
+   bool publish (const char* topic, const char* payload, bool retained) override { return !m_busy && m_client.publish (topic, payload, retained); }
+   void loop () override
+   {
+      if (!m_busy)
+         m_client.loop ();
+   }
+   int state () override { return m_client.state (); }
+
+private:
+   static void connectTask (void* param);
+   void connect ();
+
+   PubSubClient& m_client;
+   TaskHandle_t m_task;
+   volatile bool m_busy;
+   volatile ConnectStatus m_status;
+   char m_host[40];
+   uint16_t m_port;
+   char m_clientId[24];
+   char m_willTopic[64];
+   char m_willMessage[16];
+};
+
+#endif
@@ -0,0 +1,191 @@
+#include <math.h>
+#include <stdio.h>
+#include "Estimator.h"
+
+CookEstimator g_estimator;
+
+void TrendFit::reset ()
+{
+   m_count = 0;
+   m_firstT = m_lastT = 0;
+   m_meanT = m_meanY = 0;
+   m_varT = m_covTY = m_varY = 0;
+   m_weight2 = 0;
+}
+
+void TrendFit::add (float minutes, float tempF)
+{
+   if (!m_count)
+   {
+      m_firstT = m_lastT = m_meanT = minutes;
+      m_meanY = tempF;
+      m_weight2 = 1;
+      m_count = 1;
+      return;
+   }
+
+   // Weight of the new reading, uneven spacing included. Starts as a plain average.
+   float alpha = (minutes - m_lastT) / ETA_TIME_CONSTANT;
+   alpha = alpha / (1 + alpha);
+   if (alpha < 1.0f / (m_count + 1))
+      alpha = 1.0f / (m_count + 1);
+
+   // Exponentially weighted mean and covariances, updated in place.
+   float dt = minutes - m_meanT;
+   float dy = tempF - m_meanY;
+   m_meanT += alpha * dt;
+   m_meanY += alpha * dy;
+   m_varT = (1 - alpha) * (m_varT + alpha * dt * dt);
+   m_covTY = (1 - alpha) * (m_covTY + alpha * dt * dy);
+   m_varY = (1 - alpha) * (m_varY + alpha * dy * dy);
+   m_weight2 = (1 - alpha) * (1 - alpha) * m_weight2 + alpha * alpha;
+   m_lastT = minutes;
+   m_count++;
+}
+
+float TrendFit::slopeError () const
+{
+   if (m_varT <= 0)
+      return INFINITY;
+   float residual = m_varY - m_covTY * m_covTY / m_varT;
+   if (residual < 0)
+      residual = 0;
+   // Effective number of readings, minus the two fitted parameters
+   float readings = 1 / m_weight2 - 2;
+   if (readings < 1)
+      return INFINITY;
+   return sqrtf (residual / (readings * m_varT));
+}
+
+CookEstimator::CookEstimator () : m_origin (0), m_alarmRevision (0)
+{
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      m_target[i] = INT16_MIN;
+   clear ();
+}
+
+void CookEstimator::clear ()
+{
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      m_fit[i].reset ();
+      m_pastStall[i] = false;
+      m_done[i] = false;
+      m_eta[i] = Eta ();
+   }
+   m_origin = 0;
+}
+
+void CookEstimator::syncTargets ()
+{
+   m_alarmRevision = g_alarms.revision ();
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      int16_t target = g_alarms.target (i);
+      if (target != m_target[i])
+      {
+         m_target[i] = target;
+         m_eta[i] = Eta ();
+      }
+   }
+}
+
+void CookEstimator::update (const HistPoint& point)
+{
+   if (g_alarms.revision () != m_alarmRevision)
+      syncTargets ();
+
+   // Minutes from the first reading keep the float sums precise over a long cook.
+   if (!m_origin)
+      m_origin = point.m_time;
+   float minutes = (point.m_time - m_origin) / 60.0f;
+
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      if (!hasTarget (i))
+         continue;
+      if (!point.available (i))
+      {
+         m_fit[i].reset ();
+         m_eta[i] = Eta ();
+         continue;
+      }
+      m_fit[i].add (minutes, point.m_temp[i] / 10.0f);
+      estimate (i, point.m_temp[i]);
+   }
+}
+
+void CookEstimator::estimate (int channel, int16_t current)
+{
+   const TrendFit& fit = m_fit[channel];
+   Eta& eta = m_eta[channel];
+   eta.m_valid = false;
+
+   if (current >= m_target[channel])
+      m_done[channel] = true;
+   else if (current < m_target[channel] - ETA_DONE_HYSTERESIS)
+      m_done[channel] = false;
+   if (m_done[channel])
+   {
+      eta.m_valid = true;
+      eta.m_stalled = false;
+      eta.m_seconds = 0;
+      eta.m_confidence = 100;
+      return;
+   }
+   if (fit.span () < ETA_MIN_SPAN)
+      return;
+
+   float slope = fit.slope ();
+   float level = fit.level ();
+   bool inStallRange = level * 10 >= STALL_LOW_TENTHS && level * 10 <= STALL_HIGH_TENTHS;
+   if (eta.m_stalled)
+   {
+      if (slope > STALL_EXIT_SLOPE || !inStallRange)
+      {
+         eta.m_stalled = false;
+         m_pastStall[channel] = true;
+      }
+   }
+   else if (inStallRange && !m_pastStall[channel] && slope < STALL_ENTER_SLOPE)
+      eta.m_stalled = true;
+   if (eta.m_stalled || slope <= 0)
+      return;
+
+   float minutes = (m_target[channel] / 10.0f - level) / slope;
+   if (minutes < 0)
+      minutes = 0;
+
+   // Share of the trend that is certain at about 95%, lower the further the line is extended.
+   float certain = 1 - 2 * fit.slopeError () / slope;
+   float confidence = certain > 0 ? certain : 0;
+   confidence *= ETA_TIME_CONSTANT * 4 / (ETA_TIME_CONSTANT * 4 + minutes);
+   if (!m_pastStall[channel] && level * 10 < STALL_HIGH_TENTHS && m_target[channel] > STALL_HIGH_TENTHS)
+   {
+      minutes += ETA_STALL_ALLOWANCE;
+      confidence /= 2;
+   }
+   if (minutes * 60 > ETA_MAX)
+      return;
+
+   eta.m_valid = true;
+   eta.m_seconds = (int32_t)(minutes * 60);
+   eta.m_confidence = (uint8_t)(confidence * 100 + 0.5f);
+}
+
+size_t CookEstimator::formatJson (char* buf, size_t size, int channel) const
+{
+   if (!hasTarget (channel))
+      return 0;
+   return formatEtaJson (buf, size, m_eta[channel]);
+}
+
+size_t formatEtaJson (char* buf, size_t size, const Eta& eta)
+{
+   int len;
+   if (eta.m_valid)
+      len = snprintf (buf, size, ",\"eta\":%ld,\"c\":%u", (long)eta.m_seconds, (unsigned)eta.m_confidence);
+   else
+      len = snprintf (buf, size, ",\"eta\":null%s", eta.m_stalled ? ",\"stall\":true" : "");
+   return len < 0 ? 0 : (size_t)len < size ? len : size - 1;
+}
@@ -0,0 +1,107 @@
+#ifndef ESTIMATOR_H
+#define ESTIMATOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "History.h"
+#include "Alarms.h"
+
+// Time constant of the trend fit, in minutes
+#define ETA_TIME_CONSTANT 15.0f
+// Minutes of readings before there is an estimate
+#define ETA_MIN_SPAN 10.0f
+// Longest estimate reported, in seconds
+#define ETA_MAX (24 * 3600)
+// Range of the stall plateau, in 0.1 F
+#define STALL_LOW_TENTHS 1450
+#define STALL_HIGH_TENTHS 1800
+// Trend, in F per minute, under which a probe in that range is stalled and over which it left the stall
+#define STALL_ENTER_SLOPE 0.05f
+#define STALL_EXIT_SLOPE 0.1f
+// Minutes a stall is expected to last, added to the estimates made before it
+#define ETA_STALL_ALLOWANCE 180.0f
+// A probe that reached its target is done until it drops this far below it, in 0.1 F
+#define ETA_DONE_HYSTERESIS 20
+
+// Exponentially weighted least squares line through the readings of one probe. O(1) per reading.
+class TrendFit
+{
+public:
+   TrendFit () { reset (); }
+
+   void reset ();
+   void add (float minutes, float tempF);
+
+   // Minutes covered by the fit
+   float span () const { return m_count ? m_lastT - m_firstT : 0; }
+   // F per minute
+   float slope () const { return m_varT > 0 ? m_covTY / m_varT : 0; }
+   // Standard error of the slope
+   float slopeError () const;
+   // Fitted temperature at the last reading
+   float level () const { return m_meanY + slope () * (m_lastT - m_meanT); }
+
+private:
+   uint32_t m_count;
+   float m_firstT;
+   float m_lastT;
+   float m_meanT;
+   float m_meanY;
+   float m_varT;
+   float m_covTY;
+   float m_varY;
+   // Sum of the squared weights, for the effective number of readings
+   float m_weight2;
+};
+
+// Time to target of one probe
+struct Eta
+{
+   bool m_valid;
+   bool m_stalled;
+   // Seconds until the target, 0 once reached
+   int32_t m_seconds;
+   // 0 to 100
+   uint8_t m_confidence;
+};
+
+// Time to target of every probe with a target alarm rule, updated on every reading.
+//
+// A line is fitted through the last ETA_TIME_CONSTANT minutes of readings and extended to
+// the target. Meat stops rising for hours when it sweats around 150-170 F; while the trend is
+// flat in that range the probe is reported as stalled, without an estimate. Until a probe got
+// through its stall, estimates for a target above the stall range include ETA_STALL_ALLOWANCE
+// and come with half the confidence, the line fitted before the stall being far too steep.
+class CookEstimator
+{
+public:
+   CookEstimator ();
+
+   void update (const HistPoint& point);
+   bool hasTarget (int channel) const { return m_target[channel] != INT16_MIN; }
+   const Eta& eta (int channel) const { return m_eta[channel]; }
+   void clear ();
+
+   // Append the estimate of a channel to a sensor JSON object. Returns the length written.
+   size_t formatJson (char* buf, size_t size, int channel) const;
+
+private:
+   // Take the targets from the alarm rules.
+   void syncTargets ();
+   void estimate (int channel, int16_t current);
+
+   TrendFit m_fit[SENSOR_COUNT];
+   int16_t m_target[SENSOR_COUNT];
+   bool m_pastStall[SENSOR_COUNT];
+   bool m_done[SENSOR_COUNT];
+   Eta m_eta[SENSOR_COUNT];
+   int32_t m_origin;
+   uint32_t m_alarmRevision;
+};
+
+extern CookEstimator g_estimator;
+
+// Append an estimate to a sensor JSON object. Returns the length written.
+size_t formatEtaJson (char* buf, size_t size, const Eta& eta);
+
+#endif
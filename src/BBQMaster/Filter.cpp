@@ -0,0 +1,101 @@
+#include <math.h>
+#include "Filter.h"
+#include "Sensors.h"
+
+FilterConfig defaultFilterConfig ()
+{
+   FilterConfig config;
+   config.m_median = 3;
+   config.m_mode = FILTER_KALMAN;
+   config.m_alpha = 0.3f;
+   config.m_q = 0.05f;
+   config.m_r = 1.0f;
+   return config;
+}
+
+ChannelFilter::ChannelFilter ()
+{
+   m_config = defaultFilterConfig ();
+   reset ();
+}
+
+void ChannelFilter::configure (const FilterConfig& config)
+{
+   m_config = config;
+   if (m_config.m_median < 1)
+      m_config.m_median = 1;
+   if (m_config.m_median > FILTER_MEDIAN_MAX)
+      m_config.m_median = FILTER_MEDIAN_MAX;
+   reset ();
+}
+
+void ChannelFilter::reset ()
+{
+   m_count = 0;
+   m_next = 0;
+   m_primed = false;
+   m_lastMillis = 0;
+   m_estimate = 0;
+   m_variance = 0;
+}
+
+float ChannelFilter::median () const
+{
+   float sorted[FILTER_MEDIAN_MAX];
+   for (uint8_t i = 0; i < m_count; i++)
+   {
+      uint8_t pos = i;
+      while (pos > 0 && sorted[pos - 1] > m_window[i])
+      {
+         sorted[pos] = sorted[pos - 1];
+         pos--;
+      }
+      sorted[pos] = m_window[i];
+   }
+   return sorted[m_count / 2];
+}
+
+float ChannelFilter::update (float value, uint32_t nowMillis)
+{
+   // Spike rejection
+   m_window[m_next] = value;
+   m_next = (m_next + 1) % m_config.m_median;
+   if (m_count < m_config.m_median)
+      m_count++;
+   float measured = median ();
+
+   if (!m_primed)
+   {
+      m_estimate = measured;
+      m_variance = m_config.m_r;
+      m_primed = true;
+      m_lastMillis = nowMillis;
+      return m_estimate;
+   }
+
+   // Sample periods since the last reading, more than one once the planner slowed the channel down.
+   float periods = (float)(nowMillis - m_lastMillis) / SENSOR_READ_INT;
+   m_lastMillis = nowMillis;
+   switch (m_config.m_mode)
+   {
+   case FILTER_EMA:
+   {
+      // The weight left to the old estimate decays per period.
+      float alpha = periods == 1.0f ? m_config.m_alpha : 1.0f - powf (1.0f - m_config.m_alpha, periods);
+      m_estimate += alpha * (measured - m_estimate);
+      break;
+   }
+   case FILTER_KALMAN:
+   {
+      m_variance += m_config.m_q * periods;
+      float gain = m_variance / (m_variance + m_config.m_r);
+      m_estimate += gain * (measured - m_estimate);
+      m_variance *= 1 - gain;
+      break;
+   }
+   default:
+      m_estimate = measured;
+      break;
+   }
+   return m_estimate;
+}
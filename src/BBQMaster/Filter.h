@@ -0,0 +1,59 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+
+// Largest window of the median spike rejector.
+#define FILTER_MEDIAN_MAX 7
+
+enum FilterMode : uint8_t
+{
+   FILTER_NONE,
+   FILTER_EMA,
+   FILTER_KALMAN
+};
+
+// Settings of the filter of one channel.
+struct FilterConfig
+{
+   // Window of the median spike rejector, 1 disables it
+   uint8_t m_median;
+   FilterMode m_mode;
+   // EMA weight of a new sample, for readings SENSOR_READ_INT apart
+   float m_alpha;
+   // Kalman process noise per SENSOR_READ_INT and measurement noise, in F^2
+   float m_q;
+   float m_r;
+};
+
+// Default used for the channels without a configured filter.
+FilterConfig defaultFilterConfig ();
+
+// Per channel filter stage between acquisition and the published reading: median of the
+// last readings to reject spikes, then EMA or 1-D Kalman smoothing. Fixed size, O(1) per sample.
+// The smoothing follows the time between readings, so a channel read less often is not held back.
+class ChannelFilter
+{
+public:
+   ChannelFilter ();
+
+   void configure (const FilterConfig& config);
+   // Feed a valid reading taken at nowMillis, returns the filtered value.
+   float update (float value, uint32_t nowMillis);
+   // Forget the past readings, e.g. when the probe got disconnected.
+   void reset ();
+
+private:
+   float median () const;
+
+   FilterConfig m_config;
+   float m_window[FILTER_MEDIAN_MAX];
+   uint8_t m_count;
+   uint8_t m_next;
+   bool m_primed;
+   uint32_t m_lastMillis;
+   float m_estimate;
+   float m_variance;
+};
+
+#endif
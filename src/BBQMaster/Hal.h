@@ -0,0 +1,112 @@
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Thin interfaces over the hardware. The board implementations live in EspHal.h, and
+// the host build in src/native provides scripted fakes, so the sampling, history, JSON
+// and MQTT code runs the same on both.
+
+// Time base
+class Clock
+{
+public:
+   virtual uint32_t millis () = 0;
+   virtual uint32_t micros () = 0;
+};
+
+// Multiplexed ADC of the NTC probes. A sweep converts every channel without blocking.
+class ProbeAdc
+{
+public:
+   virtual void begin () = 0;
+   virtual void setOversampling (uint8_t count) = 0;
+   // Start converting the channels in mask, bit i for channel i. Ignored while a sweep is running.
+   virtual void startSweep (uint8_t mask) = 0;
+   // Advance the sweep. Returns true once when the last channel has been read.
+   virtual bool tick () = 0;
+   virtual int16_t value (int channel) const = 0;
+};
+
+// OneWire thermocouple amplifiers
+class ThermocoupleBus
+{
+public:
+   virtual void begin () = 0;
+   // Start a conversion on every amplifier without waiting for it.
+   virtual void requestTemperatures () = 0;
+   // Last converted temperature of a channel, 0 to 3.
+   virtual float tempF (int channel) = 0;
+};
+
+// Battery voltage divider
+class BatteryMonitor
+{
+public:
+   virtual float voltage () = 0;
+};
+
+// PWM output driving the pit blower
+class FanOutput
+{
+public:
+   virtual void begin () = 0;
+   // 0 (off) to 1 (full speed)
+   virtual void setDuty (float duty) = 0;
+};
+
+// Path based access to the flash file system.
+class FileSystem
+{
+public:
+   virtual bool exists (const char* path) = 0;
+   virtual bool remove (const char* path) = 0;
+   virtual size_t size (const char* path) = 0;
+   // Read up to len bytes at offset. Returns the bytes read.
+   virtual size_t read (const char* path, size_t offset, uint8_t* buf, size_t len) = 0;
+   // Add to the end of the file, creating it if needed. Returns the bytes written.
+   virtual size_t append (const char* path, const uint8_t* buf, size_t len) = 0;
+   // Replace the content of the file. Returns the bytes written.
+   virtual size_t write (const char* path, const uint8_t* buf, size_t len) = 0;
+};
+
+// Station side of the radio
+class WifiLink
+{
+public:
+   // Whether a network is configured. The credentials stay in the radio's own storage.
+   virtual bool hasCredentials () = 0;
+   // Start joining the configured network without waiting. With a bssid straight to that
+   // access point on channel, otherwise after a scan of every channel.
+   virtual void begin (const uint8_t* bssid, uint8_t channel) = 0;
+   virtual bool connected () = 0;
+   // Access point and channel of the current connection
+   virtual void accessPoint (uint8_t* bssid, uint8_t& channel) = 0;
+};
+
+// Progress of a background connection attempt
+enum ConnectStatus
+{
+   CONNECT_PENDING,
+   CONNECT_DONE,
+   CONNECT_FAILED
+};
+
+// Connection to the MQTT broker
+class MqttTransport
+{
+public:
+   virtual bool connected () = 0;
+   // Start resolving, connecting and sending CONNECT with a retained last will message,
+   // without blocking the caller. Returns false when an attempt is already running.
+   virtual bool startConnect (const char* clientId, const char* willTopic, const char* willMessage) = 0;
+   virtual ConnectStatus pollConnect () = 0;
+   virtual bool publish (const char* topic, const char* payload, bool retained) = 0;
+   // Service the connection, call regularly.
+   virtual void loop () = 0;
+   // Client specific connection state, for debugging
+   virtual int state () = 0;
+};
+
+#endif
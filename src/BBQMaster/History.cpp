@@ -0,0 +1,175 @@
+#include <string.h>
+#include "History.h"
+
+// Keep the whole store within a fixed RAM budget.
+static_assert (sizeof (HistoryStore) <= 20 * 1024, "History store exceeds its RAM budget");
+
+// Number of leading entries of a tier older than the given time.
+template <typename T, size_t N>
+static size_t countBefore (const AtomicRingBuffer<T, N>& tier, int32_t time)
+{
+   size_t low = 0, high = tier.size ();
+   while (low < high)
+   {
+      size_t mid = (low + high) / 2;
+      if (tier[mid].m_time < time)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return low;
+}
+
+void Accumulator::reset (int32_t bucket)
+{
+   m_bucket = bucket;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      m_sum[i] = 0;
+      m_count[i] = 0;
+      m_min[i] = INT16_MAX;
+      m_max[i] = INT16_MIN;
+   }
+}
+
+bool Accumulator::flush (AggPoint& out) const
+{
+   out.m_time = m_bucket;
+   out.m_avail = 0;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      if (m_count[i])
+      {
+         out.m_avail |= 1 << i;
+         out.m_min[i] = m_min[i];
+         out.m_max[i] = m_max[i];
+         out.m_avg[i] = (int16_t)((m_sum[i] + (m_sum[i] >= 0 ? 1 : -1) * (m_count[i] / 2)) / m_count[i]);
+      }
+      else
+      {
+         out.m_min[i] = 0;
+         out.m_max[i] = 0;
+         out.m_avg[i] = 0;
+      }
+   }
+   return out.m_avail != 0;
+}
+
+bool Accumulator::add (const HistPoint& point, int32_t period, AggPoint& out)
+{
+   int32_t bucket = point.m_time - point.m_time % period;
+   bool closed = false;
+   if (bucket != m_bucket)
+   {
+      closed = flush (out);
+      reset (bucket);
+   }
+
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      if (point.available (i))
+      {
+         int16_t temp = point.m_temp[i];
+         m_sum[i] += temp;
+         m_count[i]++;
+         if (temp < m_min[i])
+            m_min[i] = temp;
+         if (temp > m_max[i])
+            m_max[i] = temp;
+      }
+   }
+   return closed;
+}
+
+void HistoryStore::beginChange ()
+{
+   // The release stores of the tiers keep the odd sequence ahead of them.
+   m_seq.store (m_seq.load (std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void HistoryStore::endChange ()
+{
+   m_seq.store (m_seq.load (std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void HistoryStore::add (const HistPoint& point)
+{
+   beginChange ();
+   m_raw.push (point);
+
+   AggPoint agg;
+   if (m_minAcc.add (point, HIST_MIN_PERIOD, agg))
+      m_min.push (agg);
+   if (m_tenMinAcc.add (point, HIST_TEN_MIN_PERIOD, agg))
+      m_tenMin.push (agg);
+   endChange ();
+}
+
+void HistoryStore::clear ()
+{
+   beginChange ();
+   m_raw.clear ();
+   m_min.clear ();
+   m_tenMin.clear ();
+   m_minAcc.reset (0);
+   m_tenMinAcc.reset (0);
+   endChange ();
+}
+
+HistoryStore::View::View (const HistoryStore& store) : m_store (store), m_seq (store.m_seq.load (std::memory_order_acquire))
+{
+   int32_t rawStart = store.m_raw.empty () ? INT32_MAX : store.m_raw[0].m_time;
+   int32_t minStart = rawStart;
+   if (!store.m_min.empty () && store.m_min[0].m_time < minStart)
+      minStart = store.m_min[0].m_time;
+
+   m_rawCount = store.m_raw.size ();
+   m_minCount = countBefore (store.m_min, rawStart);
+   m_tenMinCount = countBefore (store.m_tenMin, minStart);
+}
+
+HistRecord HistoryStore::View::operator[] (size_t index) const
+{
+   if (index >= m_tenMinCount + m_minCount)
+      return toRecord (m_store.m_raw[index - m_tenMinCount - m_minCount]);
+
+   bool tenMin = index < m_tenMinCount;
+   AggPoint agg = tenMin ? m_store.m_tenMin[index] : m_store.m_min[index - m_tenMinCount];
+   HistRecord record;
+   record.m_time = agg.m_time;
+   record.m_avail = agg.m_avail;
+   record.m_period = tenMin ? HIST_TEN_MIN_PERIOD : HIST_MIN_PERIOD;
+   memcpy (record.m_avg, agg.m_avg, sizeof (record.m_avg));
+   memcpy (record.m_min, agg.m_min, sizeof (record.m_min));
+   memcpy (record.m_max, agg.m_max, sizeof (record.m_max));
+   return record;
+}
+
+bool HistoryStore::View::consistent () const
+{
+   // The acquire loads of the tiers keep this load behind them.
+   return !(m_seq & 1) && m_store.m_seq.load (std::memory_order_relaxed) == m_seq;
+}
+
+int32_t HistoryStore::View::time (size_t index) const
+{
+   if (index < m_tenMinCount)
+      return m_store.m_tenMin[index].m_time;
+   if (index < m_tenMinCount + m_minCount)
+      return m_store.m_min[index - m_tenMinCount].m_time;
+   return m_store.m_raw[index - m_tenMinCount - m_minCount].m_time;
+}
+
+size_t HistoryStore::View::upperBound (int32_t time) const
+{
+   size_t low = 0, high = size ();
+   while (low < high)
+   {
+      size_t mid = (low + high) / 2;
+      if (this->time (mid) <= time)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return low;
+}
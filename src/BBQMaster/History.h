@@ -0,0 +1,203 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+#include "Snapshot.h"
+
+// Number of probe channels on the board (4 NTC + 4 thermocouples).
+#define SENSOR_COUNT 8
+
+// Tier sizes. Raw holds the last 20 minutes at HIST_INT, the 1 minute tier the last
+// 2 hours and the 10 minute tier 20 hours, enough for an overnight cook.
+#define HIST_RAW_SIZE 240
+#define HIST_MIN_SIZE 120
+#define HIST_TEN_MIN_SIZE 120
+#define HIST_MIN_PERIOD 60
+#define HIST_TEN_MIN_PERIOD 600
+// Reads of the history given up after this many changes overtook them
+#define HIST_READ_TRIES 8
+
+// Shared channel table. Every reading and history entry refers to a channel by index.
+extern const char* const g_channelNames[SENSOR_COUNT];
+
+// Compact history entry. Temperatures are stored as tenths of a degree F.
+struct HistPoint
+{
+   // Epoch time of the sample
+   int32_t m_time;
+   // Bit i is set when sensor i was available
+   uint8_t m_avail;
+   // Temperature in 0.1 F
+   int16_t m_temp[SENSOR_COUNT];
+
+   bool available (int channel) const { return m_avail & (1 << channel); }
+   float tempF (int channel) const { return m_temp[channel] / 10.0f; }
+};
+
+// Convert a temperature to the tenth of a degree representation used in the history.
+inline int16_t toTenths (double tempF)
+{
+   double tenths = tempF * 10.0;
+   if (tenths > INT16_MAX)
+      return INT16_MAX;
+   if (tenths < INT16_MIN)
+      return INT16_MIN;
+   return (int16_t)(tenths < 0 ? tenths - 0.5 : tenths + 0.5);
+}
+
+// Statically allocated ring buffer. Appending evicts the oldest entry once the buffer is full.
+template <typename T, size_t N>
+class RingBuffer
+{
+public:
+   RingBuffer () : m_head (0), m_size (0) {}
+
+   // Append an item, overwriting the oldest one when full. O(1).
+   void push (const T& item)
+   {
+      m_items[(m_head + m_size) % N] = item;
+      if (m_size < N)
+         m_size++;
+      else
+         m_head = (m_head + 1) % N;
+   }
+
+   // Item at index, 0 being the oldest.
+   const T& operator[] (size_t index) const { return m_items[(m_head + index) % N]; }
+   const T& back () const { return (*this)[m_size - 1]; }
+   const T& front () const { return (*this)[0]; }
+   // Drop the oldest item. O(1).
+   void popFront ()
+   {
+      m_head = (m_head + 1) % N;
+      m_size--;
+   }
+
+   size_t size () const { return m_size; }
+   bool empty () const { return m_size == 0; }
+   bool full () const { return m_size == N; }
+   void clear () { m_head = 0; m_size = 0; }
+   static constexpr size_t capacity () { return N; }
+
+private:
+   T m_items[N];
+   size_t m_head;
+   size_t m_size;
+};
+
+// Rolled up entry of a coarse tier. Temperatures are stored as tenths of a degree F.
+struct AggPoint
+{
+   // Start of the bucket
+   int32_t m_time;
+   // Bit i is set when sensor i had at least one valid sample in the bucket
+   uint8_t m_avail;
+   int16_t m_min[SENSOR_COUNT];
+   int16_t m_max[SENSOR_COUNT];
+   int16_t m_avg[SENSOR_COUNT];
+};
+
+// Running min/max/sum of the bucket currently being filled.
+class Accumulator
+{
+public:
+   Accumulator () { reset (0); }
+
+   // Feed one raw sample. Returns true and fills out when the sample closed the previous bucket.
+   bool add (const HistPoint& point, int32_t period, AggPoint& out);
+   void reset (int32_t bucket);
+
+private:
+   bool flush (AggPoint& out) const;
+
+   int32_t m_bucket;
+   int32_t m_sum[SENSOR_COUNT];
+   uint16_t m_count[SENSOR_COUNT];
+   int16_t m_min[SENSOR_COUNT];
+   int16_t m_max[SENSOR_COUNT];
+};
+
+// One entry of the history regardless of the tier it comes from, copied out of the store.
+struct HistRecord
+{
+   int32_t m_time;
+   uint8_t m_avail;
+   // Bucket length in seconds, 0 for raw samples
+   int32_t m_period;
+   int16_t m_avg[SENSOR_COUNT];
+   int16_t m_min[SENSOR_COUNT];
+   int16_t m_max[SENSOR_COUNT];
+
+   bool available (int channel) const { return m_avail & (1 << channel); }
+};
+
+// Record of a raw sample.
+inline HistRecord toRecord (const HistPoint& point)
+{
+   HistRecord record;
+   record.m_time = point.m_time;
+   record.m_avail = point.m_avail;
+   record.m_period = 0;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      record.m_avg[i] = point.m_temp[i];
+      record.m_min[i] = point.m_temp[i];
+      record.m_max[i] = point.m_temp[i];
+   }
+   return record;
+}
+
+// Multi resolution history of a cook. Every sample goes into the raw tier and is rolled
+// up incrementally into the 1 minute and 10 minute tiers. RAM usage is fixed.
+//
+// One task changes the store (the sensor task, or setup () before it runs) while the web
+// handlers read it. Changes are framed by a sequence number, odd while one is under way:
+// a reader checks it did not move with View::consistent () and otherwise reads again.
+// The writer never waits for the readers.
+class HistoryStore
+{
+public:
+   HistoryStore () : m_seq (0) {}
+
+   void add (const HistPoint& point);
+   void clear ();
+   // Bumped by every change, so serialized copies can tell they are out of date
+   uint32_t revision () const { return m_seq.load (std::memory_order_acquire); }
+
+   // Whole cook from oldest to newest, coarse tiers only covering the time before the finer ones.
+   class View
+   {
+   public:
+      explicit View (const HistoryStore& store);
+      size_t size () const { return m_tenMinCount + m_minCount + m_rawCount; }
+      HistRecord operator[] (size_t index) const;
+      // Time of the record at index, cheaper than the whole record.
+      int32_t time (size_t index) const;
+      // Index of the first record newer than time, size () when there is none.
+      size_t upperBound (int32_t time) const;
+      // Whether the store did not change since the view was taken, so what was read is one state of it.
+      bool consistent () const;
+
+   private:
+      const HistoryStore& m_store;
+      uint32_t m_seq;
+      size_t m_tenMinCount;
+      size_t m_minCount;
+      size_t m_rawCount;
+   };
+
+private:
+   void beginChange ();
+   void endChange ();
+
+   AtomicRingBuffer<HistPoint, HIST_RAW_SIZE> m_raw;
+   AtomicRingBuffer<AggPoint, HIST_MIN_SIZE> m_min;
+   AtomicRingBuffer<AggPoint, HIST_TEN_MIN_SIZE> m_tenMin;
+   Accumulator m_minAcc;
+   Accumulator m_tenMinAcc;
+   std::atomic<uint32_t> m_seq;
+};
+
+#endif
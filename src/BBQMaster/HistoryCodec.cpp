@@ -0,0 +1,105 @@
+#include "HistoryCodec.h"
+#include <string.h>
+
+// Writes bytes to a buffer, or only counts them when there is no buffer.
+class ByteSink
+{
+public:
+   ByteSink (uint8_t* out, size_t capacity) : m_out (out), m_capacity (capacity), m_len (0) {}
+
+   void byte (uint8_t value)
+   {
+      if (m_out && m_len < m_capacity)
+         m_out[m_len] = value;
+      m_len++;
+   }
+
+   void varint (uint32_t value)
+   {
+      while (value >= 0x80)
+      {
+         byte ((uint8_t)(value | 0x80));
+         value >>= 7;
+      }
+      byte ((uint8_t)value);
+   }
+
+   void svarint (int32_t value)
+   {
+      varint (((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+   }
+
+   size_t length () const { return m_len; }
+
+private:
+   uint8_t* m_out;
+   size_t m_capacity;
+   size_t m_len;
+};
+
+size_t encodeHistoryBin (const HistoryStore::View& hist, int32_t since, uint8_t* out, size_t capacity)
+{
+   ByteSink sink (out, capacity);
+   size_t first = hist.upperBound (since);
+   size_t count = hist.size () - first;
+
+   sink.byte ('B');
+   sink.byte ('B');
+   sink.byte ('Q');
+   sink.byte ('H');
+   sink.byte (HIST_BIN_VERSION);
+
+   sink.byte (SENSOR_COUNT);
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      size_t len = strlen (g_channelNames[i]);
+      sink.byte ((uint8_t)len);
+      for (size_t c = 0; c < len; c++)
+         sink.byte ((uint8_t)g_channelNames[i][c]);
+   }
+
+   int32_t start = count ? hist.time (first) : 0;
+   sink.varint (count);
+   sink.svarint (start);
+
+   int32_t prevTime = start;
+   for (size_t p = first; p < hist.size (); p++)
+   {
+      int32_t time = hist.time (p);
+      sink.svarint (time - prevTime);
+      prevTime = time;
+   }
+   for (size_t p = first; p < hist.size (); p++)
+      sink.varint (hist[p].m_period);
+   for (size_t p = first; p < hist.size (); p++)
+      sink.byte (hist[p].m_avail);
+
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      int32_t prev = 0;
+      for (size_t p = first; p < hist.size (); p++)
+      {
+         HistRecord record = hist[p];
+         if (record.available (i))
+         {
+            sink.svarint (record.m_avg[i] - prev);
+            prev = record.m_avg[i];
+         }
+      }
+   }
+
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      for (size_t p = first; p < hist.size (); p++)
+      {
+         HistRecord record = hist[p];
+         if (record.m_period && record.available (i))
+         {
+            sink.varint (record.m_avg[i] - record.m_min[i]);
+            sink.varint (record.m_max[i] - record.m_avg[i]);
+         }
+      }
+   }
+
+   return sink.length ();
+}
@@ -0,0 +1,26 @@
+#ifndef HISTORY_CODEC_H
+#define HISTORY_CODEC_H
+
+#include "History.h"
+
+// Version of the /history.bin layout.
+#define HIST_BIN_VERSION 1
+
+// Columnar binary encoding of the history, served as /history.bin.
+// All multi byte integers are LEB128 varints, signed ones zigzag encoded first.
+//
+//   "BBQH", u8 version
+//   u8 channel count, then per channel: u8 name length, name
+//   varint record count, svarint start time
+//   time column:    per record svarint delta from the previous time (first from start time)
+//   period column:  per record varint bucket length in seconds, 0 for raw samples
+//   avail column:   per record u8 availability mask
+//   value columns:  per channel, per record where available: svarint delta of the
+//                   average in 0.1 F from the previous value of that channel (starting at 0)
+//   range columns:  per channel, per rolled up record where available: varint avg - min, varint max - avg
+//
+// Encodes the records newer than since into out, writing at most capacity bytes, and
+// returns the full length. Pass a null out to only compute the length.
+size_t encodeHistoryBin (const HistoryStore::View& hist, int32_t since, uint8_t* out, size_t capacity);
+
+#endif
@@ -0,0 +1,139 @@
+#include "Metrics.h"
+#include "Sensors.h"
+#include "MqttPublisher.h"
+#include "PitController.h"
+#include "Power.h"
+#include "ResponseCache.h"
+#include "TextWriter.h"
+
+StageStats g_stageStats[STAGE_COUNT];
+std::atomic<uint32_t> g_invalidReadings[SENSOR_COUNT];
+std::atomic<uint32_t> g_sensorConversions (0);
+std::atomic<uint32_t> g_mqttPublishFailures (0);
+std::atomic<uint32_t> g_mqttConnects (0);
+std::atomic<uint32_t> g_mqttConnectFailures (0);
+std::atomic<uint32_t> g_mqttBacklogDropped (0);
+std::atomic<uint32_t> g_httpRequests[HTTP_ENDPOINT_COUNT];
+std::atomic<uint32_t> g_httpNotModified (0);
+std::atomic<uint32_t> g_responseCacheHits (0);
+std::atomic<uint32_t> g_responseCacheBuilds (0);
+std::atomic<uint32_t> g_httpRejected (0);
+std::atomic<uint32_t> g_wifiConnects (0);
+std::atomic<uint32_t> g_wifiScans (0);
+std::atomic<uint32_t> g_histPendingDropped (0);
+std::atomic<uint32_t> g_bootMillis[BOOT_STAGE_COUNT];
+
+static const char* const s_stageNames[STAGE_COUNT] = {"loop", "read_sensors", "history", "mqtt_publish"};
+static const char* const s_bootStageNames[BOOT_STAGE_COUNT] = {"config", "first_sample", "history", "wifi", "time", "mqtt"};
+static const char* const s_endpointNames[HTTP_ENDPOINT_COUNT] = {"/measures.json", "/history.json", "/history.bin", "/cook.log", "/metrics", "static", "/alarms", "/pid"};
+
+void StageStats::takeWindow (uint32_t& avgMicros, uint32_t& maxMicros)
+{
+   uint32_t runs = m_windowRuns.exchange (0, std::memory_order_relaxed);
+   uint32_t micros = m_windowMicros.exchange (0, std::memory_order_relaxed);
+   maxMicros = m_windowMax.exchange (0, std::memory_order_relaxed);
+   avgMicros = runs ? micros / runs : 0;
+}
+
+// Prometheus text, written as it is formatted.
+class MetricsWriter : public TextWriter
+{
+public:
+   MetricsWriter (char* buf, size_t size) : TextWriter (buf, size) {}
+
+   void header (const char* name, const char* type, const char* help)
+   {
+      print ("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+   }
+};
+
+size_t formatMetrics (char* buf, size_t size, const HeapStats& heap, uint32_t uptimeSeconds)
+{
+   MetricsWriter out (buf, size);
+
+   out.header ("bbq_uptime_seconds", "gauge", "Time since boot.");
+   out.print ("bbq_uptime_seconds %u\n", (unsigned)uptimeSeconds);
+   out.header ("bbq_boot_stage_milliseconds", "gauge", "Time from the start of the firmware to each boot stage, missing until it is reached.");
+   for (int i = 0; i < BOOT_STAGE_COUNT; i++)
+   {
+      uint32_t ms = g_bootMillis[i].load (std::memory_order_relaxed);
+      if (ms)
+         out.print ("bbq_boot_stage_milliseconds{stage=\"%s\"} %u\n", s_bootStageNames[i], (unsigned)ms);
+   }
+
+   uint32_t avg[STAGE_COUNT];
+   uint32_t max[STAGE_COUNT];
+   for (int i = 0; i < STAGE_COUNT; i++)
+      g_stageStats[i].takeWindow (avg[i], max[i]);
+   out.header ("bbq_stage_runs_total", "counter", "Runs of each pipeline stage.");
+   for (int i = 0; i < STAGE_COUNT; i++)
+      out.print ("bbq_stage_runs_total{stage=\"%s\"} %u\n", s_stageNames[i], (unsigned)g_stageStats[i].runs ());
+   out.header ("bbq_stage_avg_microseconds", "gauge", "Average run time of each stage since the last scrape.");
+   for (int i = 0; i < STAGE_COUNT; i++)
+      out.print ("bbq_stage_avg_microseconds{stage=\"%s\"} %u\n", s_stageNames[i], (unsigned)avg[i]);
+   out.header ("bbq_stage_max_microseconds", "gauge", "Longest run of each stage since the last scrape.");
+   for (int i = 0; i < STAGE_COUNT; i++)
+      out.print ("bbq_stage_max_microseconds{stage=\"%s\"} %u\n", s_stageNames[i], (unsigned)max[i]);
+
+   out.header ("bbq_heap_free_bytes", "gauge", "Free heap.");
+   out.print ("bbq_heap_free_bytes %u\n", (unsigned)heap.m_free);
+   out.header ("bbq_heap_min_free_bytes", "gauge", "Lowest free heap since boot.");
+   out.print ("bbq_heap_min_free_bytes %u\n", (unsigned)heap.m_minFree);
+   out.header ("bbq_heap_largest_block_bytes", "gauge", "Largest block that can be allocated.");
+   out.print ("bbq_heap_largest_block_bytes %u\n", (unsigned)heap.m_largestBlock);
+
+   out.header ("bbq_invalid_readings_total", "counter", "Readings rejected as out of range, unplugged probes included.");
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      out.print ("bbq_invalid_readings_total{channel=\"%s\"} %u\n", g_channelNames[i], (unsigned)g_invalidReadings[i].load (std::memory_order_relaxed));
+   out.header ("bbq_sensor_conversions_total", "counter", "Channel conversions of the sensor task.");
+   out.print ("bbq_sensor_conversions_total %u\n", (unsigned)g_sensorConversions.load (std::memory_order_relaxed));
+   out.header ("bbq_sample_interval_seconds", "gauge", "Current sampling interval of each channel.");
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      out.print ("bbq_sample_interval_seconds{channel=\"%s\"} %.1f\n", g_channelNames[i], g_samplePlanner.interval (i) / 1000.0);
+   out.header ("bbq_power_mode", "gauge", "Power mode in effect.");
+   out.print ("bbq_power_mode{mode=\"%s\"} 1\n", g_powerModeNames[g_samplePlanner.mode ()]);
+   out.header ("bbq_queue_dropped_total", "counter", "Items dropped between the sensor task and the network side.");
+   out.print ("bbq_queue_dropped_total{queue=\"readings\"} %u\n", (unsigned)g_readings.dropped ());
+   out.print ("bbq_queue_dropped_total{queue=\"history\"} %u\n", (unsigned)g_histPoints.dropped ());
+   out.print ("bbq_queue_dropped_total{queue=\"pending_history\"} %u\n", (unsigned)g_histPendingDropped.load (std::memory_order_relaxed));
+
+   out.header ("bbq_wifi_connects_total", "counter", "Joins of the WiFi network.");
+   out.print ("bbq_wifi_connects_total %u\n", (unsigned)g_wifiConnects.load (std::memory_order_relaxed));
+   out.header ("bbq_wifi_scans_total", "counter", "Joins that scanned every channel instead of going to the cached access point.");
+   out.print ("bbq_wifi_scans_total %u\n", (unsigned)g_wifiScans.load (std::memory_order_relaxed));
+
+   out.header ("bbq_mqtt_publish_failures_total", "counter", "MQTT messages that could not be published.");
+   out.print ("bbq_mqtt_publish_failures_total %u\n", (unsigned)g_mqttPublishFailures.load (std::memory_order_relaxed));
+   out.header ("bbq_mqtt_connects_total", "counter", "Successful connections to the MQTT broker.");
+   out.print ("bbq_mqtt_connects_total %u\n", (unsigned)g_mqttConnects.load (std::memory_order_relaxed));
+   out.header ("bbq_mqtt_connect_failures_total", "counter", "Failed connection attempts to the MQTT broker.");
+   out.print ("bbq_mqtt_connect_failures_total %u\n", (unsigned)g_mqttConnectFailures.load (std::memory_order_relaxed));
+
+   out.header ("bbq_mqtt_backlog", "gauge", "States waiting to be published.");
+   out.print ("bbq_mqtt_backlog %u\n", (unsigned)g_mqttPublisher.backlog ());
+   out.header ("bbq_mqtt_backlog_dropped_total", "counter", "States lost because the backlog was full.");
+   out.print ("bbq_mqtt_backlog_dropped_total %u\n", (unsigned)g_mqttBacklogDropped.load (std::memory_order_relaxed));
+
+   out.header ("bbq_pit_fan_duty", "gauge", "Duty of the pit blower, 0 to 1.");
+   out.print ("bbq_pit_fan_duty %.2f\n", (double)g_pitController.duty ());
+   out.header ("bbq_pit_lid_openings_total", "counter", "Lid openings detected by the pit control.");
+   out.print ("bbq_pit_lid_openings_total %u\n", (unsigned)g_pitController.lidOpenings ());
+
+   out.header ("bbq_http_requests_total", "counter", "HTTP requests of each endpoint.");
+   for (int i = 0; i < HTTP_ENDPOINT_COUNT; i++)
+      out.print ("bbq_http_requests_total{endpoint=\"%s\"} %u\n", s_endpointNames[i], (unsigned)g_httpRequests[i].load (std::memory_order_relaxed));
+   out.header ("bbq_http_not_modified_total", "counter", "Static asset requests answered with 304 Not Modified.");
+   out.print ("bbq_http_not_modified_total %u\n", (unsigned)g_httpNotModified.load (std::memory_order_relaxed));
+   out.header ("bbq_http_in_flight", "gauge", "Data endpoint responses being sent.");
+   out.print ("bbq_http_in_flight %u\n", (unsigned)g_responsesInFlight.load (std::memory_order_relaxed));
+   out.header ("bbq_http_rejected_total", "counter", "Data endpoint requests answered 503 because too many responses were in flight.");
+   out.print ("bbq_http_rejected_total %u\n", (unsigned)g_httpRejected.load (std::memory_order_relaxed));
+   out.header ("bbq_response_cache_hits_total", "counter", "Data endpoint responses sharing a body already serialized.");
+   out.print ("bbq_response_cache_hits_total %u\n", (unsigned)g_responseCacheHits.load (std::memory_order_relaxed));
+   out.header ("bbq_response_cache_builds_total", "counter", "Bodies serialized for the data endpoints.");
+   out.print ("bbq_response_cache_builds_total %u\n", (unsigned)g_responseCacheBuilds.load (std::memory_order_relaxed));
+   out.header ("bbq_response_cache_bytes", "gauge", "Heap held by the cached bodies, those still being sent included.");
+   out.print ("bbq_response_cache_bytes %u\n", (unsigned)g_responseBytes.load (std::memory_order_relaxed));
+
+   return out.length ();
+}
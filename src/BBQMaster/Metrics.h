@@ -0,0 +1,123 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include "History.h"
+
+// Largest /metrics document
+#define METRICS_TEXT_MAX 8192
+
+// Timed stages of the pipeline
+enum MetricStage
+{
+   STAGE_LOOP,
+   STAGE_READ_SENSORS,
+   STAGE_HISTORY,
+   STAGE_MQTT_PUBLISH,
+   STAGE_COUNT
+};
+
+// Endpoints with a request counter
+enum HttpEndpoint
+{
+   HTTP_MEASURES,
+   HTTP_HISTORY,
+   HTTP_HISTORY_BIN,
+   HTTP_COOK_LOG,
+   HTTP_METRICS,
+   HTTP_STATIC,
+   HTTP_ALARMS,
+   HTTP_PID,
+   HTTP_ENDPOINT_COUNT
+};
+
+// Milestones of the boot, in the order they are normally reached
+enum BootStage
+{
+   BOOT_CONFIG,
+   BOOT_FIRST_SAMPLE,
+   BOOT_HISTORY,
+   BOOT_WIFI,
+   BOOT_TIME,
+   BOOT_MQTT,
+   BOOT_STAGE_COUNT
+};
+
+// Run time of a stage. Average and max cover the window since the last scrape.
+// Recording is a few relaxed atomic adds, cheap enough to leave on in production.
+class StageStats
+{
+public:
+   StageStats () : m_runs (0), m_windowRuns (0), m_windowMicros (0), m_windowMax (0) {}
+
+   void record (uint32_t micros)
+   {
+      m_runs.fetch_add (1, std::memory_order_relaxed);
+      m_windowRuns.fetch_add (1, std::memory_order_relaxed);
+      m_windowMicros.fetch_add (micros, std::memory_order_relaxed);
+      uint32_t max = m_windowMax.load (std::memory_order_relaxed);
+      while (micros > max && !m_windowMax.compare_exchange_weak (max, micros, std::memory_order_relaxed))
+         ;
+   }
+
+   uint32_t runs () const { return m_runs.load (std::memory_order_relaxed); }
+   // Close the window, returning its average and max in microseconds.
+   void takeWindow (uint32_t& avgMicros, uint32_t& maxMicros);
+
+private:
+   std::atomic<uint32_t> m_runs;
+   std::atomic<uint32_t> m_windowRuns;
+   std::atomic<uint32_t> m_windowMicros;
+   std::atomic<uint32_t> m_windowMax;
+};
+
+// Heap state, read by the board
+struct HeapStats
+{
+   uint32_t m_free;
+   uint32_t m_minFree;
+   uint32_t m_largestBlock;
+};
+
+extern StageStats g_stageStats[STAGE_COUNT];
+// Readings rejected by isValidTemp, unplugged probes included
+extern std::atomic<uint32_t> g_invalidReadings[SENSOR_COUNT];
+// Channel conversions of the sensor task
+extern std::atomic<uint32_t> g_sensorConversions;
+extern std::atomic<uint32_t> g_mqttPublishFailures;
+extern std::atomic<uint32_t> g_mqttConnects;
+extern std::atomic<uint32_t> g_mqttConnectFailures;
+// States lost because the MQTT backlog overflowed during an outage
+extern std::atomic<uint32_t> g_mqttBacklogDropped;
+extern std::atomic<uint32_t> g_httpRequests[HTTP_ENDPOINT_COUNT];
+extern std::atomic<uint32_t> g_httpNotModified;
+// Data endpoint responses served from a cached body, bodies serialized, and requests turned away with 503
+extern std::atomic<uint32_t> g_responseCacheHits;
+extern std::atomic<uint32_t> g_responseCacheBuilds;
+extern std::atomic<uint32_t> g_httpRejected;
+// Joins of the WiFi network, and how many of them needed a scan of every channel
+extern std::atomic<uint32_t> g_wifiConnects;
+extern std::atomic<uint32_t> g_wifiScans;
+// History points lost while waiting for the wall clock
+extern std::atomic<uint32_t> g_histPendingDropped;
+// Milliseconds from the start of the firmware to each boot stage, 0 until it is reached
+extern std::atomic<uint32_t> g_bootMillis[BOOT_STAGE_COUNT];
+
+inline void countMetric (std::atomic<uint32_t>& counter)
+{
+   counter.fetch_add (1, std::memory_order_relaxed);
+}
+
+// Record the first time a boot stage is reached.
+inline void markBoot (BootStage stage, uint32_t nowMillis)
+{
+   uint32_t unset = 0;
+   g_bootMillis[stage].compare_exchange_strong (unset, nowMillis ? nowMillis : 1, std::memory_order_relaxed);
+}
+
+// Write every metric in the Prometheus text format. Returns the length written.
+size_t formatMetrics (char* buf, size_t size, const HeapStats& heap, uint32_t uptimeSeconds);
+
+#endif
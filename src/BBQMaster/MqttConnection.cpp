@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "MqttConnection.h"
+#include "MqttPublisher.h"
+#include "Network.h"
+#include "Metrics.h"
+#include "Debug.h"
+
+MqttConnection g_mqttConnection;
+
+void MqttConnection::retryLater (uint32_t nowMillis)
+{
+   uint32_t delay = MQTT_BACKOFF_MIN;
+   for (uint8_t i = 0; i < m_failures && delay < MQTT_BACKOFF_MAX; i++)
+      delay *= 2;
+   if (delay > MQTT_BACKOFF_MAX)
+      delay = MQTT_BACKOFF_MAX;
+   if (m_failures < 16)
+      m_failures++;
+
+   // Anywhere in the upper half, so devices that lost the broker together do not come back together.
+   delay = delay / 2 + rand () % (delay / 2 + 1);
+   m_nextAttempt = nowMillis + delay;
+   m_state = MQTT_WAITING;
+
+   DEBUG_PRINT("MQTT retry in ms: ");
+   DEBUG_PRINTLN(delay);
+}
+
+void MqttConnection::service (uint32_t nowMillis)
+{
+   switch (m_state)
+   {
+   case MQTT_WAITING:
+   {
+      if ((int32_t)(nowMillis - m_nextAttempt) < 0)
+         break;
+      char clientId[20];
+      snprintf (clientId, 20, "BBQMaster_%x", rand () & 0xffff);
+      DEBUG_PRINT("Connecting to MQTT with client id ");
+      DEBUG_PRINTLN(clientId);
+      if (g_mqtt->startConnect (clientId, g_mqttTopics.m_avail, "offline"))
+         m_state = MQTT_CONNECTING;
+      // No helper task for the attempt, or the last one is still running.
+      else
+      {
+         countMetric (g_mqttConnectFailures);
+         retryLater (nowMillis);
+      }
+      break;
+   }
+
+   case MQTT_CONNECTING:
+   {
+      ConnectStatus status = g_mqtt->pollConnect ();
+      if (status == CONNECT_DONE)
+      {
+         countMetric (g_mqttConnects);
+         g_mqttPublisher.onConnect ();
+         publishAvailability ();
+         m_discoveryStep = 0;
+         m_state = MQTT_DISCOVERY;
+      }
+      else if (status == CONNECT_FAILED)
+      {
+         countMetric (g_mqttConnectFailures);
+         DEBUG_PRINT("Failed to connect to MQTT! ");
+         DEBUG_PRINTLN(g_mqtt->state ());
+         retryLater (nowMillis);
+      }
+      break;
+   }
+
+   case MQTT_DISCOVERY:
+      if (!g_mqtt->connected ())
+         retryLater (nowMillis);
+      // One config message per iteration instead of all of them back to back.
+      else if (!publishDiscoveryStep (m_discoveryStep++))
+      {
+         m_failures = 0;
+         m_state = MQTT_ONLINE;
+         markBoot (BOOT_MQTT, nowMillis);
+      }
+      break;
+
+   case MQTT_ONLINE:
+      if (!g_mqtt->connected ())
+      {
+         DEBUG_PRINTLN("Lost the MQTT connection");
+         retryLater (nowMillis);
+      }
+      break;
+   }
+}
@@ -0,0 +1,43 @@
+#ifndef MQTT_CONNECTION_H
+#define MQTT_CONNECTION_H
+
+#include <stdint.h>
+
+// Retry delays after a failed attempt, doubling from the first to the last
+#define MQTT_BACKOFF_MIN 2000
+#define MQTT_BACKOFF_MAX 300000
+
+// Non blocking life cycle of the broker session: wait for the retry time, connect in the
+// background, send the discovery one message per call, then stay online until the
+// connection drops. Failures back off exponentially with jitter.
+class MqttConnection
+{
+public:
+   enum State
+   {
+      MQTT_WAITING,
+      MQTT_CONNECTING,
+      MQTT_DISCOVERY,
+      MQTT_ONLINE
+   };
+
+   MqttConnection () : m_state (MQTT_WAITING), m_nextAttempt (0), m_failures (0), m_discoveryStep (0) {}
+
+   // Advance the state machine. Call from loop (), never blocks.
+   void service (uint32_t nowMillis);
+   // Whether states can be published
+   bool online () const { return m_state == MQTT_ONLINE; }
+   State state () const { return m_state; }
+
+private:
+   void retryLater (uint32_t nowMillis);
+
+   State m_state;
+   uint32_t m_nextAttempt;
+   uint8_t m_failures;
+   int m_discoveryStep;
+};
+
+extern MqttConnection g_mqttConnection;
+
+#endif
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "MqttPublisher.h"
+#include "Network.h"
+#include "Metrics.h"
+#include "Estimator.h"
+#include "TextWriter.h"
+
+MqttPublisher g_mqttPublisher;
+
+MqttPublisher::MqttPublisher () : m_hasQueued (false), m_lastQueuedMillis (0), m_pendingSince (0), m_batchPeriod (0), m_avail (0), m_availPublished (0), m_availKnown (false)
+{
+}
+
+bool MqttPublisher::changed (const HistPoint& point) const
+{
+   if (point.m_avail != m_lastQueued.m_avail)
+      return true;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      if (point.available (i) && abs (point.m_temp[i] - m_lastQueued.m_temp[i]) >= MQTT_DEADBAND_TENTHS)
+         return true;
+   }
+   return false;
+}
+
+void MqttPublisher::offer (const DataPoint& reading, float battery, uint32_t nowMillis)
+{
+   MqttSample sample;
+   sample.m_point = toHistPoint (reading);
+   sample.m_battery = battery < 0 ? 0 : (uint8_t)(battery + 0.5f);
+   m_avail = sample.m_point.m_avail;
+
+   uint32_t elapsed = nowMillis - m_lastQueuedMillis;
+   bool due = !m_hasQueued || elapsed >= MQTT_MAX_PUBLISH_PERIOD || (elapsed >= MQTT_MIN_PUBLISH_PERIOD && changed (sample.m_point));
+   if (!due)
+      return;
+
+   // A full queue loses its oldest state rather than the newest.
+   if (m_queue.full ())
+      countMetric (g_mqttBacklogDropped);
+   if (m_queue.empty ())
+      m_pendingSince = nowMillis;
+   m_queue.push (sample);
+   m_lastQueued = sample.m_point;
+   m_hasQueued = true;
+   m_lastQueuedMillis = nowMillis;
+}
+
+void MqttPublisher::publishAvailability ()
+{
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      uint8_t bit = 1 << i;
+      if (m_availKnown && (m_avail & bit) == (m_availPublished & bit))
+         continue;
+      publishToMQTT (g_mqttTopics.m_sensorAvail[i], (m_avail & bit) ? "online" : "offline");
+      m_availPublished = (m_availPublished & ~bit) | (m_avail & bit);
+   }
+   m_availKnown = true;
+}
+
+void MqttPublisher::service ()
+{
+   bool availChanged = !m_availKnown || m_avail != m_availPublished;
+   if (!g_mqtt->connected () || (m_queue.empty () && !availChanged))
+      return;
+   if (m_batchPeriod && !availChanged && g_clock->millis () - m_pendingSince < m_batchPeriod)
+      return;
+
+   uint32_t start = g_clock->micros ();
+   publishAvailability ();
+
+   // Only used from the network side, kept off the stack of loop ().
+   static char stateJson[SENSOR_JSON_MAX];
+   for (int sent = 0; sent < MQTT_BACKLOG_BURST && !m_queue.empty (); sent++)
+   {
+      // The newest state is the retained one, anything older is history.
+      bool newest = m_queue.size () == 1;
+      formatStateJson (stateJson, SENSOR_JSON_MAX, m_queue.front (), newest);
+      if (!g_mqtt->publish (newest ? g_mqttTopics.m_state : g_mqttTopics.m_backlog, stateJson, newest))
+      {
+         countMetric (g_mqttPublishFailures);
+         break;
+      }
+      m_queue.popFront ();
+   }
+   g_stageStats[STAGE_MQTT_PUBLISH].record (g_clock->micros () - start);
+}
+
+size_t formatStateJson (char* buf, size_t size, const MqttSample& sample, bool withEta)
+{
+   const HistPoint& point = sample.m_point;
+   // States queued before NTP go out with the wall clock once it is known.
+   int32_t time = point.m_time;
+   toWallTime (time);
+   TextWriter out (buf, size);
+   out.print ("{\"bat\":%d,\"t\":%d,\"sensors\":[", sample.m_battery, (int)time);
+   for (int i = 0; i < SENSOR_COUNT; ++i)
+   {
+      out.print ("%s{\"i\":%s,\"v\":%d,\"n\":\"%s\"", i ? "," : "", point.available (i) ? "true" : "false", point.m_temp[i] / 10, g_channelNames[i]);
+      if (withEta)
+         out.advance (g_estimator.formatJson (out.end (), out.space (), i));
+      out.print ("}");
+   }
+   out.print ("]}");
+   return out.length ();
+}
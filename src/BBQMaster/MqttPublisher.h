@@ -0,0 +1,77 @@
+#ifndef MQTT_PUBLISHER_H
+#define MQTT_PUBLISHER_H
+
+#include <stdint.h>
+#include "History.h"
+#include "Power.h"
+#include "Sensors.h"
+
+// A channel has to move this much, in 0.1 F, for the state to be sent before MQTT_MAX_PUBLISH_PERIOD.
+#define MQTT_DEADBAND_TENTHS 10
+// Interval bounds of the state messages
+#define MQTT_MIN_PUBLISH_PERIOD 10000
+#define MQTT_MAX_PUBLISH_PERIOD 60000
+// Seconds after which Home Assistant drops a state. A state queued just after a batch went out
+// waits for the next heartbeat and a whole saver batch, the longest, plus slack for loop ().
+#define MQTT_STATE_EXPIRY ((MQTT_MAX_PUBLISH_PERIOD + POWER_SAVER_BATCH) / 1000 + 15)
+// States kept while the broker is unreachable, 40 minutes to 4 hours depending on the deadband
+#define MQTT_BACKLOG_SIZE 240
+// Queued messages sent per service () call, so a long backlog does not stall loop ()
+#define MQTT_BACKLOG_BURST 4
+
+// State of the probes queued for MQTT
+struct MqttSample
+{
+   HistPoint m_point;
+   uint8_t m_battery;
+};
+
+// Change based MQTT publishing with store and forward.
+//
+// A reading is queued when a channel moved more than the deadband or became (un)available,
+// at most every MQTT_MIN_PUBLISH_PERIOD and at least every MQTT_MAX_PUBLISH_PERIOD. Readings
+// are queued whether the broker is reachable or not. Once connected, the newest goes to the
+// retained state topic and any older ones are replayed oldest first, with their original
+// timestamps, on the backlog topic. Sensor availability is only sent when it changes. To save
+// power the states can be sent in batches, availability changes still go out at once.
+class MqttPublisher
+{
+public:
+   MqttPublisher ();
+
+   // Offer the latest reading from the sensor task.
+   void offer (const DataPoint& reading, float battery, uint32_t nowMillis);
+   // Publish what is pending. Call from loop (), does nothing while disconnected.
+   void service ();
+   // A new broker session started, the availability of every channel is sent again.
+   void onConnect () { m_availKnown = false; }
+   // Hold the queued states until the oldest is this old, so the radio wakes up once for
+   // several of them. 0 sends them as they come.
+   void setBatchPeriod (uint32_t ms) { m_batchPeriod = ms; }
+
+   size_t backlog () const { return m_queue.size (); }
+
+private:
+   bool changed (const HistPoint& point) const;
+   void publishAvailability ();
+
+   RingBuffer<MqttSample, MQTT_BACKLOG_SIZE> m_queue;
+   HistPoint m_lastQueued;
+   bool m_hasQueued;
+   uint32_t m_lastQueuedMillis;
+   // When the oldest queued state was queued
+   uint32_t m_pendingSince;
+   uint32_t m_batchPeriod;
+   // Availability of the last offered reading and as last published
+   uint8_t m_avail;
+   uint8_t m_availPublished;
+   bool m_availKnown;
+};
+
+// Format a queued state as JSON, the same document as /measures.json. The time to target is only
+// given with the current state (withEta), the replayed ones go without. Returns the length written.
+size_t formatStateJson (char* buf, size_t size, const MqttSample& sample, bool withEta);
+
+extern MqttPublisher g_mqttPublisher;
+
+#endif
@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "Network.h"
+#include "Debug.h"
+#include "Metrics.h"
+#include "MqttPublisher.h"
+#include "Alarms.h"
+#include "Estimator.h"
+#include "PitController.h"
+#include "TextWriter.h"
+
+const char* g_hostName= "BBQ_Master";
+char g_topicMQTTHeader[22 + 11];
+char g_uniqueId[5];
+MqttTransport* g_mqtt = nullptr;
+MqttTopics g_mqttTopics;
+
+DataPoint g_lastSenUpdate;
+Snapshot<Measures> g_measures;
+
+// Format the last sensor data reading in json format.
+size_t formatSensorJson (char* buf, size_t size)
+{
+   Measures measures = g_measures.read ();
+   const DataPoint& reading = measures.m_reading;
+   TextWriter out (buf, size);
+   out.print ("{\"bat\":%.1f,\"t\":%d,", (double)g_batteryLevel.load (), reading.m_time);
+   // Blower duty in % and setpoint while the pit control is on
+   if (g_pitController.enabled ())
+      out.print ("\"fan\":%d,\"sp\":%d,%s", (int)(g_pitController.duty () * 100 + 0.5f), (int)g_pitController.setpoint (),
+                 g_pitController.lidOpen () ? "\"lid\":true," : "");
+   out.print ("\"sensors\":[");
+   for (int i = 0; i < SENSOR_COUNT; ++i)
+   {
+      const Sensor& sensor = reading.m_sensors[i];
+      out.print ("%s{\"i\":%s,\"v\":%d,\"n\":\"%s\"", i ? "," : "", sensor.m_ind ? "true" : "false", int(sensor.m_tempF), sensor.m_name);
+      if (measures.m_targets & (1 << i))
+         out.advance (formatEtaJson (out.end (), out.space (), measures.m_eta[i]));
+      out.print ("}");
+   }
+   out.print ("]}");
+   return out.length ();
+}
+
+// Format one history record as JSON. Returns the length written.
+size_t formatHistRecord (char* buf, size_t size, const HistRecord& record, bool first)
+{
+   TextWriter out (buf, size);
+   out.print ("%s{\"t\":%d,\"sensors\":[", first ? "" : ",", (int)record.m_time);
+   bool firstSensor = true;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      if (record.available (i))
+      {
+         // Lose the decimal places for space saving.
+         out.print ("%s{\"n\":\"%s\",\"v\":%d", firstSensor ? "" : ",", g_channelNames[i], record.m_avg[i] / 10);
+         // Rolled up points carry the range seen within the bucket.
+         if (record.m_period)
+            out.print (",\"l\":%d,\"h\":%d", record.m_min[i] / 10, record.m_max[i] / 10);
+         out.print ("}");
+         firstSensor = false;
+      }
+   }
+   out.print ("]}");
+   return out.length ();
+}
+
+// Fill the next chunk of a /history.json response. Returns 0 once the document is complete,
+// HIST_CHUNK_RETRY when the history could not be read consistently before anything was written.
+size_t fillHistoryChunk (HistoryJsonStream& stream, uint8_t *buffer, size_t maxLen)
+{
+   size_t written = 0;
+   while (written < maxLen)
+   {
+      if (stream.m_pendingPos < stream.m_pendingLen)
+      {
+         size_t len = std::min (maxLen - written, stream.m_pendingLen - stream.m_pendingPos);
+         memcpy (buffer + written, stream.m_pending + stream.m_pendingPos, len);
+         stream.m_pendingPos += len;
+         written += len;
+         continue;
+      }
+      if (stream.m_finished)
+         break;
+
+      stream.m_pendingPos = 0;
+      if (!stream.m_started)
+      {
+         stream.m_pendingLen = snprintf (stream.m_pending, HIST_JSON_RECORD_MAX, "{\"hist\":[");
+         stream.m_started = true;
+         continue;
+      }
+
+      // Look the next record up by time so points added or evicted meanwhile do not matter.
+      // A record read while the sensor task changed the store is read again.
+      HistRecord record;
+      bool found = false;
+      bool consistent = false;
+      for (int tries = 0; tries < HIST_READ_TRIES; tries++)
+      {
+         HistoryStore::View hist (g_tempHist);
+         size_t next = hist.upperBound (stream.m_lastTime);
+         found = next < hist.size ();
+         if (found)
+            record = hist[next];
+         consistent = hist.consistent ();
+         if (consistent)
+            break;
+      }
+      // A torn read is not the end of the data, the record is looked up again by the next call.
+      if (!consistent)
+         return written ? written : HIST_CHUNK_RETRY;
+      if (found)
+      {
+         stream.m_pendingLen = formatHistRecord (stream.m_pending, HIST_JSON_RECORD_MAX, record, stream.m_count == 0);
+         stream.m_lastTime = record.m_time;
+         stream.m_count++;
+      }
+      else
+      {
+         stream.m_pendingLen = snprintf (stream.m_pending, HIST_JSON_RECORD_MAX, "]}");
+         stream.m_finished = true;
+      }
+   }
+   return written;
+}
+
+bool takeReadings ()
+{
+   DataPoint reading;
+   bool newReading = false;
+   while (g_readings.pop (reading))
+   {
+      // Readings from before NTP carry the uptime, moved onto the wall clock as soon as it is known.
+      int32_t time = reading.m_time;
+      bool wallTime = toWallTime (time);
+      reading.m_time = time;
+      HistPoint point = toHistPoint (reading);
+      g_alarms.evaluate (point);
+      // The trend fits need a single time base, they start with the wall clock.
+      if (wallTime)
+         g_estimator.update (point);
+      g_lastSenUpdate = reading;
+      newReading = true;
+   }
+   if (newReading)
+      publishMeasures ();
+   return newReading;
+}
+
+void publishMeasures ()
+{
+   Measures measures;
+   measures.m_reading = g_lastSenUpdate;
+   measures.m_targets = 0;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      measures.m_eta[i] = g_estimator.eta (i);
+      if (g_estimator.hasTarget (i))
+         measures.m_targets |= 1 << i;
+   }
+   g_measures.publish (measures);
+}
+
+void setupMqttTopics ()
+{
+   snprintf(g_topicMQTTHeader, 22 + 11, "%s/sensor/%s", MQTT_HOME_ASSISTANT_DISCOVERY_PREFIX, g_hostName);
+   snprintf(g_mqttTopics.m_state, 22 + 11 + 10, "%s/state", g_topicMQTTHeader);
+   snprintf(g_mqttTopics.m_avail, 22 + 11 + 10, "%s/avail", g_topicMQTTHeader);
+   snprintf(g_mqttTopics.m_backlog, 22 + 11 + 10, "%s/backlog", g_topicMQTTHeader);
+   snprintf(g_mqttTopics.m_alarm, 22 + 11 + 10, "%s/alarm", g_topicMQTTHeader);
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      snprintf(g_mqttTopics.m_sensorAvail[i], 22 + 11 + 20, "%s/%s/avail", g_topicMQTTHeader, g_channelNames[i]);
+}
+
+// Publish the MQTT payload.
+void publishToMQTT(const char* p_topic,const char* p_payload) {
+  if (g_mqtt->publish(p_topic, p_payload, true)) {
+    DEBUG_PRINT(F("INFO: MQTT message published successfully, topic: "));
+    DEBUG_PRINT(p_topic);
+    DEBUG_PRINT(F(", payload: "));
+    DEBUG_PRINTLN(p_payload);
+  } else {
+    countMetric (g_mqttPublishFailures);
+    DEBUG_PRINTLN(F("ERROR: MQTT message not published, either connection lost, or message too large. Topic: "));
+    DEBUG_PRINT(p_topic);
+    DEBUG_PRINT(F(" , payload: "));
+    DEBUG_PRINTLN(p_payload);
+  }
+}
+
+// Function that publishes birthMessage
+void publishAvailability() 
+{
+   g_mqtt->publish(g_mqttTopics.m_avail, "online", true);
+}
+
+void publishAlarm (const char* payload)
+{
+   if (!g_mqtt->publish (g_mqttTopics.m_alarm, payload, false))
+      countMetric (g_mqttPublishFailures);
+}
+
+// Discovery config of the time to target of an NTC (meat) probe.
+static void publishEtaDiscovery (int i)
+{
+   char configTopic[22 + 11 + 20];
+   snprintf(configTopic, 22 + 11 + 20, "%s/%seta/config", g_topicMQTTHeader, g_channelNames[i]);
+   char availabilityTopic[15];
+   snprintf(availabilityTopic, 15, "~/%s/avail", g_channelNames[i]);
+   char sensorId[20];
+   snprintf(sensorId, 20, "%s%seta", g_uniqueId, g_channelNames[i]);
+   char sensorName[30];
+   snprintf(sensorName, 30, "%s Time to target", g_channelNames[i]);
+   // Minutes, unknown without an estimate (no target, not enough readings or stalled)
+   char valueTemplate[100];
+   snprintf(valueTemplate, 100, "{{(value_json.sensors[%d].eta/60)|round(0) if value_json.sensors[%d].eta is number else None}}", i, i);
+   char attrTemplate[140];
+   snprintf(attrTemplate, 140, "{{{'confidence':value_json.sensors[%d].c|default(0),'stall':value_json.sensors[%d].stall|default(false)}|tojson}}", i, i);
+
+   StaticJsonDocument<1024> root;
+   root["~"] = g_topicMQTTHeader;
+   root["dev_cla"] = "duration";
+   root["uniq_id"] = sensorId;
+   root["name"] = sensorName;
+   root["avty_t"] = availabilityTopic;
+   root["stat_t"] = "~/state";
+   root["unit_of_meas"] = "min";
+   root["val_tpl"] = valueTemplate;
+   root["json_attr_t"] = "~/state";
+   root["json_attr_tpl"] = attrTemplate;
+   root["exp_aft"] = MQTT_STATE_EXPIRY;
+   root["device"]["ids"] = g_uniqueId;
+   root["device"]["name"] = g_hostName;
+   root["device"]["mf"] = "DIY";
+   root["device"]["mdl"] = "DIY";
+   root["device"]["sw"] = "1.1";
+   char buffer[768];
+   serializeJson(root, buffer);
+   publishToMQTT(configTopic, buffer);
+}
+
+// Publish one MQTT discovery config message to let hassio auto discover the sensors.
+// Step 0 is the battery, then one step per sensor and one per NTC time to target.
+// Returns false past the last step.
+bool publishDiscoveryStep (int step)
+{
+   if (step < 0 || step > SENSOR_COUNT + NTC_CHANNELS)
+      return false;
+   if (step > SENSOR_COUNT)
+   {
+      publishEtaDiscovery (step - SENSOR_COUNT - 1);
+      return true;
+   }
+
+   // Create json config for battery level.
+   if (step == 0)
+   {
+      char uniqueId[15];
+      snprintf(uniqueId, 15, "%sbat", g_uniqueId);
+      char batDiscoverTopic[22 + 11 + 20];
+      snprintf(batDiscoverTopic, 22 + 11 + 20, "%s/bat/config", g_topicMQTTHeader);
+
+      StaticJsonDocument<500> root;
+      root["~"] = g_topicMQTTHeader;
+      root["dev_cla"] = "battery";
+      root["uniq_id"] = uniqueId;
+      root["name"] = "Battery";
+      root["avty_t"] = "~/avail";
+      root["stat_t"] = "~/state";
+      root["unit_of_meas"] = "%";
+      root["val_tpl"] = "{{value_json.bat}}";
+      root["device"]["ids"] = g_uniqueId;
+      root["device"]["name"] = g_hostName;
+      root["device"]["mf"] = "DIY";
+      root["device"]["mdl"] = "DIY";
+      root["device"]["sw"] = "1.1";
+      char outgoingJsonBuffer[500];
+      serializeJson(root, outgoingJsonBuffer);
+      publishToMQTT(batDiscoverTopic, outgoingJsonBuffer);
+      return true;
+   }
+
+   // Create json config for each sensor.
+   int i = step - 1;
+   char sensorConfigTopic[22 + 11 + 20];
+   snprintf(sensorConfigTopic, 22 + 11 + 20, "%s/%s/config", g_topicMQTTHeader, g_channelNames[i]);
+   char availabilitySensorTopic[15];
+   snprintf(availabilitySensorTopic, 15, "~/%s/avail", g_channelNames[i]);
+
+   char sensorId[15];
+   snprintf(sensorId, 15, "%s%s", g_uniqueId, g_channelNames[i]);
+   char sensorName[30];
+   snprintf(sensorName, 30, "%s Temperature.", g_channelNames[i]);
+   char jsonTemplate[40];
+   snprintf(jsonTemplate, 40, "{{value_json.sensors[%d].v}}", i);
+
+   StaticJsonDocument<500> sensorRoot;
+   sensorRoot["~"] = g_topicMQTTHeader;
+   sensorRoot["dev_cla"] = "temperature";
+   sensorRoot["uniq_id"] = sensorId;
+   sensorRoot["name"] = sensorName;
+   sensorRoot["avty_t"] = availabilitySensorTopic;
+   sensorRoot["stat_t"] = "~/state";
+   sensorRoot["unit_of_meas"] = "°F";
+   sensorRoot["val_tpl"] = jsonTemplate;
+   sensorRoot["exp_aft"] = MQTT_STATE_EXPIRY; // Invalidate the data when even the heartbeat state is late.
+   sensorRoot["device"]["ids"] = g_uniqueId;
+   sensorRoot["device"]["name"] = g_hostName;
+   sensorRoot["device"]["mf"] = "DIY";
+   sensorRoot["device"]["mdl"] = "DIY";
+   sensorRoot["device"]["sw"] = "1.1";
+
+   char sensorDisBuffer[500];
+   serializeJson(sensorRoot, sensorDisBuffer);
+   publishToMQTT(sensorConfigTopic, sensorDisBuffer);
+   return true;
+}
+
+// Publish every MQTT discovery config message at once.
+void publishDiscovery ()
+{
+   for (int step = 0; publishDiscoveryStep (step); step++)
+      ;
+}
@@ -0,0 +1,83 @@
+#ifndef NETWORK_H
+#define NETWORK_H
+
+#include <ArduinoJson.h>
+#include "Hal.h"
+#include "Sensors.h"
+#include "Estimator.h"
+#include "Snapshot.h"
+
+#define MQTT_HOME_ASSISTANT_DISCOVERY_PREFIX  "homeassistant"
+
+// Largest JSON text of a single history record.
+#define HIST_JSON_RECORD_MAX 448
+// Largest /measures.json document
+#define SENSOR_JSON_MAX 768
+// fillHistoryChunk () result when the history kept changing under it and nothing was written, call again later
+#define HIST_CHUNK_RETRY ((size_t)-1)
+
+// Host name of the device.
+extern const char* g_hostName;
+extern char g_topicMQTTHeader[22 + 11];
+extern char g_uniqueId[5];
+// Broker connection, provided by the board or the host build
+extern MqttTransport* g_mqtt;
+
+// Topics formatted once, so the periodic publish formats nothing but the payload.
+struct MqttTopics
+{
+   char m_state[22 + 11 + 10];
+   char m_avail[22 + 11 + 10];
+   char m_backlog[22 + 11 + 10];
+   char m_alarm[22 + 11 + 10];
+   char m_sensorAvail[SENSOR_COUNT][22 + 11 + 20];
+};
+extern MqttTopics g_mqttTopics;
+
+// Current data set, owned by loop ()
+extern DataPoint g_lastSenUpdate;
+
+// What /measures.json shows, copied out of loop () for the web handlers
+struct Measures
+{
+   DataPoint m_reading;
+   // Time to target of the probes with a target, bit i of m_targets for channel i
+   Eta m_eta[SENSOR_COUNT];
+   uint8_t m_targets;
+};
+// Published by takeReadings () with every new data set, never torn for the readers
+extern Snapshot<Measures> g_measures;
+
+// State of one streamed /history.json response.
+struct HistoryJsonStream
+{
+   // Time of the last record sent, records are streamed in time order
+   int32_t m_lastTime;
+   size_t m_count;
+   bool m_started;
+   bool m_finished;
+   // Text not yet handed to the TCP window
+   char m_pending[HIST_JSON_RECORD_MAX];
+   size_t m_pendingLen;
+   size_t m_pendingPos;
+};
+
+// Format the last sensor data reading as JSON. Returns the length written.
+size_t formatSensorJson (char* buf, size_t size);
+size_t formatHistRecord (char* buf, size_t size, const HistRecord& record, bool first);
+size_t fillHistoryChunk (HistoryJsonStream& stream, uint8_t *buffer, size_t maxLen);
+// Take the readings completed by the sensor task and run the alarm rules on each. Returns true when there was a new one.
+bool takeReadings ();
+// Publish g_lastSenUpdate and the estimates to g_measures.
+void publishMeasures ();
+
+// Set the topic header and every topic from the host name.
+void setupMqttTopics ();
+void publishToMQTT (const char* p_topic, const char* p_payload);
+void publishAvailability ();
+// Send an alarm event, not retained.
+void publishAlarm (const char* payload);
+bool publishDiscoveryStep (int step);
+void publishDiscovery ();
+
+#endif
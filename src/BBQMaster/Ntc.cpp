@@ -0,0 +1,79 @@
+#include "Ntc.h"
+#include <math.h>
+
+// Table segments: every ADC value below 256, then every 16 up to 4096, then every 64.
+struct NtcSegment
+{
+   int32_t m_start;
+   uint8_t m_shift;
+   int16_t m_firstIndex;
+};
+
+static const NtcSegment s_segments[] = {
+   {0, 0, 0},
+   {256, 4, 256},
+   {4096, 6, 496},
+};
+static const int s_segmentCount = sizeof (s_segments) / sizeof (s_segments[0]);
+
+static_assert (496 + ((NTC_MAX_ADC - 4096) >> 6) + 2 == NTC_TABLE_SIZE, "NTC table size does not cover the ADC range");
+
+NtcCalibration ntcCalibrationFromBeta (double beta, double refTempC, double refRes)
+{
+   NtcCalibration cal;
+   cal.m_a = 1.0 / (refTempC + 273.15) - log (refRes) / beta;
+   cal.m_b = 1.0 / beta;
+   cal.m_c = 0;
+   return cal;
+}
+
+double ntcExactTempF (const NtcCalibration& cal, double adcValue)
+{
+   // Resistance of the probe in the divider
+   double res = NTC_REF_RES / (NTC_MAX_ADC / adcValue - 1);
+   double lnRes = log (res);
+   double kelvin = 1.0 / (cal.m_a + cal.m_b * lnRes + cal.m_c * lnRes * lnRes * lnRes);
+   return (kelvin - 273.15) * 9.0 / 5.0 + 32.0;
+}
+
+static int16_t clampTenths (double tempF)
+{
+   if (!(tempF * 10 < INT16_MAX))
+      return INT16_MAX;
+   if (tempF * 10 < INT16_MIN)
+      return INT16_MIN;
+   return (int16_t)lround (tempF * 10);
+}
+
+void NtcTable::build (const NtcCalibration& cal)
+{
+   for (int s = 0; s < s_segmentCount; s++)
+   {
+      int last = s + 1 < s_segmentCount ? s_segments[s + 1].m_firstIndex : NTC_TABLE_SIZE;
+      for (int index = s_segments[s].m_firstIndex; index < last; index++)
+      {
+         int32_t adc = s_segments[s].m_start + ((int32_t)(index - s_segments[s].m_firstIndex) << s_segments[s].m_shift);
+         if (adc <= 0)
+            m_table[index] = INT16_MAX;
+         else
+            m_table[index] = clampTenths (ntcExactTempF (cal, adc < NTC_MAX_ADC ? adc : NTC_MAX_ADC - 0.5));
+      }
+   }
+}
+
+int16_t NtcTable::toTenthsF (int16_t adcValue) const
+{
+   if (adcValue <= 0 || adcValue >= NTC_MAX_ADC)
+      return NTC_INVALID_TENTHS;
+
+   int s = s_segmentCount - 1;
+   while (adcValue < s_segments[s].m_start)
+      s--;
+   int32_t offset = adcValue - s_segments[s].m_start;
+   int index = s_segments[s].m_firstIndex + (offset >> s_segments[s].m_shift);
+   int32_t frac = offset & ((1 << s_segments[s].m_shift) - 1);
+   int32_t low = m_table[index];
+   if (!frac)
+      return (int16_t)low;
+   return (int16_t)(low + (((m_table[index + 1] - low) * frac) >> s_segments[s].m_shift));
+}
@@ -0,0 +1,43 @@
+#ifndef NTC_H
+#define NTC_H
+
+#include <stdint.h>
+
+#define NTC_CHANNELS 4
+#define NTC_MAX_ADC 27550
+#define NTC_REF_RES 62000
+// Returned for readings outside of the probe range, reads as an invalid temperature.
+#define NTC_INVALID_TENTHS 0
+
+// Steinhart-Hart coefficients of one probe: 1/T = A + B ln(R) + C ln(R)^3, T in kelvin.
+struct NtcCalibration
+{
+   double m_a;
+   double m_b;
+   double m_c;
+};
+
+// Calibration equivalent to the single B coefficient model.
+NtcCalibration ntcCalibrationFromBeta (double beta, double refTempC, double refRes);
+
+// Exact temperature of a reading in F, for building the tables and checking them.
+double ntcExactTempF (const NtcCalibration& cal, double adcValue);
+
+// Number of entries needed for the ADC range, see Ntc.cpp for the segment layout.
+#define NTC_TABLE_SIZE 864
+
+// ADC to temperature lookup table of one probe, built when the calibration is set.
+// Steps are finer where the curve is steep (hot, low ADC values), and the reading is
+// interpolated linearly in fixed point between the entries.
+class NtcTable
+{
+public:
+   void build (const NtcCalibration& cal);
+   // Temperature in tenths of a degree F.
+   int16_t toTenthsF (int16_t adcValue) const;
+
+private:
+   int16_t m_table[NTC_TABLE_SIZE];
+};
+
+#endif
@@ -0,0 +1,104 @@
+#include "PitController.h"
+
+PitController g_pitController;
+FanOutput* g_fan = nullptr;
+
+PidConfig defaultPidConfig ()
+{
+   PidConfig config;
+   config.m_channel = NTC_CHANNELS;
+   config.m_kp = PID_DEFAULT_KP;
+   config.m_ki = PID_DEFAULT_KI;
+   config.m_kd = PID_DEFAULT_KD;
+   config.m_lidDrop = PID_DEFAULT_LID_DROP;
+   config.m_lidHold = PID_DEFAULT_LID_HOLD;
+   return config;
+}
+
+PitController::PitController () : m_config (defaultPidConfig ()), m_enabled (false), m_setpointTenths (toTenths (PID_DEFAULT_SETPOINT)),
+                                  m_channel (NTC_CHANNELS), m_dutyPercent (0), m_lidOpen (false), m_lidOpenings (0)
+{
+   reset ();
+}
+
+void PitController::configure (const PidConfig& config)
+{
+   m_config = config;
+   m_channel = config.m_channel;
+   reset ();
+}
+
+void PitController::reset ()
+{
+   m_primed = false;
+   m_integral = 0;
+   m_lastTemp = 0;
+   m_lastMillis = 0;
+   m_recentNext = 0;
+   m_recentCount = 0;
+   m_lidSince = 0;
+   m_lidOpen = false;
+}
+
+// Keep the last PID_LID_WINDOW readings and compare the new one with the oldest.
+bool PitController::lidDropped (float temp)
+{
+   bool dropped = m_recentCount == PID_LID_WINDOW && m_recent[m_recentNext] - temp >= m_config.m_lidDrop;
+   m_recent[m_recentNext] = temp;
+   m_recentNext = (m_recentNext + 1) % PID_LID_WINDOW;
+   if (m_recentCount < PID_LID_WINDOW)
+      m_recentCount++;
+   return dropped;
+}
+
+float PitController::update (const DataPoint& reading, uint32_t nowMillis)
+{
+   uint8_t channel = m_channel;
+   const Sensor& pit = reading.m_sensors[channel < SENSOR_COUNT ? channel : 0];
+   if (!m_enabled || channel >= SENSOR_COUNT || !pit.m_ind)
+   {
+      reset ();
+      m_dutyPercent = 0;
+      return 0;
+   }
+
+   float temp = pit.m_tempF;
+   float setpoint = this->setpoint ();
+   float error = setpoint - temp;
+   float dt = m_primed ? (nowMillis - m_lastMillis) / 1000.0f : 0;
+   if (dt > PID_MAX_STEP)
+      dt = PID_MAX_STEP;
+
+   // Lid open: blower off, integral held.
+   bool dropped = lidDropped (temp);
+   if (!m_lidOpen && dropped && error > 0)
+   {
+      m_lidOpen = true;
+      m_lidSince = nowMillis;
+      m_lidOpenings++;
+   }
+   else if (m_lidOpen && (error < m_config.m_lidDrop / 2 || nowMillis - m_lidSince >= m_config.m_lidHold * 1000u))
+      m_lidOpen = false;
+
+   float derivative = m_primed && dt > 0 ? (temp - m_lastTemp) / dt : 0;
+   m_lastTemp = temp;
+   m_lastMillis = nowMillis;
+   m_primed = true;
+   if (m_lidOpen)
+   {
+      m_dutyPercent = 0;
+      return 0;
+   }
+
+   float proportional = m_config.m_kp * error - m_config.m_kd * derivative;
+   float integral = m_integral + m_config.m_ki * error * dt;
+   float output = proportional + integral;
+   // Integrate only when it does not push further into saturation.
+   if (!((output > 1 && error > 0) || (output < 0 && error < 0)))
+      m_integral = integral < 0 ? 0 : integral > 1 ? 1 : integral;
+   output = proportional + m_integral;
+
+   float duty = output < PID_MIN_DUTY ? 0 : output > 1 ? 1 : output;
+   m_dutyPercent = (uint8_t)(duty * 100 + 0.5f);
+   return duty;
+}
@@ -0,0 +1,98 @@
+#ifndef PIT_CONTROLLER_H
+#define PIT_CONTROLLER_H
+
+#include <atomic>
+#include <stdint.h>
+#include "Hal.h"
+#include "Sensors.h"
+
+// Default tuning, duty (0-1) per F of error, per F second and per F/s
+#define PID_DEFAULT_KP 0.03f
+#define PID_DEFAULT_KI 0.00005f
+#define PID_DEFAULT_KD 0.6f
+#define PID_DEFAULT_SETPOINT 225.0f
+// The blower does not turn below this duty, smaller outputs switch it off
+#define PID_MIN_DUTY 0.1f
+// A drop of this many F within PID_LID_WINDOW readings means the lid was opened
+#define PID_DEFAULT_LID_DROP 15.0f
+#define PID_LID_WINDOW 10
+// Longest time the blower stays off for an open lid, in seconds
+#define PID_DEFAULT_LID_HOLD 240
+// Largest time step between readings taken into account, in seconds
+#define PID_MAX_STEP 10.0f
+
+// Settings of the pit controller, from config.json
+struct PidConfig
+{
+   uint8_t m_channel;
+   float m_kp;
+   float m_ki;
+   float m_kd;
+   float m_lidDrop;
+   uint16_t m_lidHold;
+};
+
+PidConfig defaultPidConfig ();
+
+// PID control of the pit blower from the filtered reading of a pit probe.
+//
+// Runs in the sensor task on every reading, so the control period is SENSOR_READ_INT
+// whatever the network is doing. The derivative acts on the measurement rather than the
+// error, so setpoint changes do not kick the blower. The integral only moves while the output
+// is not saturated in the same direction (anti-windup). A sudden drop of the pit temperature
+// is taken as an open lid: the blower stops and the integral is held until the pit is back
+// near the setpoint or the lid hold time is over. A missing probe stops the blower.
+class PitController
+{
+public:
+   PitController ();
+
+   // Tuning, set before the sensor task starts.
+   void configure (const PidConfig& config);
+   const PidConfig& config () const { return m_config; }
+
+   // Runtime settings, safe to change from any task.
+   void setEnabled (bool enabled) { m_enabled = enabled; }
+   bool enabled () const { return m_enabled; }
+   void setSetpoint (float tempF) { m_setpointTenths = toTenths (tempF); }
+   float setpoint () const { return m_setpointTenths / 10.0f; }
+   void setChannel (uint8_t channel) { m_channel = channel; }
+   uint8_t channel () const { return m_channel; }
+
+   // Feed a reading from the sensor task. Returns the blower duty.
+   float update (const DataPoint& reading, uint32_t nowMillis);
+
+   float duty () const { return m_dutyPercent / 100.0f; }
+   bool lidOpen () const { return m_lidOpen; }
+   uint32_t lidOpenings () const { return m_lidOpenings; }
+
+private:
+   void reset ();
+   bool lidDropped (float temp);
+
+   PidConfig m_config;
+   std::atomic<bool> m_enabled;
+   std::atomic<int16_t> m_setpointTenths;
+   std::atomic<uint8_t> m_channel;
+
+   // Owned by the sensor task
+   bool m_primed;
+   float m_integral;
+   float m_lastTemp;
+   uint32_t m_lastMillis;
+   float m_recent[PID_LID_WINDOW];
+   uint8_t m_recentNext;
+   uint8_t m_recentCount;
+   uint32_t m_lidSince;
+
+   // Read by the network side
+   std::atomic<uint8_t> m_dutyPercent;
+   std::atomic<bool> m_lidOpen;
+   std::atomic<uint32_t> m_lidOpenings;
+};
+
+extern PitController g_pitController;
+// Blower, provided by the board or the host build. Null when there is none.
+extern FanOutput* g_fan;
+
+#endif
@@ -0,0 +1,176 @@
+#include <math.h>
+#include <string.h>
+#include "Power.h"
+#include "PitController.h"
+
+SamplePlanner g_samplePlanner;
+
+const char* const g_powerModeNames[POWER_MODE_COUNT] = {"auto", "full", "balanced", "saver"};
+
+bool parsePowerMode (const char* name, PowerMode& mode)
+{
+   for (int i = 0; i < POWER_MODE_COUNT; i++)
+   {
+      if (strcmp (name, g_powerModeNames[i]) == 0)
+      {
+         mode = (PowerMode)i;
+         return true;
+      }
+   }
+   return false;
+}
+
+uint32_t powerBatchPeriod (PowerMode mode)
+{
+   switch (mode)
+   {
+   case POWER_BALANCED:
+      return POWER_BALANCED_BATCH;
+   case POWER_SAVER:
+      return POWER_SAVER_BATCH;
+   default:
+      return 0;
+   }
+}
+
+uint32_t powerLoopIdle (PowerMode mode)
+{
+   switch (mode)
+   {
+   case POWER_BALANCED:
+      return POWER_BALANCED_LOOP_IDLE;
+   case POWER_SAVER:
+      return POWER_SAVER_LOOP_IDLE;
+   default:
+      return 0;
+   }
+}
+
+SamplePlanner::SamplePlanner () : m_setting (POWER_AUTO), m_mode (POWER_BALANCED)
+{
+   reset ();
+}
+
+void SamplePlanner::reset ()
+{
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      m_shift[i] = 0;
+      m_rate[i] = 0;
+      m_last[i] = 0;
+      m_lastMillis[i] = 0;
+      m_known[i] = false;
+   }
+}
+
+uint8_t SamplePlanner::due (uint32_t slot) const
+{
+   uint8_t mask = 0;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      if ((slot & ((1u << m_shift[i]) - 1)) == 0)
+         mask |= 1 << i;
+   }
+   return mask;
+}
+
+void SamplePlanner::resolveMode (float battery)
+{
+   PowerMode setting = this->setting ();
+   if (setting != POWER_AUTO)
+      m_mode = setting;
+   else if (battery < POWER_SAVER_BATTERY)
+      m_mode = POWER_SAVER;
+   else if (battery >= POWER_SAVER_BATTERY + POWER_SAVER_HYSTERESIS)
+      m_mode = POWER_BALANCED;
+   else if (m_mode != POWER_SAVER)
+      m_mode = POWER_BALANCED;
+}
+
+void SamplePlanner::sampled (const DataPoint& reading, uint8_t mask, uint32_t nowMillis)
+{
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      if (!(mask & (1 << i)))
+         continue;
+      const Sensor& sensor = reading.m_sensors[i];
+      if (!sensor.m_ind)
+      {
+         // A probe plugged back in starts from a fast rate.
+         m_known[i] = false;
+         m_rate[i] = POWER_FAST_RATE;
+         continue;
+      }
+      float temp = sensor.m_tempF;
+      if (m_known[i] && nowMillis != m_lastMillis[i])
+      {
+         float seconds = (nowMillis - m_lastMillis[i]) / 1000.0f;
+         float rate = fabsf (temp - m_last[i]) * 60.0f / seconds;
+         if (rate > m_rate[i])
+            m_rate[i] = rate;
+         else
+            m_rate[i] += (rate - m_rate[i]) * fminf (1.0f, seconds / POWER_RATE_TAU);
+      }
+      m_known[i] = true;
+      m_last[i] = temp;
+      m_lastMillis[i] = nowMillis;
+   }
+
+   resolveMode (g_batteryLevel);
+   plan (g_pitController.enabled () ? g_pitController.channel () : -1);
+}
+
+void SamplePlanner::plan (int pinned)
+{
+   PowerMode mode = this->mode ();
+   if (mode == POWER_FULL)
+   {
+      for (int i = 0; i < SENSOR_COUNT; i++)
+         m_shift[i] = 0;
+      return;
+   }
+
+   uint8_t maxShift = mode == POWER_SAVER ? POWER_SAVER_MAX_SHIFT : POWER_BALANCED_MAX_SHIFT;
+   uint32_t budget = mode == POWER_SAVER ? POWER_SAVER_BUDGET : POWER_BALANCED_BUDGET;
+   uint8_t shift[SENSOR_COUNT];
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      if (i == pinned)
+         shift[i] = 0;
+      else if (!m_known[i])
+         shift[i] = POWER_IDLE_SHIFT;
+      else
+      {
+         // Halvings of the rate below POWER_FAST_RATE
+         uint8_t s = 0;
+         float rate = m_rate[i];
+         while (s < maxShift && rate * (1 << (s + 1)) <= POWER_FAST_RATE)
+            s++;
+         shift[i] = s;
+      }
+   }
+
+   // Slow the flattest connected probes until the sweeps fit in the budget.
+   for (;;)
+   {
+      uint32_t perMinute = 0;
+      for (int i = 0; i < SENSOR_COUNT; i++)
+         perMinute += (60000u / SENSOR_READ_INT) >> shift[i];
+      if (perMinute <= budget)
+         break;
+      int flattest = -1;
+      for (int i = 0; i < SENSOR_COUNT; i++)
+      {
+         if (i == pinned || !m_known[i] || shift[i] >= maxShift)
+            continue;
+         if (flattest < 0 || shift[i] < shift[flattest] || (shift[i] == shift[flattest] && m_rate[i] < m_rate[flattest]))
+            flattest = i;
+      }
+      if (flattest < 0)
+         break;
+      shift[flattest]++;
+   }
+
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      m_shift[i] = shift[i];
+}
@@ -0,0 +1,101 @@
+#ifndef POWER_H
+#define POWER_H
+
+#include <atomic>
+#include <stdint.h>
+#include "Sensors.h"
+
+// A channel is sampled every SENSOR_READ_INT << shift. The shifts are powers of two of the
+// base interval so slower channels always fall in the same sweeps as the faster ones.
+#define POWER_BALANCED_MAX_SHIFT 4
+#define POWER_SAVER_MAX_SHIFT 5
+// Unplugged channels are only checked for a probe every 12 s
+#define POWER_IDLE_SHIFT 3
+// Rate of change, in F per minute, sampled at the base interval. Each halving of the rate
+// doubles the interval.
+#define POWER_FAST_RATE 4.0f
+// Time constant of the rate estimate while the rate falls, in seconds. Rises are taken at once.
+#define POWER_RATE_TAU 120.0f
+// Channel conversions per minute allowed, shared by the connected probes
+#define POWER_BALANCED_BUDGET 160
+#define POWER_SAVER_BUDGET 48
+// Battery level under which the automatic setting switches to saver, left 5% higher.
+#define POWER_SAVER_BATTERY 30
+#define POWER_SAVER_HYSTERESIS 5
+// MQTT states are held and sent together this often
+#define POWER_BALANCED_BATCH 30000
+#define POWER_SAVER_BATCH 120000
+// Pause at the end of loop (), lets the idle task run and the modem sleep
+#define POWER_BALANCED_LOOP_IDLE 20
+#define POWER_SAVER_LOOP_IDLE 50
+
+// Power settings. Full is the original behaviour: every channel at SENSOR_READ_INT and
+// the radio always on. Auto picks balanced, or saver once the battery runs low.
+enum PowerMode
+{
+   POWER_AUTO,
+   POWER_FULL,
+   POWER_BALANCED,
+   POWER_SAVER,
+   POWER_MODE_COUNT
+};
+
+extern const char* const g_powerModeNames[POWER_MODE_COUNT];
+
+// Returns false for an unknown name.
+bool parsePowerMode (const char* name, PowerMode& mode);
+
+// Adaptive sampling plan of the sensor task.
+//
+// Each channel gets its own interval from its recent rate of change: a probe climbing
+// fast is read every SENSOR_READ_INT, one that has been flat for a while every 24 s (48 s
+// in saver). The pit probe of the PID stays at the base interval. When the connected
+// probes together would need more conversions than the budget of the mode, the flattest
+// ones are slowed down further. Sweeps happen in slots of SENSOR_READ_INT, channel i is
+// due in the slots that are multiples of 1 << shift (i).
+class SamplePlanner
+{
+public:
+   SamplePlanner ();
+
+   // Configured setting, safe to change from any task.
+   void setSetting (PowerMode mode) { m_setting = mode; }
+   PowerMode setting () const { return (PowerMode)m_setting.load (); }
+   // Mode in effect, the setting with auto resolved from the battery level.
+   PowerMode mode () const { return (PowerMode)m_mode.load (); }
+
+   // Channels to convert in a slot.
+   uint8_t due (uint32_t slot) const;
+   // Take the result of a sweep of the channels in mask into account.
+   void sampled (const DataPoint& reading, uint8_t mask, uint32_t nowMillis);
+
+   uint8_t shift (int channel) const { return m_shift[channel]; }
+   uint32_t interval (int channel) const { return (uint32_t)SENSOR_READ_INT << m_shift[channel]; }
+   // Estimated rate of change in F per minute
+   float rate (int channel) const { return m_rate[channel]; }
+
+   // Forget the rates, every channel back to the base interval.
+   void reset ();
+
+private:
+   void resolveMode (float battery);
+   void plan (int pinned);
+
+   std::atomic<uint8_t> m_setting;
+   std::atomic<uint8_t> m_mode;
+
+   // Owned by the sensor task, the shifts are also read by the network side
+   std::atomic<uint8_t> m_shift[SENSOR_COUNT];
+   float m_rate[SENSOR_COUNT];
+   float m_last[SENSOR_COUNT];
+   uint32_t m_lastMillis[SENSOR_COUNT];
+   bool m_known[SENSOR_COUNT];
+};
+
+// MQTT batch period and loop () pause of a mode in effect, 0 for none.
+uint32_t powerBatchPeriod (PowerMode mode);
+uint32_t powerLoopIdle (PowerMode mode);
+
+extern SamplePlanner g_samplePlanner;
+
+#endif
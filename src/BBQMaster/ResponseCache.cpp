@@ -0,0 +1,187 @@
+#include <string.h>
+#include <new>
+#include <algorithm>
+#include "ResponseCache.h"
+#include "Network.h"
+#include "HistoryCodec.h"
+#include "Metrics.h"
+
+ResponseCache g_responseCache;
+std::atomic<uint32_t> g_responseBytes (0);
+std::atomic<uint32_t> g_responsesInFlight (0);
+
+SharedBody::~SharedBody ()
+{
+   size_t blocks = (m_length + RESPONSE_BLOCK_SIZE - 1) / RESPONSE_BLOCK_SIZE;
+   for (size_t i = 0; i < blocks; i++)
+      delete[] m_blocks[i];
+   g_responseBytes.fetch_sub (blocks * RESPONSE_BLOCK_SIZE);
+}
+
+bool SharedBody::append (const void* data, size_t len)
+{
+   const uint8_t* bytes = (const uint8_t*)data;
+   while (len)
+   {
+      size_t block = m_length / RESPONSE_BLOCK_SIZE;
+      size_t offset = m_length % RESPONSE_BLOCK_SIZE;
+      if (!offset)
+      {
+         if (block >= RESPONSE_MAX_BLOCKS || g_responseBytes.load () + RESPONSE_BLOCK_SIZE > RESPONSE_BYTES_MAX)
+            return false;
+         m_blocks[block] = new (std::nothrow) uint8_t[RESPONSE_BLOCK_SIZE];
+         if (!m_blocks[block])
+            return false;
+         g_responseBytes.fetch_add (RESPONSE_BLOCK_SIZE);
+      }
+      size_t count = std::min (len, (size_t)RESPONSE_BLOCK_SIZE - offset);
+      memcpy (m_blocks[block] + offset, bytes, count);
+      m_length += count;
+      bytes += count;
+      len -= count;
+   }
+   return true;
+}
+
+size_t SharedBody::read (size_t offset, uint8_t* buf, size_t len) const
+{
+   size_t copied = 0;
+   while (copied < len && offset < m_length)
+   {
+      size_t inBlock = offset % RESPONSE_BLOCK_SIZE;
+      size_t count = std::min (std::min (len - copied, (size_t)RESPONSE_BLOCK_SIZE - inBlock), m_length - offset);
+      memcpy (buf + copied, m_blocks[offset / RESPONSE_BLOCK_SIZE] + inBlock, count);
+      copied += count;
+      offset += count;
+   }
+   return copied;
+}
+
+// Revision of the data a document is made of.
+static uint32_t documentRevision (CachedDocument doc)
+{
+   return doc == DOC_MEASURES ? g_measures.version () : g_tempHist.revision ();
+}
+
+// Serialize a document. Returns false when the body ran out of room.
+static bool buildBody (CachedDocument doc, int32_t since, SharedBody& body)
+{
+   switch (doc)
+   {
+      case DOC_MEASURES:
+      {
+         char json[SENSOR_JSON_MAX];
+         size_t len = formatSensorJson (json, SENSOR_JSON_MAX);
+         return body.append (json, len);
+      }
+      case DOC_HISTORY_JSON:
+      {
+         HistoryJsonStream stream = HistoryJsonStream ();
+         stream.m_lastTime = since;
+         uint8_t chunk[RESPONSE_BLOCK_SIZE];
+         size_t len;
+         while ((len = fillHistoryChunk (stream, chunk, sizeof (chunk))) > 0)
+         {
+            // A torn read fails the build, the client is told to poll again
+            if (len == HIST_CHUNK_RETRY || !body.append (chunk, len))
+               return false;
+         }
+         return true;
+      }
+      case DOC_HISTORY_BIN:
+      {
+         // The codec wants the whole body in one piece, only for the time of the copy.
+         // Encoded again when the sensor task changed the history meanwhile.
+         for (int tries = 0; tries < HIST_READ_TRIES; tries++)
+         {
+            HistoryStore::View hist (g_tempHist);
+            size_t len = encodeHistoryBin (hist, since, nullptr, 0);
+            std::unique_ptr<uint8_t[]> bin (new (std::nothrow) uint8_t[len]);
+            if (!bin)
+               return false;
+            encodeHistoryBin (hist, since, bin.get (), len);
+            if (hist.consistent ())
+               return body.append (bin.get (), len);
+         }
+         return false;
+      }
+      default:
+         return false;
+   }
+}
+
+BodyRef ResponseCache::get (CachedDocument doc, int32_t since)
+{
+   uint32_t revision = documentRevision (doc);
+   if (doc == DOC_MEASURES)
+      since = 0;
+   m_uses++;
+
+   // Bodies of older data go first, to leave their memory to the new one.
+   for (int i = 0; i < RESPONSE_CACHE_SLOTS; i++)
+   {
+      if (m_slots[i].m_doc == doc && m_slots[i].m_revision != revision)
+         m_slots[i].m_body.reset ();
+   }
+
+   // Same document, data and since: share the body. Otherwise replace the least recently used.
+   Slot* victim = &m_slots[0];
+   for (int i = 0; i < RESPONSE_CACHE_SLOTS; i++)
+   {
+      Slot& slot = m_slots[i];
+      if (slot.m_body && slot.m_doc == doc && slot.m_since == since)
+      {
+         slot.m_lastUse = m_uses;
+         countMetric (g_responseCacheHits);
+         return slot.m_body;
+      }
+      if (!slot.m_body || (victim->m_body && slot.m_lastUse < victim->m_lastUse))
+         victim = &slot;
+   }
+   victim->m_body.reset ();
+
+   std::shared_ptr<SharedBody> body (new (std::nothrow) SharedBody ());
+   if (!body || !buildBody (doc, since, *body))
+      return BodyRef ();
+   countMetric (g_responseCacheBuilds);
+   victim->m_doc = doc;
+   victim->m_revision = revision;
+   victim->m_since = since;
+   victim->m_lastUse = m_uses;
+   victim->m_body = body;
+   return victim->m_body;
+}
+
+void ResponseCache::clear ()
+{
+   for (int i = 0; i < RESPONSE_CACHE_SLOTS; i++)
+      m_slots[i].m_body.reset ();
+}
+
+std::shared_ptr<ResponseTicket> ResponseTicket::take ()
+{
+   if (g_responsesInFlight.fetch_add (1) >= RESPONSE_INFLIGHT_MAX)
+   {
+      g_responsesInFlight--;
+      countMetric (g_httpRejected);
+      return std::shared_ptr<ResponseTicket> ();
+   }
+   std::shared_ptr<ResponseTicket> ticket (new (std::nothrow) ResponseTicket ());
+   if (!ticket)
+   {
+      g_responsesInFlight--;
+      countMetric (g_httpRejected);
+   }
+   return ticket;
+}
+
+ResponseTicket::~ResponseTicket ()
+{
+   g_responsesInFlight--;
+}
+
+bool historyJsonCacheable (int32_t since)
+{
+   HistoryStore::View hist (g_tempHist);
+   return hist.size () - hist.upperBound (since) <= RESPONSE_HISTORY_JSON_RECORDS;
+}
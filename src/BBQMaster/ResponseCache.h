@@ -0,0 +1,108 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+// Size of the blocks a cached body is stored in, about one TCP segment
+#define RESPONSE_BLOCK_SIZE 1436
+// Longest cached body
+#define RESPONSE_MAX_BLOCKS 16
+// Heap all the cached bodies may use together, those still being sent included
+#define RESPONSE_BYTES_MAX (48 * 1024)
+// Bodies kept, one per document and "since" asked for
+#define RESPONSE_CACHE_SLOTS 6
+// Responses of the data endpoints being sent at a time, more are answered 503
+#define RESPONSE_INFLIGHT_MAX 12
+// Seconds a client told 503 waits before trying again
+#define RESPONSE_RETRY_AFTER "2"
+// Longest /history.json answer that is cached, longer ones (the whole cook on page load) are streamed
+#define RESPONSE_HISTORY_JSON_RECORDS 32
+
+// Documents served from the cache
+enum CachedDocument
+{
+   DOC_MEASURES,
+   DOC_HISTORY_JSON,
+   DOC_HISTORY_BIN,
+   DOC_COUNT
+};
+
+// Response body serialized once and never changed after, shared by every response sending it.
+// Stored in fixed blocks so a long body needs no large contiguous allocation.
+class SharedBody
+{
+public:
+   SharedBody () : m_length (0), m_blocks () {}
+   ~SharedBody ();
+
+   // Append to the body. Returns false when the heap or the budget of the cache ran out.
+   bool append (const void* data, size_t len);
+   size_t length () const { return m_length; }
+   // Copy up to len bytes from offset, as the web server fills the TCP window. Returns the count copied.
+   size_t read (size_t offset, uint8_t* buf, size_t len) const;
+
+private:
+   SharedBody (const SharedBody&) = delete;
+   SharedBody& operator= (const SharedBody&) = delete;
+
+   size_t m_length;
+   uint8_t* m_blocks[RESPONSE_MAX_BLOCKS];
+};
+
+// A body is freed when the cache and the last response sending it let go of it.
+typedef std::shared_ptr<const SharedBody> BodyRef;
+
+// Last bodies of the data endpoints, each valid for one revision of its data.
+// Only used from the async TCP task, where the web handlers run one at a time.
+class ResponseCache
+{
+public:
+   ResponseCache () : m_slots (), m_uses (0) {}
+
+   // Body of doc for the current data, serialized on the first request after a change.
+   // since only matters for the history. Null when there is no memory for it.
+   BodyRef get (CachedDocument doc, int32_t since);
+   // Drop every body, responses in flight keep theirs.
+   void clear ();
+
+private:
+   struct Slot
+   {
+      CachedDocument m_doc;
+      uint32_t m_revision;
+      int32_t m_since;
+      uint32_t m_lastUse;
+      BodyRef m_body;
+   };
+
+   Slot m_slots[RESPONSE_CACHE_SLOTS];
+   uint32_t m_uses;
+};
+
+// Place of a response among the RESPONSE_INFLIGHT_MAX being sent, held until the web server destroys it.
+class ResponseTicket
+{
+public:
+   // Take a place. Returns null when they are all taken or out of memory.
+   static std::shared_ptr<ResponseTicket> take ();
+   ~ResponseTicket ();
+
+private:
+   ResponseTicket () {}
+   ResponseTicket (const ResponseTicket&) = delete;
+   ResponseTicket& operator= (const ResponseTicket&) = delete;
+};
+
+// Whether a /history.json answer from since on is short enough to be cached.
+bool historyJsonCacheable (int32_t since);
+
+extern ResponseCache g_responseCache;
+// Heap held by the cached bodies, those still being sent included
+extern std::atomic<uint32_t> g_responseBytes;
+// Responses being sent
+extern std::atomic<uint32_t> g_responsesInFlight;
+
+#endif
@@ -0,0 +1,307 @@
+#include "Sensors.h"
+#include "PitController.h"
+#include "Power.h"
+#include "Debug.h"
+#include "Metrics.h"
+
+Clock* g_clock = nullptr;
+ProbeAdc* g_probeAdc = nullptr;
+ThermocoupleBus* g_thermoCouples = nullptr;
+BatteryMonitor* g_battery = nullptr;
+
+NtcCalibration g_ntcCalibration[NTC_CHANNELS];
+NtcTable g_ntcTables[NTC_CHANNELS];
+FilterConfig g_filterConfig[SENSOR_COUNT];
+ChannelFilter g_filters[SENSOR_COUNT];
+uint8_t g_adsOversampling = 4;
+
+double g_batteryVoltage = 0;
+std::atomic<float> g_batteryLevel (0);
+volatile bool firmwareUpdating = false;
+std::atomic<bool> g_cookLogFlush (false);
+
+// Names of the channels, indexed the same way as DataPoint::m_sensors
+const char* const g_channelNames[SENSOR_COUNT] = {"NTC1", "NTC2", "NTC3", "NTC4", "TC1", "TC2", "TC3", "TC4"};
+
+SpscQueue<DataPoint, 8> g_readings;
+SpscQueue<HistPoint, 8> g_histPoints;
+std::atomic<int32_t> g_epochOffset (0);
+std::atomic<bool> g_holdHistory (false);
+
+HistoryStore g_tempHist;
+
+// Set every probe to the default calibration.
+void defaultNtcCalibration ()
+{
+   for (int i = 0; i < NTC_CHANNELS; i++)
+      g_ntcCalibration[i] = ntcCalibrationFromBeta (NTC_BCOEFFICIENT, NTC_SMP_TMP, NTC_SMP_RES);
+}
+
+// Rebuild the lookup tables after the calibration changed.
+void buildNtcTables ()
+{
+   for (int i = 0; i < NTC_CHANNELS; i++)
+      g_ntcTables[i].build (g_ntcCalibration[i]);
+}
+
+// Calculate NTC temp from the probe lookup table
+float calculateNTCTemp (int channel, int16_t adcValue)
+{
+   return g_ntcTables[channel].toTenthsF (adcValue) / 10.0f;
+}
+
+// Check whether temperature is valid.
+bool isValidTemp (float temp)
+{
+   if (temp <= 32.0 || temp > 1000.00)
+      return false;
+   else
+      return true;
+}
+
+// Set every channel to the default filter.
+void defaultFilterConfigs ()
+{
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      g_filterConfig[i] = defaultFilterConfig ();
+}
+
+// Apply the configured filters and oversampling.
+void applyFilterConfigs ()
+{
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      g_filters[i].configure (g_filterConfig[i]);
+   g_probeAdc->setOversampling (g_adsOversampling);
+}
+
+// Run a raw reading through the filter of its channel. Invalid readings restart the filter.
+Sensor filterReading (int channel, float tempF, uint32_t nowMillis)
+{
+   if (!isValidTemp (tempF))
+   {
+      countMetric (g_invalidReadings[channel]);
+      g_filters[channel].reset ();
+      return Sensor (false, tempF, g_channelNames[channel]);
+   }
+   float filtered = g_filters[channel].update (tempF, nowMillis);
+   return Sensor (isValidTemp (filtered), filtered, g_channelNames[channel]);
+}
+
+// Battery precentage calculator
+float batteryLevel()
+{
+   g_batteryVoltage = g_battery->voltage ();
+
+   float output = 0.0;             //output value
+   const float battery_max = 4.20; //maximum voltage of battery
+   const float battery_min = 3.5;  //minimum voltage of battery before shutdown
+
+   output = ((g_batteryVoltage - battery_min) / (battery_max - battery_min)) * 100;
+   if (output < 100)
+      return output;
+   else
+      return 100.0f;
+}
+
+
+int32_t stampTime (uint32_t nowMillis)
+{
+   return g_epochOffset.load () + (int32_t)(nowMillis / 1000);
+}
+
+bool toWallTime (int32_t& time)
+{
+   if (time >= UPTIME_STAMP_MAX)
+      return true;
+   int32_t epochOffset = g_epochOffset.load ();
+   if (!epochOffset)
+      return false;
+   time += epochOffset;
+   return true;
+}
+
+// Read the channels in mask, bit i for DataPoint::m_sensors[i], the others keep their last reading.
+// The NTC values come from the last completed ADC sweep. Readings are taken from power on,
+// stamped with the uptime until NTP has set the wall clock.
+void readSensors (DataPoint& reading, uint8_t mask)
+{
+   uint32_t now = g_clock->millis ();
+   reading.m_time = stampTime (now);
+
+   // NTC readings
+   for (int i = 0; i < NTC_CHANNELS; i++)
+   {
+      if (mask & (1 << i))
+         reading.m_sensors[i] = filterReading (i, calculateNTCTemp (i, g_probeAdc->value (i)), now);
+   }
+
+   // Thermocouple readings
+   for (int i = NTC_CHANNELS; i < SENSOR_COUNT; i++)
+   {
+      if (mask & (1 << i))
+         reading.m_sensors[i] = filterReading (i, g_thermoCouples->tempF (i - NTC_CHANNELS), now);
+   }
+
+   g_batteryLevel = batteryLevel ();
+
+#ifdef DEBUG_EXTRA_OUTPUT
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      if (!(mask & (1 << i)))
+         continue;
+      DEBUG_PRINT("Temp ");
+      DEBUG_PRINT(g_channelNames[i]);
+      DEBUG_PRINT(" F: ");
+      DEBUG_PRINTLN(reading.m_sensors[i].m_tempF);
+   }
+#endif
+}
+
+// Compact copy of a reading.
+HistPoint toHistPoint (const DataPoint& reading)
+{
+   HistPoint point;
+   point.m_time = reading.m_time;
+   point.m_avail = 0;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      point.m_temp[i] = toTenths (reading.m_sensors[i].m_tempF);
+      if (reading.m_sensors[i].m_ind)
+         point.m_avail |= 1 << i;
+   }
+   return point;
+}
+
+// History points waiting for the wall clock or the end of the cook log replay, owned by the sensor task
+static RingBuffer<HistPoint, HIST_PENDING_MAX> s_pendingHist;
+
+// Add a point stamped with the wall clock to the history
+static void keepHistPoint (const HistPoint& point)
+{
+   // A long gap since the logged samples means a new cook has started.
+   if (g_cookLog.isNewCook (point.m_time))
+   {
+      g_tempHist.clear ();
+      g_cookLog.clear ();
+   }
+   g_tempHist.add (point);
+   g_cookLog.append (point);
+   g_histPoints.push (point);
+}
+
+// Add a data point to the history
+void addDataPointToHistory (const DataPoint& reading)
+{
+  HistPoint point = toHistPoint (reading);
+
+  // The availability mask travels with every point, so probes can come and go without dropping the cook.
+  if (point.m_avail)
+  {
+   // Points taken before NTP or during the cook log replay wait, then go in with their uptime rebased.
+   if (g_holdHistory || !toWallTime (point.m_time))
+   {
+      if (s_pendingHist.full ())
+         countMetric (g_histPendingDropped);
+      s_pendingHist.push (point);
+      return;
+   }
+   while (!s_pendingHist.empty ())
+   {
+      HistPoint pending = s_pendingHist.front ();
+      s_pendingHist.popFront ();
+      toWallTime (pending.m_time);
+      keepHistPoint (pending);
+   }
+   keepHistPoint (point);
+  }
+
+#ifdef DEBUG_EXTRA_OUTPUT
+   DEBUG_PRINT ("size g_tempHist ");
+   DEBUG_PRINTLN(HistoryStore::View (g_tempHist).size ());
+#endif
+}
+
+// Sweep in progress: its channels, when it started and whether the ADC is still converting
+static uint8_t s_sweepMask = 0;
+static uint32_t s_sweepStart = 0;
+static bool s_adcBusy = false;
+
+void sensorTick (uint32_t ticks, DataPoint& reading)
+{
+   // The cook log page is only touched here, other tasks ask for it to be written out.
+   if (g_cookLogFlush)
+   {
+      g_cookLog.flush ();
+      g_cookLogFlush = false;
+   }
+   if (firmwareUpdating)
+      return;
+
+   // At the start of a slot, convert the channels the plan has due: the NTCs on the ADC and
+   // the thermocouples on their bus. The readings are taken once both are done.
+   uint32_t now = g_clock->millis ();
+   if (!s_sweepMask && ticks % SENSOR_SLOT_TICKS == 0)
+   {
+      s_sweepMask = g_samplePlanner.due (ticks / SENSOR_SLOT_TICKS);
+      s_sweepStart = now;
+      s_adcBusy = (s_sweepMask & NTC_CHANNEL_MASK) != 0;
+      if (s_adcBusy)
+         g_probeAdc->startSweep (s_sweepMask & NTC_CHANNEL_MASK);
+      if (s_sweepMask & ~NTC_CHANNEL_MASK)
+         g_thermoCouples->requestTemperatures ();
+   }
+   if (s_adcBusy && g_probeAdc->tick ())
+      s_adcBusy = false;
+   if (s_sweepMask && !s_adcBusy && (!(s_sweepMask & ~NTC_CHANNEL_MASK) || now - s_sweepStart >= THERMOCOUPLE_CONVERSION_MS))
+   {
+      uint32_t start = g_clock->micros ();
+      g_sensorConversions.fetch_add (__builtin_popcount (s_sweepMask), std::memory_order_relaxed);
+      readSensors (reading, s_sweepMask);
+      g_readings.push (reading);
+      markBoot (BOOT_FIRST_SAMPLE, now);
+      g_samplePlanner.sampled (reading, s_sweepMask, now);
+      s_sweepMask = 0;
+      // Closed loop on every reading, away from the network.
+      float duty = g_pitController.update (reading, now);
+      if (g_fan)
+         g_fan->setDuty (duty);
+      g_stageStats[STAGE_READ_SENSORS].record (g_clock->micros () - start);
+   }
+
+   // Add a point to the history over time.
+   if ((ticks + 1) % (HIST_INT / SENSOR_TASK_PERIOD) == 0)
+   {
+      uint32_t start = g_clock->micros ();
+      addDataPointToHistory (reading);
+      g_stageStats[STAGE_HISTORY].record (g_clock->micros () - start);
+   }
+}
+
+uint32_t sensorIdleTicks (uint32_t ticks)
+{
+   if (s_sweepMask || firmwareUpdating)
+      return 0;
+
+   // Up to the next history point, or an earlier slot with a channel due
+   const uint32_t histTicks = HIST_INT / SENSOR_TASK_PERIOD;
+   uint32_t next = ticks + 1;
+   uint32_t wake = next + (histTicks - 1 - next % histTicks);
+   for (uint32_t slot = (next + SENSOR_SLOT_TICKS - 1) / SENSOR_SLOT_TICKS; slot * SENSOR_SLOT_TICKS < wake; slot++)
+   {
+      if (g_samplePlanner.due (slot))
+      {
+         wake = slot * SENSOR_SLOT_TICKS;
+         break;
+      }
+   }
+   return wake - next;
+}
+
+void resetAcquisition ()
+{
+   s_sweepMask = 0;
+   s_adcBusy = false;
+   s_pendingHist.clear ();
+   g_samplePlanner.reset ();
+   applyFilterConfigs ();
+}
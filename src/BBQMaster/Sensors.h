@@ -0,0 +1,112 @@
+#ifndef SENSORS_H
+#define SENSORS_H
+
+#include <atomic>
+#include "Hal.h"
+#include "History.h"
+#include "CookLog.h"
+#include "SpscQueue.h"
+#include "Ntc.h"
+#include "Filter.h"
+
+#define HIST_INT 5000
+#define SENSOR_READ_INT 1500
+// Period of the sensor acquisition tick
+#define SENSOR_TASK_PERIOD 10
+// Ticks per sampling slot
+#define SENSOR_SLOT_TICKS (SENSOR_READ_INT / SENSOR_TASK_PERIOD)
+// Longest conversion of the MAX31850 thermocouple amplifiers
+#define THERMOCOUPLE_CONVERSION_MS 100
+// Bits of the NTC channels in a channel mask, the thermocouples are the others
+#define NTC_CHANNEL_MASK ((1 << NTC_CHANNELS) - 1)
+// Timestamps below this are seconds of uptime, taken before NTP set the wall clock.
+// Uptime never gets past 2^32 ms, the wall clock is well beyond 2001.
+#define UPTIME_STAMP_MAX 1000000000
+// History points kept until the wall clock is known, 10 minutes at HIST_INT
+#define HIST_PENDING_MAX 120
+
+// Default probe calibration, single B coefficient model
+#define NTC_SMP_TMP 25.81
+#define NTC_SMP_RES 52250
+#define NTC_BCOEFFICIENT 4200 //3950
+
+// Representation of one temperature probe
+struct Sensor
+{
+   // Availability flag
+   bool m_ind;
+   // Temperature
+   double m_tempF;
+   // Name of the sensor, points into the channel table
+   const char* m_name;
+
+public:
+   Sensor (bool ind, double tempF, const char* name) : m_ind (ind), m_tempF (tempF), m_name (name) {}
+   Sensor () : m_ind (false), m_tempF (0), m_name ("N/A") {}
+};
+
+// Data point completed with multiple probes
+struct DataPoint
+{
+   int m_time;
+   Sensor m_sensors[SENSOR_COUNT];
+};
+
+// Hardware used by the acquisition, provided by the board or the host build
+extern Clock* g_clock;
+extern ProbeAdc* g_probeAdc;
+extern ThermocoupleBus* g_thermoCouples;
+extern BatteryMonitor* g_battery;
+
+// Per probe calibration and the lookup tables built from it
+extern NtcCalibration g_ntcCalibration[NTC_CHANNELS];
+extern NtcTable g_ntcTables[NTC_CHANNELS];
+// Filter stage of each channel, the state is owned by the sensor task
+extern FilterConfig g_filterConfig[SENSOR_COUNT];
+extern ChannelFilter g_filters[SENSOR_COUNT];
+// ADC conversions averaged into each NTC reading
+extern uint8_t g_adsOversampling;
+
+// Battery charge in %, written by the sensor task and read by the network side
+extern std::atomic<float> g_batteryLevel;
+extern volatile bool firmwareUpdating;
+// Set by another task to have the sensor task write out the pending cook log page, cleared once written
+extern std::atomic<bool> g_cookLogFlush;
+
+// Readings handed from the sensor task to the network side
+extern SpscQueue<DataPoint, 8> g_readings;
+// History points handed from the sensor task to the network side
+extern SpscQueue<HistPoint, 8> g_histPoints;
+// now () minus the uptime in seconds, maintained by the network side so the sensor task never touches NTP
+extern std::atomic<int32_t> g_epochOffset;
+// Set while the cook log is restored at boot, the sensor task keeps its history points until then
+extern std::atomic<bool> g_holdHistory;
+
+// Saving the history for the histogram
+extern HistoryStore g_tempHist;
+// Copy of the history on flash, replayed at boot. Defined next to the file system it uses.
+extern CookLog g_cookLog;
+
+void defaultNtcCalibration ();
+void buildNtcTables ();
+float calculateNTCTemp (int channel, int16_t adcValue);
+bool isValidTemp (float temp);
+void defaultFilterConfigs ();
+void applyFilterConfigs ();
+Sensor filterReading (int channel, float tempF, uint32_t nowMillis);
+float batteryLevel ();
+// Seconds since the epoch once the wall clock is known, seconds of uptime before.
+int32_t stampTime (uint32_t nowMillis);
+// Move an uptime stamp onto the wall clock. Returns false while the wall clock is not known.
+bool toWallTime (int32_t& time);
+void readSensors (DataPoint& reading, uint8_t mask);
+HistPoint toHistPoint (const DataPoint& reading);
+void addDataPointToHistory (const DataPoint& reading);
+// One SENSOR_TASK_PERIOD step of the acquisition. ticks counts the steps since the start.
+void sensorTick (uint32_t ticks, DataPoint& reading);
+// Steps after ticks that have nothing to do, the sensor task sleeps through them.
+uint32_t sensorIdleTicks (uint32_t ticks);
+// Drop the sweep in progress, the sampling plan and the pending history, for a fresh start of the simulations.
+void resetAcquisition ();
+
+#endif
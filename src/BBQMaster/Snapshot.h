@@ -0,0 +1,146 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <atomic>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+
+// Data written by one task and read by others without locks. Values go through atomic
+// words: a reader racing the writer gets a mix of old and new words, never undefined
+// behaviour, and a sequence number around the copy, odd while a write is under way, tells it
+// to try again. The words are stored with release and loaded with acquire: a reader that
+// sees a new word also sees the odd sequence before it, and its second look at the sequence
+// cannot move ahead of the words. There are no standalone fences, which ThreadSanitizer does
+// not model. On the ESP32 the words are 32 bit loads and stores with a memory barrier.
+
+// Trivially copyable value stored as atomic words.
+template <typename T>
+class AtomicWords
+{
+public:
+   static_assert (std::is_trivially_copyable<T>::value, "Only plain data can be copied word by word");
+
+   AtomicWords () : m_words () {}
+
+   void store (const T& value)
+   {
+      uint32_t words[WORDS] = {};
+      memcpy (words, &value, sizeof (T));
+      for (size_t i = 0; i < WORDS; i++)
+         m_words[i].store (words[i], std::memory_order_release);
+   }
+
+   T load () const
+   {
+      uint32_t words[WORDS];
+      for (size_t i = 0; i < WORDS; i++)
+         words[i] = m_words[i].load (std::memory_order_acquire);
+      T value;
+      memcpy (&value, words, sizeof (T));
+      return value;
+   }
+
+private:
+   static constexpr size_t WORDS = (sizeof (T) + 3) / 4;
+   std::atomic<uint32_t> m_words[WORDS];
+};
+
+// Last value published by one writer task, read whole by any other task. Double buffered:
+// the writer fills the slot readers are not sent to, then points them at it, so it never
+// waits for a reader. A reader only retries when two publications overtook its copy, which
+// cannot happen while it preempts the writer on the same core.
+template <typename T>
+class Snapshot
+{
+public:
+   explicit Snapshot (const T& initial = T ()) : m_latest (0), m_version (0)
+   {
+      m_slots[0].m_value.store (initial);
+      m_slots[1].m_value.store (initial);
+   }
+
+   // Writer side.
+   void publish (const T& value)
+   {
+      int slot = 1 - m_latest.load (std::memory_order_relaxed);
+      Slot& target = m_slots[slot];
+      uint32_t seq = target.m_seq.load (std::memory_order_relaxed);
+      target.m_seq.store (seq + 1, std::memory_order_relaxed);
+      target.m_value.store (value);
+      target.m_seq.store (seq + 2, std::memory_order_release);
+      m_latest.store (slot, std::memory_order_release);
+      m_version.fetch_add (1, std::memory_order_release);
+   }
+
+   // Reader side, any task.
+   T read () const
+   {
+      for (;;)
+      {
+         const Slot& slot = m_slots[m_latest.load (std::memory_order_acquire)];
+         uint32_t seq = slot.m_seq.load (std::memory_order_acquire);
+         if (seq & 1)
+            continue;
+         T value = slot.m_value.load ();
+         if (slot.m_seq.load (std::memory_order_relaxed) == seq)
+            return value;
+      }
+   }
+
+   // Publications so far, to tell whether a copy derived from the value is out of date.
+   uint32_t version () const { return m_version.load (std::memory_order_acquire); }
+
+private:
+   struct Slot
+   {
+      Slot () : m_seq (0) {}
+      std::atomic<uint32_t> m_seq;
+      AtomicWords<T> m_value;
+   };
+
+   Slot m_slots[2];
+   std::atomic<int> m_latest;
+   std::atomic<uint32_t> m_version;
+};
+
+// RingBuffer whose items and indices are atomic words, so one task can append while others
+// read. Readers only get whole items and indices that go together through a sequence kept by the owner.
+template <typename T, size_t N>
+class AtomicRingBuffer
+{
+public:
+   AtomicRingBuffer () : m_head (0), m_size (0) {}
+
+   // Append an item, overwriting the oldest one when full. O(1).
+   void push (const T& item)
+   {
+      size_t head = m_head.load (std::memory_order_relaxed);
+      size_t size = m_size.load (std::memory_order_relaxed);
+      m_items[(head + size) % N].store (item);
+      if (size < N)
+         m_size.store (size + 1, std::memory_order_release);
+      else
+         m_head.store ((head + 1) % N, std::memory_order_release);
+   }
+
+   // Item at index, 0 being the oldest.
+   T operator[] (size_t index) const { return m_items[(m_head.load (std::memory_order_acquire) + index) % N].load (); }
+
+   size_t size () const { return m_size.load (std::memory_order_acquire); }
+   bool empty () const { return size () == 0; }
+   void clear ()
+   {
+      m_head.store (0, std::memory_order_release);
+      m_size.store (0, std::memory_order_release);
+   }
+   static constexpr size_t capacity () { return N; }
+
+private:
+   AtomicWords<T> m_items[N];
+   std::atomic<size_t> m_head;
+   std::atomic<size_t> m_size;
+};
+
+#endif
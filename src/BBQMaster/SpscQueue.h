@@ -0,0 +1,52 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lock free queue between exactly one producer task and one consumer task.
+// Holds up to N - 1 items. Pushing to a full queue drops the new item.
+template <typename T, size_t N>
+class SpscQueue
+{
+public:
+   SpscQueue () : m_head (0), m_tail (0), m_dropped (0) {}
+
+   // Producer side.
+   bool push (const T& item)
+   {
+      size_t tail = m_tail.load (std::memory_order_relaxed);
+      size_t next = (tail + 1) % N;
+      if (next == m_head.load (std::memory_order_acquire))
+      {
+         m_dropped++;
+         return false;
+      }
+      m_items[tail] = item;
+      m_tail.store (next, std::memory_order_release);
+      return true;
+   }
+
+   // Consumer side.
+   bool pop (T& item)
+   {
+      size_t head = m_head.load (std::memory_order_relaxed);
+      if (head == m_tail.load (std::memory_order_acquire))
+         return false;
+      item = m_items[head];
+      m_head.store ((head + 1) % N, std::memory_order_release);
+      return true;
+   }
+
+   // Items dropped because the consumer fell behind.
+   uint32_t dropped () const { return m_dropped; }
+
+private:
+   T m_items[N];
+   std::atomic<size_t> m_head;
+   std::atomic<size_t> m_tail;
+   volatile uint32_t m_dropped;
+};
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef TEXT_WRITER_H
+#define TEXT_WRITER_H
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stddef.h>
+
+// Appends to a fixed buffer, dropping what does not fit. The text stays terminated and the
+// length never goes past size - 1, however much the formatted parts would have needed.
+class TextWriter
+{
+public:
+   TextWriter (char* buf, size_t size) : m_buf (buf), m_size (size), m_len (0)
+   {
+      if (size)
+         buf[0] = '\0';
+   }
+
+   void print (const char* fmt, ...) __attribute__ ((format (printf, 2, 3)))
+   {
+      if (m_len + 1 >= m_size)
+         return;
+      va_list args;
+      va_start (args, fmt);
+      int len = vsnprintf (m_buf + m_len, m_size - m_len, fmt, args);
+      va_end (args);
+      advance (len);
+   }
+
+   // Room left for a formatter that writes into end () itself, then reports its length to advance ().
+   char* end () { return m_buf + m_len; }
+   size_t space () const { return m_size - m_len; }
+   void advance (int len)
+   {
+      if (len > 0)
+         m_len = m_len + len < m_size ? m_len + len : m_size - 1;
+   }
+
+   size_t length () const { return m_len; }
+
+private:
+   char* m_buf;
+   size_t m_size;
+   size_t m_len;
+};
+
+#endif
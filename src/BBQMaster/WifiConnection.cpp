@@ -0,0 +1,119 @@
+#include <string.h>
+#include "WifiConnection.h"
+#include "Metrics.h"
+#include "Debug.h"
+
+WifiLink* g_wifi = nullptr;
+WifiConnection g_wifiConnection;
+
+WifiConnection::WifiConnection () : m_state (WIFI_NO_NETWORK), m_since (0), m_apChanged (false), m_failures (0)
+{
+   memset (&m_cached, 0, sizeof (m_cached));
+}
+
+void WifiConnection::begin (const WifiAccessPoint& cached, uint32_t nowMillis)
+{
+   m_cached = cached;
+   m_apChanged = false;
+   m_failures = 0;
+   if (!g_wifi->hasCredentials ())
+   {
+      DEBUG_PRINTLN("No WiFi network configured");
+      m_state = WIFI_NO_NETWORK;
+      return;
+   }
+   join (nowMillis);
+}
+
+// Straight to the cached access point when there is one.
+void WifiConnection::join (uint32_t nowMillis)
+{
+   if (!m_cached.m_channel)
+   {
+      scan (nowMillis);
+      return;
+   }
+   g_wifi->begin (m_cached.m_bssid, m_cached.m_channel);
+   m_state = WIFI_FAST;
+   m_since = nowMillis;
+}
+
+void WifiConnection::scan (uint32_t nowMillis)
+{
+   DEBUG_PRINTLN("Scanning for the WiFi network");
+   g_wifi->begin (nullptr, 0);
+   m_state = WIFI_SCAN;
+   m_since = nowMillis;
+}
+
+void WifiConnection::connected (uint32_t nowMillis)
+{
+   countMetric (g_wifiConnects);
+   if (m_state == WIFI_SCAN)
+      countMetric (g_wifiScans);
+   markBoot (BOOT_WIFI, nowMillis);
+   m_state = WIFI_ONLINE;
+   m_failures = 0;
+
+   WifiAccessPoint ap;
+   g_wifi->accessPoint (ap.m_bssid, ap.m_channel);
+   if (ap.m_channel != m_cached.m_channel || memcmp (ap.m_bssid, m_cached.m_bssid, WIFI_BSSID_SIZE) != 0)
+   {
+      m_cached = ap;
+      m_apChanged = true;
+   }
+   DEBUG_PRINT("WiFi connected on channel ");
+   DEBUG_PRINTLN(ap.m_channel);
+}
+
+void WifiConnection::service (uint32_t nowMillis)
+{
+   switch (m_state)
+   {
+   case WIFI_NO_NETWORK:
+      break;
+
+   case WIFI_FAST:
+      if (g_wifi->connected ())
+         connected (nowMillis);
+      // The access point moved to another channel or is gone.
+      else if (nowMillis - m_since >= WIFI_FAST_TIMEOUT)
+         scan (nowMillis);
+      break;
+
+   case WIFI_SCAN:
+      if (g_wifi->connected ())
+         connected (nowMillis);
+      else if (nowMillis - m_since >= WIFI_SCAN_TIMEOUT)
+      {
+         DEBUG_PRINTLN("WiFi network not found");
+         if (m_failures < UINT8_MAX)
+            m_failures++;
+         m_state = WIFI_WAITING;
+         m_since = nowMillis;
+      }
+      break;
+
+   case WIFI_WAITING:
+      if (nowMillis - m_since >= WIFI_RETRY_DELAY)
+         join (nowMillis);
+      break;
+
+   case WIFI_ONLINE:
+      if (!g_wifi->connected ())
+      {
+         DEBUG_PRINTLN("WiFi connection lost");
+         join (nowMillis);
+      }
+      break;
+   }
+}
+
+bool WifiConnection::takeNewAccessPoint (WifiAccessPoint& ap)
+{
+   if (!m_apChanged)
+      return false;
+   ap = m_cached;
+   m_apChanged = false;
+   return true;
+}
@@ -0,0 +1,69 @@
+#ifndef WIFI_CONNECTION_H
+#define WIFI_CONNECTION_H
+
+#include <stdint.h>
+#include "Hal.h"
+
+#define WIFI_BSSID_SIZE 6
+// Time given to the cached access point before scanning every channel
+#define WIFI_FAST_TIMEOUT 3000
+// Time given to a join after a scan
+#define WIFI_SCAN_TIMEOUT 20000
+// Pause before joining again after a failed scan
+#define WIFI_RETRY_DELAY 30000
+// Failed joins in a row after which the stored network is taken as changed, about 2 minutes
+#define WIFI_PORTAL_FAILURES 3
+
+// Access point of the last connection, saved so the next join can skip the scan
+struct WifiAccessPoint
+{
+   uint8_t m_bssid[WIFI_BSSID_SIZE];
+   // 0 when unknown
+   uint8_t m_channel;
+};
+
+// Non blocking life cycle of the station: join the cached access point on its channel,
+// scan every channel when it does not answer, and join again in the background after a
+// drop. Sampling and the web server never wait for the radio.
+class WifiConnection
+{
+public:
+   enum State
+   {
+      WIFI_NO_NETWORK,
+      WIFI_FAST,
+      WIFI_SCAN,
+      WIFI_WAITING,
+      WIFI_ONLINE
+   };
+
+   WifiConnection ();
+
+   // Start joining, with the access point saved by the last connection.
+   void begin (const WifiAccessPoint& cached, uint32_t nowMillis);
+   // Advance the state machine. Call from loop (), never blocks.
+   void service (uint32_t nowMillis);
+   bool online () const { return m_state == WIFI_ONLINE; }
+   State state () const { return m_state; }
+   // The access point changed since the last call, to be saved for the next boot.
+   bool takeNewAccessPoint (WifiAccessPoint& ap);
+   // Joins that found no network since the last connection.
+   uint8_t failures () const { return m_failures; }
+
+private:
+   void join (uint32_t nowMillis);
+   void scan (uint32_t nowMillis);
+   void connected (uint32_t nowMillis);
+
+   State m_state;
+   uint32_t m_since;
+   WifiAccessPoint m_cached;
+   bool m_apChanged;
+   uint8_t m_failures;
+};
+
+// Radio used by the connection, provided by the board or the host build
+extern WifiLink* g_wifi;
+extern WifiConnection g_wifiConnection;
+
+#endif
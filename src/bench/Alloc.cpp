@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "Alloc.h"
+
+// Room kept in front of every block for its size, keeps the alignment of malloc.
+#define ALLOC_HEADER 16
+
+static AllocStats s_stats;
+
+extern "C"
+{
+void* __real_malloc (size_t size);
+void* __real_realloc (void* ptr, size_t size);
+void __real_free (void* ptr);
+
+void* __wrap_malloc (size_t size)
+{
+   uint8_t* block = (uint8_t*)__real_malloc (size + ALLOC_HEADER);
+   if (!block)
+      return nullptr;
+   memcpy (block, &size, sizeof (size));
+   s_stats.m_count++;
+   s_stats.m_live += size;
+   if (s_stats.m_live > s_stats.m_peak)
+      s_stats.m_peak = s_stats.m_live;
+   return block + ALLOC_HEADER;
+}
+
+void __wrap_free (void* ptr)
+{
+   if (!ptr)
+      return;
+   uint8_t* block = (uint8_t*)ptr - ALLOC_HEADER;
+   size_t size;
+   memcpy (&size, block, sizeof (size));
+   s_stats.m_live -= size;
+   __real_free (block);
+}
+
+void* __wrap_calloc (size_t count, size_t size)
+{
+   void* ptr = __wrap_malloc (count * size);
+   if (ptr)
+      memset (ptr, 0, count * size);
+   return ptr;
+}
+
+void* __wrap_realloc (void* ptr, size_t size)
+{
+   if (!ptr)
+      return __wrap_malloc (size);
+   uint8_t* block = (uint8_t*)ptr - ALLOC_HEADER;
+   size_t oldSize;
+   memcpy (&oldSize, block, sizeof (oldSize));
+   block = (uint8_t*)__real_realloc (block, size + ALLOC_HEADER);
+   if (!block)
+      return nullptr;
+   memcpy (block, &size, sizeof (size));
+   s_stats.m_count++;
+   s_stats.m_live += size - oldSize;
+   if (s_stats.m_live > s_stats.m_peak)
+      s_stats.m_peak = s_stats.m_live;
+   return block + ALLOC_HEADER;
+}
+}
+
+void* operator new (size_t size)
+{
+   void* ptr = malloc (size);
+   // Out of memory is fatal for the benchmark anyway.
+   if (!ptr)
+      abort ();
+   return ptr;
+}
+
+void* operator new[] (size_t size)
+{
+   return operator new (size);
+}
+
+void* operator new (size_t size, const std::nothrow_t&) noexcept
+{
+   return malloc (size);
+}
+
+void* operator new[] (size_t size, const std::nothrow_t&) noexcept
+{
+   return malloc (size);
+}
+
+void operator delete (void* ptr) noexcept
+{
+   free (ptr);
+}
+
+void operator delete[] (void* ptr) noexcept
+{
+   free (ptr);
+}
+
+void operator delete (void* ptr, size_t) noexcept
+{
+   free (ptr);
+}
+
+void operator delete[] (void* ptr, size_t) noexcept
+{
+   free (ptr);
+}
+
+AllocStats allocStats ()
+{
+   return s_stats;
+}
+
+void resetAllocPeak ()
+{
+   s_stats.m_peak = s_stats.m_live;
+}
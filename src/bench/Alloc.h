@@ -0,0 +1,19 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+
+// Heap use of the benchmark. malloc, calloc, realloc and free are wrapped at link time
+// (-Wl,--wrap=...) and operator new/delete go through them.
+struct AllocStats
+{
+   unsigned long m_count;
+   size_t m_live;
+   size_t m_peak;
+};
+
+AllocStats allocStats ();
+// Forget the peak so far, it starts again from the bytes currently allocated.
+void resetAllocPeak ();
+
+#endif
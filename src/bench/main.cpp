@@ -0,0 +1,470 @@
+// Microbenchmarks of the firmware hot paths: time per call, heap allocations per call and
+// peak heap. The steady state path (sample, history, JSON and MQTT) must not allocate after
+// the warm up call, which fails the run on the PC. Runs on the PC (pio run -e bench -t exec) or on the board (env bench_device,
+// results on the serial port).
+//
+// On the PC a baseline file can be given to check for regressions, or recorded with --record:
+//    .pio/build/bench/program src/bench/baseline.txt [--record]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Alloc.h"
+#include "../BBQMaster/Sensors.h"
+#include "../BBQMaster/Network.h"
+#include "../BBQMaster/MqttPublisher.h"
+#include "../BBQMaster/Power.h"
+#include "../BBQMaster/ResponseCache.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <esp_timer.h>
+#else
+#include <chrono>
+#endif
+
+// Minimum measuring time of one run, and runs of each benchmark
+#define BENCH_MIN_NS 50000000LL
+#define BENCH_REPEATS 5
+// Allowed slowdown against the baseline before it counts as a regression, in percent
+#define BENCH_TIME_TOLERANCE 25
+#define BENCH_MAX 16
+// Clients of the load test of the data endpoints
+#define BENCH_CLIENTS 10
+
+// File system that only counts what is written, so the cook log costs no RAM.
+class NullFileSystem : public FileSystem
+{
+public:
+   bool exists (const char*) override { return false; }
+   bool remove (const char*) override { return true; }
+   size_t size (const char*) override { return 0; }
+   size_t read (const char*, size_t, uint8_t*, size_t) override { return 0; }
+   size_t append (const char*, const uint8_t*, size_t len) override { return len; }
+   size_t write (const char*, const uint8_t*, size_t len) override { return len; }
+};
+
+// Always connected broker that drops everything.
+class NullMqtt : public MqttTransport
+{
+public:
+   bool connected () override { return true; }
+   bool startConnect (const char*, const char*, const char*) override { return true; }
+   ConnectStatus pollConnect () override { return CONNECT_DONE; }
+   bool publish (const char*, const char*, bool) override { return true; }
+   void loop () override {}
+   int state () override { return 0; }
+};
+
+// Time that only moves when told to
+class StepClock : public Clock
+{
+public:
+   StepClock () : m_micros (0) {}
+   uint32_t millis () override { return m_micros / 1000; }
+   uint32_t micros () override { return m_micros; }
+   void advance (uint32_t ms) { m_micros += ms * 1000; }
+
+private:
+   uint32_t m_micros;
+};
+
+// Probes and battery reading fixed values
+class FixedAdc : public ProbeAdc
+{
+public:
+   FixedAdc () : m_busy (false) {}
+   void begin () override {}
+   void setOversampling (uint8_t) override {}
+   void startSweep (uint8_t) override { m_busy = true; }
+   bool tick () override
+   {
+      bool done = m_busy;
+      m_busy = false;
+      return done;
+   }
+   int16_t value (int channel) const override { return 3000 + 1000 * channel; }
+
+private:
+   bool m_busy;
+};
+
+class FixedThermocouples : public ThermocoupleBus
+{
+public:
+   void begin () override {}
+   void requestTemperatures () override {}
+   float tempF (int channel) override { return 225.0f + channel; }
+};
+
+class FixedBattery : public BatteryMonitor
+{
+public:
+   float voltage () override { return 3.9f; }
+};
+
+NullFileSystem g_nullFs;
+CookLog g_cookLog (g_nullFs);
+NullMqtt g_nullMqtt;
+StepClock g_stepClock;
+FixedAdc g_fixedAdc;
+FixedThermocouples g_fixedThermocouples;
+FixedBattery g_fixedBattery;
+
+struct BenchResult
+{
+   char m_name[32];
+   double m_nsPerOp;
+   double m_allocsPerOp;
+   unsigned long m_peakBytes;
+   // Part of the steady state path, must not allocate at all
+   bool m_allocFree;
+};
+
+static int64_t nowNs ()
+{
+#ifdef ARDUINO
+   return esp_timer_get_time () * 1000;
+#else
+   return std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+#endif
+}
+
+// Time iterations calls of fn, filling in the heap use.
+static int64_t timeBench (void (*fn) (), long iterations, BenchResult& result)
+{
+   resetAllocPeak ();
+   AllocStats before = allocStats ();
+   int64_t start = nowNs ();
+   for (long i = 0; i < iterations; i++)
+      fn ();
+   int64_t elapsed = nowNs () - start;
+   AllocStats after = allocStats ();
+
+   result.m_allocsPerOp = (double)(after.m_count - before.m_count) / iterations;
+   result.m_peakBytes = after.m_peak - before.m_live;
+   return elapsed;
+}
+
+// Double the iterations until a run lasts BENCH_MIN_NS, then keep the fastest of
+// BENCH_REPEATS runs so other load on the machine does not count.
+static BenchResult runBench (const char* name, void (*fn) (), bool allocFree = false)
+{
+   BenchResult result;
+   snprintf (result.m_name, sizeof (result.m_name), "%s", name);
+   result.m_allocFree = allocFree;
+
+   // Warm up, lazily built state is not part of the measure.
+   fn ();
+
+   long iterations = 1;
+   int64_t elapsed;
+   while ((elapsed = timeBench (fn, iterations, result)) < BENCH_MIN_NS)
+      iterations *= 2;
+   int64_t best = elapsed;
+   for (int r = 1; r < BENCH_REPEATS; r++)
+   {
+      elapsed = timeBench (fn, iterations, result);
+      if (elapsed < best)
+         best = elapsed;
+   }
+   result.m_nsPerOp = (double)best / iterations;
+   return result;
+}
+
+// Sample time of the fake history
+static int32_t s_histTime = 1700000000;
+
+// Sample of a cook with every probe plugged in
+static HistPoint syntheticPoint (int32_t time)
+{
+   HistPoint point;
+   point.m_time = time;
+   point.m_avail = 0xff;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      point.m_temp[i] = toTenths (150.0 + 50.0 * i + (time / 5 + i) % 7);
+   return point;
+}
+
+// Fill the history with a whole overnight cook, the worst case for serialization.
+static void fillHistory ()
+{
+   g_tempHist.clear ();
+   for (int i = 0; i < 16 * 3600 / (HIST_INT / 1000); i++)
+   {
+      g_tempHist.add (syntheticPoint (s_histTime));
+      s_histTime += HIST_INT / 1000;
+   }
+
+   g_lastSenUpdate.m_time = s_histTime;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      g_lastSenUpdate.m_sensors[i] = Sensor (true, 150.0 + 50.0 * i, g_channelNames[i]);
+   publishMeasures ();
+}
+
+static volatile float s_sink;
+
+static void benchCalculateNTCTemp ()
+{
+   float sum = 0;
+   for (int16_t adc = 0; adc < NTC_MAX_ADC; adc += 997)
+      sum += calculateNTCTemp (adc % NTC_CHANNELS, adc);
+   s_sink = sum;
+}
+
+static void benchFormatSensorJson ()
+{
+   char tempJson[SENSOR_JSON_MAX];
+   formatSensorJson (tempJson, SENSOR_JSON_MAX);
+   s_sink = tempJson[0];
+}
+
+static void benchHistoryJson ()
+{
+   HistoryJsonStream stream = HistoryJsonStream ();
+   stream.m_lastTime = INT32_MIN;
+   // About one TCP segment per chunk, as the web server asks for
+   uint8_t chunk[1436];
+   while (fillHistoryChunk (stream, chunk, sizeof (chunk)) > 0)
+      ;
+   s_sink = chunk[0];
+}
+
+static void benchAddDataPointToHistory ()
+{
+   DataPoint reading;
+   reading.m_time = s_histTime;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      reading.m_sensors[i] = Sensor (true, 150.0 + 50.0 * i, g_channelNames[i]);
+   s_histTime += HIST_INT / 1000;
+   addDataPointToHistory (reading);
+
+   HistPoint point;
+   while (g_histPoints.pop (point))
+      ;
+}
+
+static void benchPublishDiscovery ()
+{
+   publishDiscovery ();
+}
+
+// One history period of the whole sample, history, JSON and MQTT path, as the sensor
+// task and loop () run it.
+static void benchSteadyState ()
+{
+   static uint32_t ticks = 0;
+   DataPoint reading;
+   for (int i = 0; i < HIST_INT / SENSOR_TASK_PERIOD; i++)
+   {
+      g_stepClock.advance (SENSOR_TASK_PERIOD);
+      sensorTick (ticks++, reading);
+      if (takeReadings ())
+      {
+         char tempJson[SENSOR_JSON_MAX];
+         formatSensorJson (tempJson, SENSOR_JSON_MAX);
+         s_sink = tempJson[0];
+         g_mqttPublisher.offer (g_lastSenUpdate, g_batteryLevel, g_stepClock.millis ());
+      }
+      HistPoint point;
+      while (g_histPoints.pop (point))
+         ;
+      g_mqttPublisher.service ();
+   }
+}
+
+// Load test of a data endpoint: every client asks for the document and reads the whole
+// body as the web server fills the TCP window, all the responses in flight together.
+static void serveClients (CachedDocument doc, int32_t since, int clients)
+{
+   BodyRef bodies[BENCH_CLIENTS];
+   for (int c = 0; c < clients; c++)
+      bodies[c] = g_responseCache.get (doc, since);
+   uint8_t segment[RESPONSE_BLOCK_SIZE];
+   for (int c = 0; c < clients; c++)
+   {
+      size_t index = 0;
+      size_t len;
+      while ((len = bodies[c]->read (index, segment, sizeof (segment))) > 0)
+         index += len;
+      s_sink = segment[0];
+   }
+}
+
+// A new reading, then the clients polling /measures.json.
+static void serveMeasures (int clients)
+{
+   publishMeasures ();
+   serveClients (DOC_MEASURES, 0, clients);
+}
+
+static void benchMeasures1 () { serveMeasures (1); }
+static void benchMeasures10 () { serveMeasures (BENCH_CLIENTS); }
+
+// A new history point, then the clients polling /history.json for the points since their last poll.
+static void serveHistoryPoll (int clients)
+{
+   int32_t since = s_histTime - HIST_INT / 1000;
+   g_tempHist.add (syntheticPoint (s_histTime));
+   s_histTime += HIST_INT / 1000;
+   serveClients (DOC_HISTORY_JSON, since, clients);
+}
+
+static void benchHistoryPoll1 () { serveHistoryPoll (1); }
+static void benchHistoryPoll10 () { serveHistoryPoll (BENCH_CLIENTS); }
+
+// A new history point, then the clients loading the whole /history.bin.
+static void serveHistoryBin (int clients)
+{
+   g_tempHist.add (syntheticPoint (s_histTime));
+   s_histTime += HIST_INT / 1000;
+   serveClients (DOC_HISTORY_BIN, INT32_MIN, clients);
+}
+
+static void benchHistoryBin1 () { serveHistoryBin (1); }
+static void benchHistoryBin10 () { serveHistoryBin (BENCH_CLIENTS); }
+
+static int runAll (BenchResult* results)
+{
+   int count = 0;
+   results[count++] = runBench ("calculateNTCTemp_x28", benchCalculateNTCTemp);
+   results[count++] = runBench ("formatSensorJson", benchFormatSensorJson, true);
+   results[count++] = runBench ("historyJson_16h", benchHistoryJson);
+   results[count++] = runBench ("addDataPointToHistory", benchAddDataPointToHistory, true);
+   results[count++] = runBench ("publishDiscovery", benchPublishDiscovery);
+   results[count++] = runBench ("steadyState_5s", benchSteadyState, true);
+   results[count++] = runBench ("measures_1client", benchMeasures1);
+   results[count++] = runBench ("measures_10clients", benchMeasures10);
+   results[count++] = runBench ("historyPoll_1client", benchHistoryPoll1);
+   results[count++] = runBench ("historyPoll_10clients", benchHistoryPoll10);
+   results[count++] = runBench ("historyBin_1client", benchHistoryBin1);
+   results[count++] = runBench ("historyBin_10clients", benchHistoryBin10);
+   return count;
+}
+
+static void setupBench ()
+{
+   g_clock = &g_stepClock;
+   g_probeAdc = &g_fixedAdc;
+   g_thermoCouples = &g_fixedThermocouples;
+   g_battery = &g_fixedBattery;
+   g_mqtt = &g_nullMqtt;
+   g_epochOffset = s_histTime;
+   setupMqttTopics ();
+   snprintf (g_uniqueId, 5, "0000");
+   defaultNtcCalibration ();
+   buildNtcTables ();
+   defaultFilterConfigs ();
+   applyFilterConfigs ();
+   // Every channel on every sweep, the steady state keeps measuring the full pipeline.
+   g_samplePlanner.setSetting (POWER_FULL);
+   g_cookLog.begin ();
+   fillHistory ();
+}
+
+#ifdef ARDUINO
+
+static void printResult (const BenchResult& result)
+{
+   printf ("%-24s %12.1f %10.2f %10lu%s\n", result.m_name, result.m_nsPerOp, result.m_allocsPerOp, result.m_peakBytes, result.m_allocFree && result.m_allocsPerOp > 0 ? " ALLOCATES" : "");
+}
+
+void setup ()
+{
+   Serial.begin (115200);
+   setupBench ();
+
+   BenchResult results[BENCH_MAX];
+   int count = runAll (results);
+   printf ("%-24s %12s %10s %10s\n", "name", "ns/op", "allocs/op", "peak B");
+   for (int i = 0; i < count; i++)
+      printResult (results[i]);
+}
+
+void loop ()
+{
+   delay (1000);
+}
+
+#else
+
+// Read a baseline written by --record. Returns the number of entries.
+static int readBaseline (const char* path, BenchResult* baseline)
+{
+   FILE* file = fopen (path, "r");
+   if (!file)
+      return 0;
+   int count = 0;
+   char line[128];
+   while (count < BENCH_MAX && fgets (line, sizeof (line), file))
+   {
+      BenchResult& entry = baseline[count];
+      if (line[0] != '#' && sscanf (line, "%31s %lf %lf %lu", entry.m_name, &entry.m_nsPerOp, &entry.m_allocsPerOp, &entry.m_peakBytes) == 4)
+         count++;
+   }
+   fclose (file);
+   return count;
+}
+
+static bool writeBaseline (const char* path, const BenchResult* results, int count)
+{
+   FILE* file = fopen (path, "w");
+   if (!file)
+      return false;
+   fprintf (file, "# name ns/op allocs/op peak_bytes, recorded with --record\n");
+   for (int i = 0; i < count; i++)
+      fprintf (file, "%s %.1f %.2f %lu\n", results[i].m_name, results[i].m_nsPerOp, results[i].m_allocsPerOp, results[i].m_peakBytes);
+   fclose (file);
+   return true;
+}
+
+int main (int argc, char** argv)
+{
+   const char* baselinePath = argc > 1 ? argv[1] : nullptr;
+   bool record = argc > 2 && strcmp (argv[2], "--record") == 0;
+
+   setupBench ();
+   BenchResult results[BENCH_MAX];
+   int count = runAll (results);
+
+   BenchResult baseline[BENCH_MAX];
+   int baselineCount = baselinePath && !record ? readBaseline (baselinePath, baseline) : 0;
+
+   int regressions = 0;
+   printf ("%-24s %12s %10s %10s %8s\n", "name", "ns/op", "allocs/op", "peak B", "vs base");
+   for (int i = 0; i < count; i++)
+   {
+      const BenchResult& result = results[i];
+      printf ("%-24s %12.1f %10.2f %10lu", result.m_name, result.m_nsPerOp, result.m_allocsPerOp, result.m_peakBytes);
+      for (int b = 0; b < baselineCount; b++)
+      {
+         if (strcmp (baseline[b].m_name, result.m_name) != 0)
+            continue;
+         double change = (result.m_nsPerOp / baseline[b].m_nsPerOp - 1.0) * 100.0;
+         // Heap use is deterministic, any increase is a regression.
+         bool regressed = change > BENCH_TIME_TOLERANCE || result.m_allocsPerOp > baseline[b].m_allocsPerOp + 0.005 || result.m_peakBytes > baseline[b].m_peakBytes;
+         printf (" %+7.1f%%%s", change, regressed ? " REGRESSED" : "");
+         if (regressed)
+            regressions++;
+      }
+      if (result.m_allocFree && result.m_allocsPerOp > 0)
+      {
+         printf (" ALLOCATES");
+         regressions++;
+      }
+      printf ("\n");
+   }
+
+   if (record)
+   {
+      if (!writeBaseline (baselinePath, results, count))
+      {
+         printf ("Cannot write %s\n", baselinePath);
+         return 2;
+      }
+      printf ("Baseline recorded to %s\n", baselinePath);
+   }
+   return regressions ? 1 : 0;
+}
+
+#endif
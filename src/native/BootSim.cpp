@@ -0,0 +1,259 @@
+// Reboot in the middle of a cook: the config record is loaded, sampling starts at once,
+// the cook log is restored while the WiFi joins the cached access point and NTP answers
+// some time later. Prints the boot timeline and checks that the points taken before the
+// wall clock was known land in the history in order. A second run joins with a stale
+// cached access point.
+//
+//    .pio/build/native/program 0 boot
+
+#include <stdio.h>
+#include <string.h>
+#include "FakeHal.h"
+#include "../BBQMaster/Sensors.h"
+#include "../BBQMaster/Network.h"
+#include "../BBQMaster/Metrics.h"
+#include "../BBQMaster/Config.h"
+#include "../BBQMaster/Power.h"
+#include "../BBQMaster/WifiConnection.h"
+
+// Wall clock at the reboot, 3 hours into the cook
+#define BOOT_SIM_TIME 1700010800
+#define BOOT_SIM_COOK_AT (3 * 3600000u)
+// Cook logged before the reboot, up to a few seconds before it
+#define BOOT_SIM_LOGGED 3600
+#define BOOT_SIM_LOG_GAP 10
+// Time the cook log replay takes on the board
+#define BOOT_SIM_REPLAY_MS 1500
+// Join times of the access point, on its channel and after a scan of every channel
+#define BOOT_SIM_FAST_JOIN_MS 300
+#define BOOT_SIM_SCAN_JOIN_MS 2500
+// NTP answers this long after the first connection
+#define BOOT_SIM_NTP_DELAY 40000
+#define BOOT_SIM_SECONDS 180
+
+// Bounds of the regression check
+#define BOOT_SIM_MAX_FIRST_SAMPLE 1000
+
+static const uint8_t s_bssid[6] = {0x24, 0x0A, 0xC4, 0x12, 0x34, 0x56};
+static const uint8_t s_oldBssid[6] = {0x24, 0x0A, 0xC4, 0x65, 0x43, 0x21};
+static TempCurve s_curve;
+
+// The cook carries on from where it was before the reboot.
+static float rebootCurve (int channel, uint32_t millis)
+{
+   return s_curve (channel, BOOT_SIM_COOK_AT + millis);
+}
+
+// Save non default settings, load them back and check a damaged record is refused.
+static bool checkConfigRecord ()
+{
+   AlarmRule rule;
+   makeAlarmRule ("target", "NTC1", 203, 2, ALARM_DEFAULT_WINDOW, rule);
+   g_alarms.setRule (3, rule);
+   g_pitController.setSetpoint (250);
+   g_pitController.setEnabled (true);
+   g_samplePlanner.setSetting (POWER_SAVER);
+   g_adsOversampling = 8;
+
+   StoredConfig saved;
+   captureConfig (saved);
+   uint8_t record[CONFIG_RECORD_SIZE];
+   size_t len = encodeConfig (saved, record, sizeof (record));
+
+   g_alarms.clear ();
+   g_pitController.setEnabled (false);
+   g_samplePlanner.setSetting (POWER_AUTO);
+   g_adsOversampling = 4;
+
+   StoredConfig loaded;
+   bool ok = decodeConfig (record, len, loaded);
+   if (ok)
+      applyConfig (loaded);
+   StoredConfig applied;
+   captureConfig (applied);
+   ok = ok && memcmp (&saved, &applied, sizeof (saved)) == 0;
+
+   record[CONFIG_HEADER_SIZE + 5] ^= 1;
+   bool damaged = decodeConfig (record, len, loaded);
+   printf ("boot config: %u byte record, %s, damaged record %s\n", (unsigned)len, ok ? "restored" : "NOT RESTORED", damaged ? "ACCEPTED" : "refused");
+
+   // Back to the defaults for the boot itself
+   g_alarms.clear ();
+   g_pitController.setEnabled (false);
+   g_samplePlanner.setSetting (POWER_FULL);
+   g_adsOversampling = 4;
+   return ok && !damaged;
+}
+
+// Log the cook of the hour before the reboot.
+static void logPreviousCook ()
+{
+   for (int32_t t = BOOT_SIM_TIME - BOOT_SIM_LOGGED; t <= BOOT_SIM_TIME - BOOT_SIM_LOG_GAP; t += HIST_INT / 1000)
+   {
+      uint32_t millis = BOOT_SIM_COOK_AT - (BOOT_SIM_TIME - t) * 1000u;
+      HistPoint point;
+      point.m_time = t;
+      point.m_avail = 0;
+      for (int i = 0; i < SENSOR_COUNT; i++)
+      {
+         float temp = s_curve (i, millis);
+         point.m_temp[i] = isnan (temp) ? 0 : toTenths (temp);
+         if (!isnan (temp))
+            point.m_avail |= 1 << i;
+      }
+      g_cookLog.append (point);
+   }
+   g_cookLog.flush ();
+}
+
+// Join with a cached access point that moved, as after a router change.
+static bool checkStaleAccessPoint ()
+{
+   FakeClock clock;
+   FakeWifi wifi (clock, s_bssid, 6, BOOT_SIM_FAST_JOIN_MS, BOOT_SIM_SCAN_JOIN_MS);
+   g_wifi = &wifi;
+   WifiConnection connection;
+   WifiAccessPoint cached;
+   memcpy (cached.m_bssid, s_oldBssid, sizeof (cached.m_bssid));
+   cached.m_channel = 11;
+   connection.begin (cached, clock.millis ());
+   while (!connection.online () && clock.millis () < WIFI_FAST_TIMEOUT + WIFI_SCAN_TIMEOUT)
+   {
+      clock.advance (SENSOR_TASK_PERIOD);
+      connection.service (clock.millis ());
+   }
+   WifiAccessPoint ap;
+   bool saved = connection.takeNewAccessPoint (ap) && ap.m_channel == 6 && memcmp (ap.m_bssid, s_bssid, sizeof (s_bssid)) == 0;
+   printf ("boot wifi with a stale access point: joined at %u ms after %lu attempts, new access point %s\n", (unsigned)clock.millis (), wifi.joins (),
+           saved ? "cached" : "NOT CACHED");
+   return connection.online () && saved;
+}
+
+// Stored network that does not take the credentials any more, as after a password change. The
+// config portal is due after WIFI_PORTAL_FAILURES joins.
+static bool checkChangedNetwork ()
+{
+   FakeClock clock;
+   FakeWifi wifi (clock, s_bssid, 6, UINT32_MAX, UINT32_MAX);
+   g_wifi = &wifi;
+   WifiConnection connection;
+   WifiAccessPoint cached;
+   memcpy (cached.m_bssid, s_bssid, sizeof (cached.m_bssid));
+   cached.m_channel = 6;
+   connection.begin (cached, clock.millis ());
+   uint32_t limit = WIFI_PORTAL_FAILURES * (WIFI_FAST_TIMEOUT + WIFI_SCAN_TIMEOUT + WIFI_RETRY_DELAY);
+   while (connection.failures () < WIFI_PORTAL_FAILURES && clock.millis () < limit)
+   {
+      clock.advance (SENSOR_TASK_PERIOD);
+      connection.service (clock.millis ());
+   }
+   bool due = connection.failures () >= WIFI_PORTAL_FAILURES;
+   printf ("boot wifi with a changed password: config portal %s at %u ms after %lu attempts\n", due ? "due" : "NOT DUE", (unsigned)clock.millis (), wifi.joins ());
+   return due;
+}
+
+int runBootSimulation (TempCurve curve)
+{
+   srand (1);
+   s_curve = curve;
+
+   FakeClock clock;
+   ScriptedAdc adc (clock, rebootCurve, ntcCalibrationFromBeta (NTC_BCOEFFICIENT, NTC_SMP_TMP, NTC_SMP_RES));
+   ScriptedThermocouples thermocouples (clock, rebootCurve);
+   FakeBattery battery (3.9f);
+   FakeWifi wifi (clock, s_bssid, 6, BOOT_SIM_FAST_JOIN_MS, BOOT_SIM_SCAN_JOIN_MS);
+
+   g_clock = &clock;
+   g_probeAdc = &adc;
+   g_thermoCouples = &thermocouples;
+   g_battery = &battery;
+   g_wifi = &wifi;
+
+   defaultNtcCalibration ();
+   defaultFilterConfigs ();
+   bool ok = checkConfigRecord ();
+   buildNtcTables ();
+   applyFilterConfigs ();
+
+   g_cookLog.begin ();
+   logPreviousCook ();
+   int32_t lastLogged = BOOT_SIM_TIME - BOOT_SIM_LOG_GAP;
+
+   // Boot as in setup (): sampling first, the history held until the log is restored.
+   g_tempHist.clear ();
+   g_holdHistory = true;
+   WifiAccessPoint cached;
+   memcpy (cached.m_bssid, s_bssid, sizeof (cached.m_bssid));
+   cached.m_channel = 6;
+   g_wifiConnection.begin (cached, clock.millis ());
+
+   uint32_t ntpAt = 0;
+   DataPoint reading;
+   uint32_t totalTicks = BOOT_SIM_SECONDS * 1000 / SENSOR_TASK_PERIOD;
+   for (uint32_t ticks = 0; ticks < totalTicks; ticks++)
+   {
+      clock.advance (SENSOR_TASK_PERIOD);
+      uint32_t ms = clock.millis ();
+      sensorTick (ticks, reading);
+
+      if (ms == BOOT_SIM_REPLAY_MS)
+      {
+         g_cookLog.begin ();
+         g_cookLog.replay ([](const HistPoint& point) { g_tempHist.add (point); });
+         g_holdHistory = false;
+         markBoot (BOOT_HISTORY, ms);
+      }
+
+      g_wifiConnection.service (ms);
+      if (g_wifiConnection.online () && !ntpAt)
+         ntpAt = ms + BOOT_SIM_NTP_DELAY;
+      if (ntpAt && ms >= ntpAt && !g_epochOffset)
+      {
+         g_epochOffset = BOOT_SIM_TIME;
+         markBoot (BOOT_TIME, ms);
+      }
+
+      takeReadings ();
+      HistPoint point;
+      while (g_histPoints.pop (point))
+         ;
+   }
+
+   printf ("boot timeline:");
+   static const char* const names[] = {"config", "first sample", "history", "wifi", "wall clock", "mqtt"};
+   for (int i = 0; i < BOOT_STAGE_COUNT; i++)
+      if (g_bootMillis[i])
+         printf (" %s %u ms,", names[i], (unsigned)g_bootMillis[i].load ());
+   printf (" %lu wifi attempts\n", wifi.joins ());
+
+   // The restored cook followed by the points of this boot, in order and on the wall clock.
+   HistoryStore::View hist (g_tempHist);
+   size_t newPoints = 0;
+   size_t heldPoints = 0;
+   int32_t firstNew = 0;
+   bool ordered = true;
+   for (size_t i = 0; i < hist.size (); i++)
+   {
+      if (i && hist[i].m_time <= hist[i - 1].m_time)
+         ordered = false;
+      if (hist[i].m_time > lastLogged)
+      {
+         if (!newPoints)
+            firstNew = hist[i].m_time;
+         newPoints++;
+         if (hist[i].m_time < BOOT_SIM_TIME + (int32_t)(ntpAt / 1000))
+            heldPoints++;
+      }
+   }
+   size_t expected = BOOT_SIM_SECONDS * 1000 / HIST_INT;
+   printf ("boot history: %u records, %u since the reboot, first at +%d s, %u held until the wall clock, %s, %u dropped\n", (unsigned)hist.size (),
+           (unsigned)newPoints, (int)(firstNew - BOOT_SIM_TIME), (unsigned)heldPoints, ordered ? "in order" : "OUT OF ORDER",
+           (unsigned)g_histPendingDropped.load ());
+
+   ok = ok && g_bootMillis[BOOT_FIRST_SAMPLE] && g_bootMillis[BOOT_FIRST_SAMPLE] <= BOOT_SIM_MAX_FIRST_SAMPLE;
+   ok = ok && ordered && newPoints == expected && firstNew - BOOT_SIM_TIME <= HIST_INT / 1000 && !g_histPendingDropped;
+   ok = checkStaleAccessPoint () && ok;
+   ok = checkChangedNetwork () && ok;
+   printf ("boot: %s\n", ok ? "within bounds" : "OUT OF BOUNDS");
+   return ok ? 0 : 1;
+}
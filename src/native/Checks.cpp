@@ -0,0 +1,457 @@
+// Checks of the firmware building blocks against what they promise, run after the simulated
+// cook. Each prints one line and fails the run when the result is off.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "FakeHal.h"
+#include "../BBQMaster/Sensors.h"
+#include "../BBQMaster/History.h"
+#include "../BBQMaster/HistoryCodec.h"
+#include "../BBQMaster/CookLog.h"
+
+#define CHECK_START_TIME 1700000000
+// Samples fed to the history check, past the 20 hours the 10 minute tier holds
+#define CHECK_TIER_HOURS 24
+// Pages the cook log check writes before the power loss, and the one of them damaged
+#define CHECK_LOG_PAGES 10
+#define CHECK_LOG_BAD_PAGE 4
+// Pages written once the log is back
+#define CHECK_LOG_MORE_PAGES 3
+// Largest error of the NTC table against Steinhart-Hart over the range of valid readings, in F
+#define CHECK_NTC_MAX_ERROR 0.15
+// Time a filter read every SENSOR_READ_INT may take to follow a 50 F step to within 1 F, in ms
+#define CHECK_KALMAN_SETTLE 45000
+#define CHECK_EMA_SETTLE 30000
+// Read interval of a channel the power planner slowed down, in ms
+#define CHECK_SLOW_INTERVAL 24000
+
+static HistoryStore s_tierStore;
+// Records decoded from /history.bin
+static HistRecord s_decoded[HIST_RAW_SIZE + HIST_MIN_SIZE + HIST_TEN_MIN_SIZE];
+
+// Sample at time t of the history check: a sawtooth per channel crossing 0 F, channel 1 unplugged now and then.
+static HistPoint tierPoint (int32_t t)
+{
+   HistPoint point;
+   point.m_time = t;
+   point.m_avail = 0xff;
+   int32_t step = (t - CHECK_START_TIME) / (HIST_INT / 1000);
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      point.m_temp[i] = (int16_t)((step * (i + 1)) % 997 - 300 + i);
+   if ((step / 140) % 3 == 0)
+      point.m_avail &= ~(1 << 1);
+   return point;
+}
+
+// Rolled up record of the samples in [time, time + period), the way the accumulators do it.
+static HistRecord tierBucket (int32_t time, int32_t period, int32_t last)
+{
+   HistRecord record;
+   record.m_time = time;
+   record.m_avail = 0;
+   record.m_period = period;
+   int32_t sum[SENSOR_COUNT] = {};
+   int count[SENSOR_COUNT] = {};
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      record.m_min[i] = INT16_MAX;
+      record.m_max[i] = INT16_MIN;
+   }
+   int32_t interval = HIST_INT / 1000;
+   int32_t first = time > CHECK_START_TIME ? time + (interval - (time - CHECK_START_TIME) % interval) % interval : CHECK_START_TIME;
+   for (int32_t t = first; t < time + period && t <= last; t += interval)
+   {
+      HistPoint point = tierPoint (t);
+      for (int i = 0; i < SENSOR_COUNT; i++)
+      {
+         if (!point.available (i))
+            continue;
+         record.m_avail |= 1 << i;
+         sum[i] += point.m_temp[i];
+         count[i]++;
+         record.m_min[i] = point.m_temp[i] < record.m_min[i] ? point.m_temp[i] : record.m_min[i];
+         record.m_max[i] = point.m_temp[i] > record.m_max[i] ? point.m_temp[i] : record.m_max[i];
+      }
+   }
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      record.m_avg[i] = count[i] ? (int16_t)((sum[i] + (sum[i] >= 0 ? 1 : -1) * (count[i] / 2)) / count[i]) : 0;
+   return record;
+}
+
+static bool sameRecord (const HistRecord& a, const HistRecord& b)
+{
+   if (a.m_time != b.m_time || a.m_avail != b.m_avail || a.m_period != b.m_period)
+      return false;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      if (a.available (i) && (a.m_avg[i] != b.m_avg[i] || a.m_min[i] != b.m_min[i] || a.m_max[i] != b.m_max[i]))
+         return false;
+   }
+   return true;
+}
+
+// A day of samples through the tiers: the view is in time order without holes, goes back as far
+// as the 10 minute tier holds, ends with the raw tier and every rolled up record matches its samples.
+static bool checkHistoryTiers ()
+{
+   int32_t last = CHECK_START_TIME;
+   for (int32_t t = CHECK_START_TIME; t < CHECK_START_TIME + CHECK_TIER_HOURS * 3600; t += HIST_INT / 1000)
+   {
+      s_tierStore.add (tierPoint (t));
+      last = t;
+   }
+
+   HistoryStore::View hist (s_tierStore);
+   size_t counts[3] = {};
+   size_t wrong = 0;
+   bool ordered = true;
+   for (size_t i = 0; i < hist.size (); i++)
+   {
+      HistRecord record = hist[i];
+      counts[record.m_period == HIST_TEN_MIN_PERIOD ? 0 : record.m_period == HIST_MIN_PERIOD ? 1 : 2]++;
+      HistRecord expected = record.m_period ? tierBucket (record.m_time, record.m_period, last) : toRecord (tierPoint (record.m_time));
+      if (!sameRecord (record, expected))
+         wrong++;
+      if (i)
+      {
+         HistRecord previous = hist[i - 1];
+         int32_t span = previous.m_period ? previous.m_period : HIST_INT / 1000;
+         if (record.m_time <= previous.m_time || record.m_time - previous.m_time > span || record.m_period > previous.m_period)
+            ordered = false;
+      }
+   }
+   int32_t oldest = last - last % HIST_TEN_MIN_PERIOD - HIST_TEN_MIN_SIZE * HIST_TEN_MIN_PERIOD;
+   bool covered = hist.size () && hist.time (0) == oldest && hist.time (hist.size () - 1) == last;
+   bool ok = ordered && covered && !wrong && counts[0] && counts[1] && counts[2] == HIST_RAW_SIZE;
+   printf ("check history tiers: %u + %u + %u records, %s, %s, %u wrong: %s\n", (unsigned)counts[0], (unsigned)counts[1], (unsigned)counts[2],
+           ordered ? "in order" : "OUT OF ORDER", covered ? "covering the tiers" : "NOT COVERING THE TIERS", (unsigned)wrong, ok ? "ok" : "FAILED");
+   return ok;
+}
+
+// Reads /history.bin the way the page does, see HistoryCodec.h for the layout.
+class BinReader
+{
+public:
+   BinReader (const uint8_t* data, size_t len) : m_data (data), m_len (len), m_pos (0), m_overrun (false) {}
+
+   uint8_t byte ()
+   {
+      if (m_pos < m_len)
+         return m_data[m_pos++];
+      m_overrun = true;
+      return 0;
+   }
+   uint32_t varint ()
+   {
+      uint32_t value = 0;
+      for (int shift = 0; shift < 35; shift += 7)
+      {
+         uint8_t b = byte ();
+         value |= (uint32_t)(b & 0x7f) << shift;
+         if (!(b & 0x80))
+            break;
+      }
+      return value;
+   }
+   int32_t svarint ()
+   {
+      uint32_t value = varint ();
+      return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+   }
+   // Whole input read, nothing past it
+   bool done () const { return !m_overrun && m_pos == m_len; }
+
+private:
+   const uint8_t* m_data;
+   size_t m_len;
+   size_t m_pos;
+   bool m_overrun;
+};
+
+// Decode into s_decoded. Returns the record count, or -1 when the header is not the one expected.
+static int decodeHistoryBin (const uint8_t* data, size_t len, bool& complete)
+{
+   BinReader in (data, len);
+   if (in.byte () != 'B' || in.byte () != 'B' || in.byte () != 'Q' || in.byte () != 'H' || in.byte () != HIST_BIN_VERSION || in.byte () != SENSOR_COUNT)
+      return -1;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      size_t nameLen = in.byte ();
+      if (nameLen != strlen (g_channelNames[i]))
+         return -1;
+      for (size_t c = 0; c < nameLen; c++)
+         if (in.byte () != (uint8_t)g_channelNames[i][c])
+            return -1;
+   }
+   uint32_t count = in.varint ();
+   if (count > sizeof (s_decoded) / sizeof (s_decoded[0]))
+      return -1;
+   int32_t time = in.svarint ();
+   for (uint32_t p = 0; p < count; p++)
+   {
+      time += in.svarint ();
+      s_decoded[p].m_time = time;
+   }
+   for (uint32_t p = 0; p < count; p++)
+      s_decoded[p].m_period = in.varint ();
+   for (uint32_t p = 0; p < count; p++)
+      s_decoded[p].m_avail = in.byte ();
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      int32_t value = 0;
+      for (uint32_t p = 0; p < count; p++)
+      {
+         if (!s_decoded[p].available (i))
+            continue;
+         value += in.svarint ();
+         s_decoded[p].m_avg[i] = s_decoded[p].m_min[i] = s_decoded[p].m_max[i] = (int16_t)value;
+      }
+   }
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      for (uint32_t p = 0; p < count; p++)
+      {
+         if (!s_decoded[p].m_period || !s_decoded[p].available (i))
+            continue;
+         s_decoded[p].m_min[i] = (int16_t)(s_decoded[p].m_avg[i] - (int32_t)in.varint ());
+         s_decoded[p].m_max[i] = (int16_t)(s_decoded[p].m_avg[i] + (int32_t)in.varint ());
+      }
+   }
+   complete = in.done ();
+   return (int)count;
+}
+
+// /history.bin of the history check decodes back to the records of the view, whole and
+// since a time in the middle, and the encoder never writes past the room it is given.
+static bool checkHistoryBin ()
+{
+   static uint8_t bin[16384];
+   HistoryStore::View hist (s_tierStore);
+   int32_t sinces[] = {INT32_MIN, hist.time (hist.size () / 2), hist.time (hist.size () - 1)};
+   bool ok = true;
+   size_t fullLen = 0;
+   for (size_t s = 0; s < sizeof (sinces) / sizeof (sinces[0]); s++)
+   {
+      size_t len = encodeHistoryBin (hist, sinces[s], nullptr, 0);
+      if (len > sizeof (bin))
+      {
+         ok = false;
+         continue;
+      }
+      memset (bin, 0xa5, sizeof (bin));
+      bool bounded = encodeHistoryBin (hist, sinces[s], bin, len / 2) == len && bin[len / 2] == 0xa5;
+      encodeHistoryBin (hist, sinces[s], bin, len);
+      if (!s)
+         fullLen = len;
+
+      bool complete = false;
+      int count = decodeHistoryBin (bin, len, complete);
+      size_t first = hist.upperBound (sinces[s]);
+      bool same = count == (int)(hist.size () - first) && complete;
+      for (int p = 0; same && p < count; p++)
+         same = sameRecord (hist[first + p], s_decoded[p]);
+      ok = ok && bounded && same;
+   }
+   printf ("check history.bin: %u records in %u bytes, decoded whole and from the middle: %s\n", (unsigned)hist.size (), (unsigned)fullLen, ok ? "ok" : "FAILED");
+   return ok;
+}
+
+// Points the cook log replayed
+static HistPoint s_replayed[(CHECK_LOG_PAGES + CHECK_LOG_MORE_PAGES) * COOK_LOG_PAGE_RECORDS];
+static size_t s_replayCount;
+
+static void collectPoint (const HistPoint& point)
+{
+   if (s_replayCount < sizeof (s_replayed) / sizeof (s_replayed[0]))
+      s_replayed[s_replayCount] = point;
+   s_replayCount++;
+}
+
+// Whether the log replays exactly the points of the pages listed, in order.
+static bool replaysPages (FileSystem& fs, const int* pages, size_t pageCount)
+{
+   CookLog log (fs);
+   log.begin ();
+   s_replayCount = 0;
+   log.replay (collectPoint);
+   if (s_replayCount != pageCount * COOK_LOG_PAGE_RECORDS)
+      return false;
+   for (size_t p = 0; p < pageCount; p++)
+   {
+      for (int r = 0; r < COOK_LOG_PAGE_RECORDS; r++)
+      {
+         HistPoint expected = tierPoint (CHECK_START_TIME + (pages[p] * COOK_LOG_PAGE_RECORDS + r) * HIST_INT / 1000);
+         if (!sameRecord (toRecord (s_replayed[p * COOK_LOG_PAGE_RECORDS + r]), toRecord (expected)))
+            return false;
+      }
+   }
+   return true;
+}
+
+// Power lost in the middle of a page write, and a page gone bad on flash: the log replays
+// every other page in order, then carries on with the cook after the damage.
+static bool checkCookLogRecovery ()
+{
+   MemoryFileSystem fs;
+   CookLog log (fs);
+   log.begin ();
+   for (int i = 0; i < (CHECK_LOG_PAGES + 1) * COOK_LOG_PAGE_RECORDS; i++)
+      log.append (tierPoint (CHECK_START_TIME + i * HIST_INT / 1000));
+
+   // Half of the last page reached flash, and a bit flipped in a record of an earlier one.
+   const char* path = "/cook0.log";
+   std::vector<uint8_t> data (fs.size (path));
+   fs.read (path, 0, data.data (), data.size ());
+   data.resize (data.size () - COOK_LOG_PAGE_SIZE / 2);
+   data[COOK_LOG_SEGMENT_HEADER + CHECK_LOG_BAD_PAGE * COOK_LOG_PAGE_SIZE + COOK_LOG_PAGE_HEADER + 7] ^= 0x10;
+   fs.write (path, data.data (), data.size ());
+
+   int pages[CHECK_LOG_PAGES + CHECK_LOG_MORE_PAGES];
+   size_t pageCount = 0;
+   for (int p = 0; p < CHECK_LOG_PAGES; p++)
+      if (p != CHECK_LOG_BAD_PAGE)
+         pages[pageCount++] = p;
+   bool recovered = replaysPages (fs, pages, pageCount);
+
+   // Back up after the reboot, the cook goes on.
+   CookLog restored (fs);
+   restored.begin ();
+   restored.replay (collectPoint);
+   for (int p = CHECK_LOG_PAGES + 1; p <= CHECK_LOG_PAGES + CHECK_LOG_MORE_PAGES; p++)
+   {
+      for (int r = 0; r < COOK_LOG_PAGE_RECORDS; r++)
+         restored.append (tierPoint (CHECK_START_TIME + (p * COOK_LOG_PAGE_RECORDS + r) * HIST_INT / 1000));
+      pages[pageCount++] = p;
+   }
+   bool continued = replaysPages (fs, pages, pageCount);
+
+   bool ok = recovered && continued;
+   printf ("check cook log: %s past a torn and a damaged page, %s after the reboot: %s\n", recovered ? "the other pages replayed" : "REPLAY WRONG",
+           continued ? "new pages replayed" : "NEW PAGES LOST", ok ? "ok" : "FAILED");
+   return ok;
+}
+
+// Largest error of a table against the exact formula over the ADC values of valid temperatures.
+// Values outside the probe range have to read as invalid.
+static double ntcTableError (const NtcCalibration& cal, const NtcTable& table, bool& invalidOk)
+{
+   double worst = 0;
+   for (int32_t adc = 1; adc < NTC_MAX_ADC; adc++)
+   {
+      double exact = ntcExactTempF (cal, adc);
+      if (isValidTemp (exact))
+         worst = fmax (worst, fabs (table.toTenthsF (adc) / 10.0 - exact));
+   }
+   invalidOk = table.toTenthsF (0) == NTC_INVALID_TENTHS && table.toTenthsF (NTC_MAX_ADC) == NTC_INVALID_TENTHS && !isValidTemp (table.toTenthsF (-1) / 10.0f);
+   return worst;
+}
+
+// The NTC tables stay within CHECK_NTC_MAX_ERROR of Steinhart-Hart, for the default B model of
+// the probes and for a calibration with a C term.
+static bool checkNtcTables ()
+{
+   static NtcTable table;
+   NtcCalibration calibrations[2] = {ntcCalibrationFromBeta (NTC_BCOEFFICIENT, NTC_SMP_TMP, NTC_SMP_RES), {6.6853e-4, 2.2041e-4, 1.0365e-7}};
+   double worst = 0;
+   bool invalidOk = true;
+   for (int c = 0; c < 2; c++)
+   {
+      bool invalid;
+      table.build (calibrations[c]);
+      worst = fmax (worst, ntcTableError (calibrations[c], table, invalid));
+      invalidOk = invalidOk && invalid;
+   }
+   bool ok = worst <= CHECK_NTC_MAX_ERROR && invalidOk;
+   printf ("check ntc tables: %.3f F max error against Steinhart-Hart, out of range readings %s: %s\n", worst, invalidOk ? "invalid" : "NOT INVALID", ok ? "ok" : "FAILED");
+   return ok;
+}
+
+// How a filter follows 150 F then a step to 200 F, with readings interval ms apart.
+struct StepResponse
+{
+   // Time and readings from the step until the output stays within 1 F of 200 F
+   uint32_t m_settleMillis;
+   int m_settleReadings;
+   float m_overshoot;
+   bool m_monotonic;
+};
+
+static StepResponse stepResponse (const FilterConfig& config, uint32_t interval)
+{
+   ChannelFilter filter;
+   filter.configure (config);
+   uint32_t now = 0;
+   float last = 0;
+   for (int i = 0; i < 20; i++, now += interval)
+      last = filter.update (150.0f, now);
+
+   StepResponse response = {0, 0, 0.0f, true};
+   bool settled = false;
+   for (int i = 1; i <= 400; i++, now += interval)
+   {
+      float value = filter.update (200.0f, now);
+      response.m_monotonic = response.m_monotonic && value >= last;
+      response.m_overshoot = fmaxf (response.m_overshoot, value - 200.0f);
+      last = value;
+      bool within = fabsf (value - 200.0f) <= 1.0f;
+      if (within && !settled)
+      {
+         response.m_settleMillis = i * interval;
+         response.m_settleReadings = i;
+      }
+      settled = within;
+   }
+   return response;
+}
+
+// Largest move of the output of a filter fed 150 F with a single 250 F spike.
+static float spikeResponse (const FilterConfig& config)
+{
+   ChannelFilter filter;
+   filter.configure (config);
+   float worst = 0;
+   for (int i = 0; i < 40; i++)
+      worst = fmaxf (worst, fabsf (filter.update (i == 20 ? 250.0f : 150.0f, i * SENSOR_READ_INT) - 150.0f));
+   return worst;
+}
+
+// The default median and Kalman filter, and median and EMA, reject a single spike and follow a
+// step without overshoot in bounded time. A channel read every CHECK_SLOW_INTERVAL is not held
+// back by the weights being given per SENSOR_READ_INT.
+static bool checkFilters ()
+{
+   FilterConfig kalman = defaultFilterConfig ();
+   FilterConfig ema = kalman;
+   ema.m_mode = FILTER_EMA;
+
+   StepResponse kalmanStep = stepResponse (kalman, SENSOR_READ_INT);
+   StepResponse emaStep = stepResponse (ema, SENSOR_READ_INT);
+   StepResponse kalmanSlow = stepResponse (kalman, CHECK_SLOW_INTERVAL);
+   StepResponse emaSlow = stepResponse (ema, CHECK_SLOW_INTERVAL);
+   float spike = fmaxf (spikeResponse (kalman), spikeResponse (ema));
+
+   bool ok = spike <= 0.5f;
+   ok = ok && kalmanStep.m_settleMillis <= CHECK_KALMAN_SETTLE && emaStep.m_settleMillis <= CHECK_EMA_SETTLE;
+   ok = ok && kalmanStep.m_monotonic && emaStep.m_monotonic && kalmanSlow.m_monotonic && emaSlow.m_monotonic;
+   ok = ok && fmaxf (fmaxf (kalmanStep.m_overshoot, emaStep.m_overshoot), fmaxf (kalmanSlow.m_overshoot, emaSlow.m_overshoot)) <= 0.0f;
+   // The median holds a step back by one reading, the EMA time constant stays the same.
+   ok = ok && emaSlow.m_settleMillis <= emaStep.m_settleMillis + 2 * CHECK_SLOW_INTERVAL;
+   ok = ok && kalmanSlow.m_settleReadings < kalmanStep.m_settleReadings;
+   printf ("check filters: spike moves the output %.2f F, 50 F step settled in %.1f s (kalman) %.1f s (ema), read every %d s in %.1f s (kalman) %.1f s (ema): %s\n", spike,
+           kalmanStep.m_settleMillis / 1000.0f, emaStep.m_settleMillis / 1000.0f, CHECK_SLOW_INTERVAL / 1000, kalmanSlow.m_settleMillis / 1000.0f, emaSlow.m_settleMillis / 1000.0f,
+           ok ? "ok" : "FAILED");
+   return ok;
+}
+
+bool runChecks ()
+{
+   bool ok = checkHistoryTiers ();
+   // Encodes the history the tier check left behind.
+   ok = checkHistoryBin () && ok;
+   ok = checkCookLogRecovery () && ok;
+   ok = checkNtcTables () && ok;
+   ok = checkFilters () && ok;
+   return ok;
+}
@@ -0,0 +1,323 @@
+#ifndef FAKE_HAL_H
+#define FAKE_HAL_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../BBQMaster/Hal.h"
+#include "../BBQMaster/Ntc.h"
+#include "Heap.h"
+
+// Probe temperature in F at a time in ms, NAN when the probe is unplugged.
+typedef float (*TempCurve) (int channel, uint32_t millis);
+
+// Manually advanced time base
+class FakeClock : public Clock
+{
+public:
+   FakeClock () : m_micros (0) {}
+
+   // Both wrap around like on the board, micros after about 71 minutes.
+   uint32_t millis () override { return m_micros / 1000; }
+   uint32_t micros () override { return (uint32_t)m_micros; }
+   void advance (uint32_t ms) { m_micros += ms * 1000ULL; }
+
+private:
+   uint64_t m_micros;
+};
+
+// NTC probes following a temperature curve. Temperatures are turned back into the ADC
+// counts the probe divider would produce, so the lookup tables and filters run as on the board.
+class ScriptedAdc : public ProbeAdc
+{
+public:
+   ScriptedAdc (Clock& clock, TempCurve curve, const NtcCalibration& cal) : m_clock (clock), m_curve (curve), m_cal (cal), m_busy (false), m_mask (0), m_conversions (0)
+   {
+      for (int i = 0; i < NTC_CHANNELS; i++)
+         m_values[i] = 0;
+   }
+
+   void begin () override {}
+   void setOversampling (uint8_t) override {}
+   void startSweep (uint8_t mask) override
+   {
+      m_busy = true;
+      m_mask = mask;
+   }
+   bool tick () override
+   {
+      if (!m_busy)
+         return false;
+      for (int i = 0; i < NTC_CHANNELS; i++)
+      {
+         if (m_mask & (1 << i))
+         {
+            m_values[i] = toAdc (m_curve (i, m_clock.millis ()));
+            m_conversions++;
+         }
+      }
+      m_busy = false;
+      return true;
+   }
+   int16_t value (int channel) const override { return m_values[channel]; }
+   // Channel conversions done so far
+   unsigned long conversions () const { return m_conversions; }
+
+private:
+   // The temperature falls as the reading rises, find the reading by bisection.
+   int16_t toAdc (float tempF) const
+   {
+      if (isnan (tempF))
+         return INT16_MAX;
+      int low = 1;
+      int high = NTC_MAX_ADC - 1;
+      while (low < high)
+      {
+         int mid = (low + high) / 2;
+         if (ntcExactTempF (m_cal, mid) > tempF)
+            low = mid + 1;
+         else
+            high = mid;
+      }
+      return low;
+   }
+
+   Clock& m_clock;
+   TempCurve m_curve;
+   NtcCalibration m_cal;
+   bool m_busy;
+   uint8_t m_mask;
+   unsigned long m_conversions;
+   int16_t m_values[NTC_CHANNELS];
+};
+
+// Thermocouples following a temperature curve, on channels NTC_CHANNELS and up of the curve.
+class ScriptedThermocouples : public ThermocoupleBus
+{
+public:
+   ScriptedThermocouples (Clock& clock, TempCurve curve) : m_clock (clock), m_curve (curve), m_requests (0), m_reads (0) {}
+
+   void begin () override {}
+   void requestTemperatures () override { m_requests++; }
+   float tempF (int channel) override
+   {
+      m_reads++;
+      float temp = m_curve (NTC_CHANNELS + channel, m_clock.millis ());
+      // DEVICE_DISCONNECTED_F of the Dallas library
+      return isnan (temp) ? -196.6f : temp;
+   }
+   unsigned long requests () const { return m_requests; }
+   unsigned long reads () const { return m_reads; }
+
+private:
+   Clock& m_clock;
+   TempCurve m_curve;
+   unsigned long m_requests;
+   unsigned long m_reads;
+};
+
+// Battery at a set voltage
+class FakeBattery : public BatteryMonitor
+{
+public:
+   explicit FakeBattery (float voltage) : m_voltage (voltage) {}
+   float voltage () override { return m_voltage; }
+   void setVoltage (float voltage) { m_voltage = voltage; }
+
+private:
+   float m_voltage;
+};
+
+// Access point the station can join. Going straight to its BSSID and channel takes fastMs,
+// a scan of every channel scanMs, and a stale BSSID or channel never answers.
+class FakeWifi : public WifiLink
+{
+public:
+   FakeWifi (Clock& clock, const uint8_t* bssid, uint8_t channel, uint32_t fastMs, uint32_t scanMs)
+      : m_clock (clock), m_channel (channel), m_fastMs (fastMs), m_scanMs (scanMs), m_joining (false), m_joinMs (0), m_start (0), m_joins (0)
+   {
+      memcpy (m_bssid, bssid, sizeof (m_bssid));
+   }
+
+   bool hasCredentials () override { return true; }
+   void begin (const uint8_t* bssid, uint8_t channel) override
+   {
+      m_joins++;
+      m_joining = !bssid || (channel == m_channel && memcmp (bssid, m_bssid, sizeof (m_bssid)) == 0);
+      m_joinMs = bssid ? m_fastMs : m_scanMs;
+      m_start = m_clock.millis ();
+   }
+   bool connected () override { return m_joining && m_clock.millis () - m_start >= m_joinMs; }
+   void accessPoint (uint8_t* bssid, uint8_t& channel) override
+   {
+      memcpy (bssid, m_bssid, sizeof (m_bssid));
+      channel = m_channel;
+   }
+
+   unsigned long joins () const { return m_joins; }
+
+private:
+   Clock& m_clock;
+   uint8_t m_bssid[6];
+   uint8_t m_channel;
+   uint32_t m_fastMs;
+   uint32_t m_scanMs;
+   bool m_joining;
+   uint32_t m_joinMs;
+   uint32_t m_start;
+   unsigned long m_joins;
+};
+
+// Blower keeping the last duty it was given
+class FakeFan : public FanOutput
+{
+public:
+   FakeFan () : m_duty (0) {}
+
+   void begin () override {}
+   void setDuty (float duty) override { m_duty = duty; }
+   float duty () const { return m_duty; }
+
+private:
+   float m_duty;
+};
+
+// File system kept in memory
+class MemoryFileSystem : public FileSystem
+{
+public:
+   bool exists (const char* path) override { return m_files.count (path) != 0; }
+   bool remove (const char* path) override { return m_files.erase (path) != 0; }
+   size_t size (const char* path) override { return exists (path) ? m_files[path].size () : 0; }
+   size_t read (const char* path, size_t offset, uint8_t* buf, size_t len) override
+   {
+      if (!exists (path))
+         return 0;
+      const std::vector<uint8_t>& file = m_files[path];
+      if (offset >= file.size ())
+         return 0;
+      if (len > file.size () - offset)
+         len = file.size () - offset;
+      memcpy (buf, file.data () + offset, len);
+      return len;
+   }
+   size_t append (const char* path, const uint8_t* buf, size_t len) override
+   {
+      UntrackedHeap untracked;
+      m_files[path].insert (m_files[path].end (), buf, buf + len);
+      return len;
+   }
+   size_t write (const char* path, const uint8_t* buf, size_t len) override
+   {
+      UntrackedHeap untracked;
+      m_files[path].assign (buf, buf + len);
+      return len;
+   }
+
+private:
+   std::map<std::string, std::vector<uint8_t> > m_files;
+};
+
+// Broker that records what is published. It can be made unreachable to simulate an outage.
+class RecordingMqtt : public MqttTransport
+{
+public:
+   RecordingMqtt () : m_reachable (true), m_connected (false), m_pendingPolls (0), m_status (CONNECT_FAILED), m_attempts (0), m_published (0), m_bytes (0), m_states (0), m_backlog (0), m_lastStateTime (0), m_maxStateGap (0), m_outOfOrder (0) {}
+
+   bool connected () override { return m_connected; }
+   // Attempts take a few polls, like DNS and TCP on the board.
+   bool startConnect (const char*, const char*, const char*) override
+   {
+      if (m_status == CONNECT_PENDING)
+         return false;
+      m_attempts++;
+      m_pendingPolls = 3;
+      m_status = CONNECT_PENDING;
+      return true;
+   }
+   ConnectStatus pollConnect () override
+   {
+      if (m_status == CONNECT_PENDING && --m_pendingPolls == 0)
+      {
+         m_connected = m_reachable;
+         m_status = m_connected ? CONNECT_DONE : CONNECT_FAILED;
+      }
+      return m_status;
+   }
+   bool publish (const char* topic, const char* payload, bool) override
+   {
+      if (!m_connected)
+         return false;
+      UntrackedHeap untracked;
+      m_published++;
+      m_bytes += strlen (topic) + strlen (payload);
+      m_lastTopic = topic;
+      m_lastPayload = payload;
+
+      // States, live or replayed, must arrive in time order without holes.
+      bool backlog = endsWith (topic, "/backlog");
+      if (backlog || endsWith (topic, "/state"))
+      {
+         if (backlog)
+            m_backlog++;
+         else
+            m_states++;
+         const char* t = strstr (payload, "\"t\":");
+         long time = t ? atol (t + 4) : 0;
+         if (m_lastStateTime && time <= m_lastStateTime)
+            m_outOfOrder++;
+         else if (m_lastStateTime && time - m_lastStateTime > m_maxStateGap)
+            m_maxStateGap = time - m_lastStateTime;
+         m_lastStateTime = time;
+      }
+      return true;
+   }
+   void loop () override {}
+   int state () override { return m_connected ? 0 : -1; }
+
+   // Drop the connection and refuse new ones until reachable again.
+   void setReachable (bool reachable)
+   {
+      m_reachable = reachable;
+      if (!reachable)
+         m_connected = false;
+   }
+   unsigned long attempts () const { return m_attempts; }
+   unsigned long published () const { return m_published; }
+   unsigned long bytes () const { return m_bytes; }
+   unsigned long states () const { return m_states; }
+   unsigned long backlog () const { return m_backlog; }
+   long maxStateGap () const { return m_maxStateGap; }
+   unsigned long outOfOrder () const { return m_outOfOrder; }
+   const std::string& lastTopic () const { return m_lastTopic; }
+   const std::string& lastPayload () const { return m_lastPayload; }
+
+private:
+   static bool endsWith (const char* text, const char* suffix)
+   {
+      size_t len = strlen (text);
+      size_t suffixLen = strlen (suffix);
+      return len >= suffixLen && strcmp (text + len - suffixLen, suffix) == 0;
+   }
+
+   bool m_reachable;
+   bool m_connected;
+   int m_pendingPolls;
+   ConnectStatus m_status;
+   unsigned long m_attempts;
+   unsigned long m_published;
+   unsigned long m_bytes;
+   unsigned long m_states;
+   unsigned long m_backlog;
+   long m_lastStateTime;
+   long m_maxStateGap;
+   unsigned long m_outOfOrder;
+   std::string m_lastTopic;
+   std::string m_lastPayload;
+};
+
+#endif
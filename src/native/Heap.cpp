@@ -0,0 +1,125 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+#include "Heap.h"
+
+// Room kept in front of every block for its size and whether it is counted, keeps the alignment of malloc.
+#define HEAP_HEADER 16
+
+struct BlockHeader
+{
+   size_t m_size;
+   bool m_tracked;
+};
+
+static thread_local bool t_tracked = false;
+static std::atomic<unsigned long> s_count (0);
+static std::atomic<size_t> s_live (0);
+static std::atomic<size_t> s_peak (0);
+static std::atomic<size_t> s_largest (0);
+
+static void raise (std::atomic<size_t>& value, size_t to)
+{
+   size_t current = value.load ();
+   while (current < to && !value.compare_exchange_weak (current, to))
+      ;
+}
+
+static void* allocate (size_t size)
+{
+   uint8_t* block = (uint8_t*)malloc (size + HEAP_HEADER);
+   if (!block)
+      return nullptr;
+   BlockHeader header = {size, t_tracked};
+   memcpy (block, &header, sizeof (header));
+   if (t_tracked)
+   {
+      s_count++;
+      raise (s_peak, s_live.fetch_add (size) + size);
+      raise (s_largest, size);
+   }
+   return block + HEAP_HEADER;
+}
+
+static void release (void* ptr)
+{
+   if (!ptr)
+      return;
+   uint8_t* block = (uint8_t*)ptr - HEAP_HEADER;
+   BlockHeader header;
+   memcpy (&header, block, sizeof (header));
+   if (header.m_tracked)
+      s_live.fetch_sub (header.m_size);
+   free (block);
+}
+
+void* operator new (size_t size)
+{
+   void* ptr = allocate (size);
+   // Out of memory is fatal for the simulation anyway.
+   if (!ptr)
+      abort ();
+   return ptr;
+}
+
+void* operator new[] (size_t size)
+{
+   return operator new (size);
+}
+
+void* operator new (size_t size, const std::nothrow_t&) noexcept
+{
+   return allocate (size);
+}
+
+void* operator new[] (size_t size, const std::nothrow_t&) noexcept
+{
+   return allocate (size);
+}
+
+void operator delete (void* ptr) noexcept
+{
+   release (ptr);
+}
+
+void operator delete[] (void* ptr) noexcept
+{
+   release (ptr);
+}
+
+void operator delete (void* ptr, size_t) noexcept
+{
+   release (ptr);
+}
+
+void operator delete[] (void* ptr, size_t) noexcept
+{
+   release (ptr);
+}
+
+void trackThreadHeap ()
+{
+   t_tracked = true;
+}
+
+UntrackedHeap::UntrackedHeap () : m_tracked (t_tracked)
+{
+   t_tracked = false;
+}
+
+UntrackedHeap::~UntrackedHeap ()
+{
+   t_tracked = m_tracked;
+}
+
+HeapUse heapUse ()
+{
+   HeapUse stats;
+   stats.m_count = s_count.load ();
+   stats.m_live = s_live.load ();
+   stats.m_peak = s_peak.load ();
+   stats.m_largest = s_largest.load ();
+   return stats;
+}
@@ -0,0 +1,32 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stddef.h>
+
+// Heap use of the threads standing in for a firmware task. operator new/delete are replaced
+// for the whole host program, only the blocks allocated by a tracked thread are counted,
+// wherever they are freed.
+struct HeapUse
+{
+   unsigned long m_count;
+   size_t m_live;
+   size_t m_peak;
+   size_t m_largest;
+};
+
+// Count the allocations of the calling thread from now on.
+void trackThreadHeap ();
+HeapUse heapUse ();
+
+// Allocations of the fakes standing in for the SDK, not counted while one of these is in scope.
+class UntrackedHeap
+{
+public:
+   UntrackedHeap ();
+   ~UntrackedHeap ();
+
+private:
+   bool m_tracked;
+};
+
+#endif
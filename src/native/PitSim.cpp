@@ -0,0 +1,160 @@
+// Closed loop run of the pit control against the smoker model: cold start to 225 F, the
+// lid opened for a minute after 2 hours and the setpoint raised to 275 F after 3 hours.
+// The blower duty goes through the real sensor task, filters and PID, the pit probe reads
+// the model back. Prints the control figures and fails when they are out of bounds.
+//
+//    .pio/build/native/program [hours] pid
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "FakeHal.h"
+#include "Smoker.h"
+#include "../BBQMaster/Sensors.h"
+#include "../BBQMaster/Network.h"
+#include "../BBQMaster/PitController.h"
+
+// Scenario, in seconds
+#define PIT_SIM_LID_AT 7200
+#define PIT_SIM_LID_FOR 60
+#define PIT_SIM_STEP_AT 10800
+#define PIT_SIM_SETPOINT 225.0f
+#define PIT_SIM_STEP_SETPOINT 275.0f
+// The pit is settled once it stays within this many F of the setpoint.
+#define PIT_SIM_BAND 5.0f
+
+// Bounds of the regression check
+#define PIT_SIM_MAX_OVERSHOOT 15.0f
+#define PIT_SIM_MAX_SETTLE 3600
+#define PIT_SIM_MAX_RMS 3.0f
+#define PIT_SIM_MAX_LID_RECOVERY 900
+
+static SmokerModel s_smoker;
+
+// Pit on TC1, every other probe unplugged.
+static float pitCurve (int channel, uint32_t)
+{
+   return channel == NTC_CHANNELS ? s_smoker.pitTempF () + 0.5f * (2.0f * rand () / RAND_MAX - 1.0f) : NAN;
+}
+
+// Response to a setpoint change or a disturbance starting at m_start.
+struct StepResponse
+{
+   uint32_t m_start;
+   float m_setpoint;
+   float m_peak;
+   // Last time outside the band, so the settling time once the run is over
+   uint32_t m_lastOut;
+
+   StepResponse () { begin (0, 0); }
+   void begin (uint32_t now, float setpoint)
+   {
+      m_start = now;
+      m_setpoint = setpoint;
+      m_peak = -INFINITY;
+      m_lastOut = now;
+   }
+   void sample (uint32_t now, float temp)
+   {
+      m_peak = fmaxf (m_peak, temp);
+      if (fabsf (temp - m_setpoint) > PIT_SIM_BAND)
+         m_lastOut = now;
+   }
+   float overshoot () const { return fmaxf (0.0f, m_peak - m_setpoint); }
+   uint32_t settling () const { return m_lastOut - m_start; }
+};
+
+int runPitSimulation (float hours)
+{
+   srand (1);
+
+   FakeClock clock;
+   ScriptedAdc adc (clock, pitCurve, ntcCalibrationFromBeta (NTC_BCOEFFICIENT, NTC_SMP_TMP, NTC_SMP_RES));
+   ScriptedThermocouples thermocouples (clock, pitCurve);
+   FakeBattery battery (3.9f);
+   FakeFan fan;
+
+   g_clock = &clock;
+   g_probeAdc = &adc;
+   g_thermoCouples = &thermocouples;
+   g_battery = &battery;
+   g_fan = &fan;
+
+   defaultNtcCalibration ();
+   defaultFilterConfigs ();
+   buildNtcTables ();
+   applyFilterConfigs ();
+
+   g_pitController.configure (defaultPidConfig ());
+   g_pitController.setSetpoint (PIT_SIM_SETPOINT);
+   g_pitController.setEnabled (true);
+
+   StepResponse start;
+   StepResponse lid;
+   StepResponse step;
+   start.begin (0, PIT_SIM_SETPOINT);
+   double squaredError = 0;
+   unsigned long errorSamples = 0;
+   float dutySum = 0;
+   unsigned long dutySamples = 0;
+
+   uint32_t totalTicks = hours * 3600000.0f / SENSOR_TASK_PERIOD;
+   DataPoint reading;
+   for (uint32_t ticks = 0; ticks < totalTicks; ticks++)
+   {
+      clock.advance (SENSOR_TASK_PERIOD);
+      s_smoker.step (fan.duty (), SENSOR_TASK_PERIOD / 1000.0f);
+      sensorTick (ticks, reading);
+      takeReadings ();
+
+      uint32_t ms = clock.millis ();
+      if (ms % 1000 != 0)
+         continue;
+      uint32_t now = ms / 1000;
+      float temp = s_smoker.pitTempF ();
+      if (now == PIT_SIM_LID_AT)
+      {
+         s_smoker.openLid (PIT_SIM_LID_FOR);
+         lid.begin (now, PIT_SIM_SETPOINT);
+      }
+      if (now == PIT_SIM_STEP_AT)
+      {
+         g_pitController.setSetpoint (PIT_SIM_STEP_SETPOINT);
+         step.begin (now, PIT_SIM_STEP_SETPOINT);
+      }
+
+      if (now < PIT_SIM_LID_AT)
+      {
+         start.sample (now, temp);
+         // Steady state error over the hour before the lid opens
+         if (now >= PIT_SIM_LID_AT - 3600)
+         {
+            squaredError += (temp - PIT_SIM_SETPOINT) * (temp - PIT_SIM_SETPOINT);
+            errorSamples++;
+            dutySum += fan.duty ();
+            dutySamples++;
+         }
+      }
+      else if (now < PIT_SIM_STEP_AT)
+         lid.sample (now, temp);
+      else
+         step.sample (now, temp);
+
+      if (now % 900 == 0)
+         printf ("pid at %.2f h: pit %.1f F, setpoint %.0f F, fan %.0f%%%s\n", now / 3600.0f, temp, g_pitController.setpoint (), fan.duty () * 100, g_pitController.lidOpen () ? ", lid open" : "");
+   }
+
+   float rms = errorSamples ? sqrt (squaredError / errorSamples) : 0;
+   printf ("pid start: %.1f F overshoot, settled in %u s, %.2f F rms error, %.0f%% mean duty\n", start.overshoot (), (unsigned)start.settling (), rms,
+           dutySamples ? dutySum / dutySamples * 100 : 0.0f);
+   printf ("pid lid: %u openings detected, recovered in %u s, %.1f F overshoot\n", (unsigned)g_pitController.lidOpenings (), (unsigned)lid.settling (), lid.overshoot ());
+   printf ("pid step: %.1f F overshoot, settled in %u s\n", step.overshoot (), (unsigned)step.settling ());
+
+   bool ok = start.overshoot () <= PIT_SIM_MAX_OVERSHOOT && start.settling () <= PIT_SIM_MAX_SETTLE && rms <= PIT_SIM_MAX_RMS;
+   if (hours * 3600 >= PIT_SIM_STEP_AT)
+      ok = ok && g_pitController.lidOpenings () == 1 && lid.settling () <= PIT_SIM_MAX_LID_RECOVERY && lid.overshoot () <= PIT_SIM_MAX_OVERSHOOT;
+   if (hours * 3600 >= PIT_SIM_STEP_AT + PIT_SIM_MAX_SETTLE)
+      ok = ok && step.overshoot () <= PIT_SIM_MAX_OVERSHOOT && step.settling () <= PIT_SIM_MAX_SETTLE;
+   printf ("pid: %s\n", ok ? "within bounds" : "OUT OF BOUNDS");
+   return ok ? 0 : 1;
+}
@@ -0,0 +1,303 @@
+// Energy estimate of a cook in each power mode. The sensor task, sampling plan, history and
+// MQTT publisher run as on the board; the time the CPU spends awake and the radio traffic
+// are turned into an average current with the typical figures below. The cook is either
+// the simulated one or a cook.log downloaded from the board, replayed at its own pace.
+//
+//    .pio/build/native/program [hours] power [cook.log]
+
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "FakeHal.h"
+#include "../BBQMaster/Sensors.h"
+#include "../BBQMaster/Network.h"
+#include "../BBQMaster/MqttPublisher.h"
+#include "../BBQMaster/Power.h"
+
+#define POWER_SIM_START_TIME 1700000000
+// Battery the runtime is given for
+#define POWER_SIM_CAPACITY_MAH 2000.0f
+
+// Currents in mA, typical figures of the ESP32 datasheet
+#define POWER_SIM_BOARD_MA 2.0f
+#define POWER_SIM_CPU_ACTIVE_MA 50.0f
+#define POWER_SIM_CPU_ACTIVE_SLOW_MA 22.0f
+#define POWER_SIM_CPU_IDLE_MA 22.0f
+#define POWER_SIM_CPU_IDLE_SLOW_MA 12.0f
+// Radio: receiver always on, modem sleep waking for every beacon, and for every third one
+#define POWER_SIM_RADIO_LISTEN_MA 70.0f
+#define POWER_SIM_RADIO_DTIM_MA 10.0f
+#define POWER_SIM_RADIO_SKIP_MA 4.0f
+// Charge of MQTT messages in mA s: waking the modem for a burst, and each message with the radio on
+#define POWER_SIM_PUBLISH_WAKE_MAS 6.0f
+#define POWER_SIM_PUBLISH_MAS 1.0f
+// Four MAX31850 converting for 100 ms at 1.5 mA
+#define POWER_SIM_TC_REQUEST_MAS 0.6f
+
+// CPU time of each piece of work in ms
+#define POWER_SIM_WAKE_MS 0.05f
+// I2C traffic of one NTC channel at the default oversampling of 4
+#define POWER_SIM_CONVERSION_MS 3.0f
+// Bit banged OneWire scratchpad read of one amplifier
+#define POWER_SIM_TC_READ_MS 12.0f
+// Filters, queues, alarms and estimates of one reading
+#define POWER_SIM_READING_MS 1.0f
+#define POWER_SIM_PUBLISH_MS 2.0f
+// One pass of loop () with nothing to do
+#define POWER_SIM_LOOP_PASS_MS 0.3f
+
+static TempCurve s_curve;
+static std::vector<HistPoint> s_trace;
+static bool s_tracing;
+
+// Recorded cook, interpolated between the logged samples.
+static float traceCurve (int channel, uint32_t millis)
+{
+   if (s_trace.empty ())
+      return NAN;
+   float time = s_trace.front ().m_time + millis / 1000.0f;
+   size_t low = 0;
+   size_t high = s_trace.size () - 1;
+   if (time >= s_trace[high].m_time)
+      low = high;
+   while (high - low > 1)
+   {
+      size_t mid = (low + high) / 2;
+      if (s_trace[mid].m_time <= time)
+         low = mid;
+      else
+         high = mid;
+   }
+   const HistPoint& a = s_trace[low];
+   const HistPoint& b = s_trace[high];
+   if (!a.available (channel))
+      return NAN;
+   if (!b.available (channel) || b.m_time <= a.m_time)
+      return a.m_temp[channel] / 10.0f;
+   float f = (time - a.m_time) / (b.m_time - a.m_time);
+   return (a.m_temp[channel] + f * (b.m_temp[channel] - a.m_temp[channel])) / 10.0f;
+}
+
+static void addTracePoint (const HistPoint& point)
+{
+   s_trace.push_back (point);
+}
+
+// Split a downloaded cook.log back into its segments and replay them.
+static bool loadTrace (const char* path)
+{
+   FILE* file = fopen (path, "rb");
+   if (!file)
+      return false;
+   std::vector<uint8_t> data;
+   uint8_t buf[4096];
+   size_t len;
+   while ((len = fread (buf, 1, sizeof (buf), file)) > 0)
+      data.insert (data.end (), buf, buf + len);
+   fclose (file);
+
+   // Pages never start with 'B', their first byte is a record count.
+   MemoryFileSystem fs;
+   int slot = -1;
+   for (size_t offset = 0; offset + COOK_LOG_SEGMENT_HEADER <= data.size ();)
+   {
+      bool header = memcmp (&data[offset], "BBQL", 4) == 0;
+      if (header && ++slot == COOK_LOG_SEGMENTS)
+         break;
+      if (slot < 0)
+         return false;
+      char name[COOK_LOG_PATH_MAX];
+      snprintf (name, sizeof (name), "/cook%d.log", slot);
+      size_t chunk = header ? COOK_LOG_SEGMENT_HEADER : COOK_LOG_PAGE_SIZE;
+      if (offset + chunk > data.size ())
+         break;
+      fs.append (name, &data[offset], chunk);
+      offset += chunk;
+   }
+   CookLog log (fs);
+   log.begin ();
+   log.replay (addTracePoint);
+   return !s_trace.empty ();
+}
+
+// Figures of one run
+struct PowerRun
+{
+   float m_hours;
+   double m_chargeMas;
+   double m_activeMs;
+   unsigned long m_conversions;
+   unsigned long m_messages;
+   unsigned long m_wakes;
+   double m_error;
+   unsigned long m_errorSamples;
+   float m_saverAt;
+
+   float averageMa () const { return m_chargeMas / (m_hours * 3600.0f); }
+   float duty () const { return m_activeMs / (m_hours * 3600000.0f); }
+};
+
+static PowerRun runMode (PowerMode setting, float hours)
+{
+   srand (1);
+   FakeClock clock;
+   TempCurve curve = s_tracing ? traceCurve : s_curve;
+   ScriptedAdc adc (clock, curve, ntcCalibrationFromBeta (NTC_BCOEFFICIENT, NTC_SMP_TMP, NTC_SMP_RES));
+   ScriptedThermocouples thermocouples (clock, curve);
+   FakeBattery battery (4.2f);
+   RecordingMqtt mqtt;
+
+   g_clock = &clock;
+   g_probeAdc = &adc;
+   g_thermoCouples = &thermocouples;
+   g_battery = &battery;
+   g_mqtt = &mqtt;
+   g_epochOffset = POWER_SIM_START_TIME;
+
+   // Start from a clean slate, connected to the broker.
+   resetAcquisition ();
+   g_samplePlanner.setSetting (setting);
+   g_tempHist.clear ();
+   g_cookLog.clear ();
+   g_mqttPublisher = MqttPublisher ();
+   DataPoint drained;
+   while (g_readings.pop (drained))
+      ;
+   mqtt.startConnect ("", "", "");
+   while (mqtt.pollConnect () == CONNECT_PENDING)
+      ;
+
+   PowerRun run = PowerRun ();
+   run.m_hours = hours;
+   run.m_saverAt = -1;
+   unsigned long lastConversions = 0;
+   unsigned long lastRequests = 0;
+   unsigned long lastReads = 0;
+   unsigned long lastMessages = 0;
+   PowerMode applied = POWER_MODE_COUNT;
+   uint32_t totalTicks = hours * 3600000.0f / SENSOR_TASK_PERIOD;
+   uint32_t nextWake = 0;
+   DataPoint reading;
+   for (uint32_t ticks = 0; ticks < totalTicks; ticks++)
+   {
+      clock.advance (SENSOR_TASK_PERIOD);
+      float activeMs = 0;
+
+      // The sensor task sleeps through its idle ticks, as sensorTask () does.
+      if (ticks == nextWake)
+      {
+         sensorTick (ticks, reading);
+         nextWake = ticks + 1 + sensorIdleTicks (ticks);
+         activeMs += POWER_SIM_WAKE_MS;
+         run.m_wakes++;
+      }
+
+      // loop ()
+      PowerMode mode = g_samplePlanner.mode ();
+      if (mode != applied)
+      {
+         g_mqttPublisher.setBatchPeriod (powerBatchPeriod (mode));
+         if (mode == POWER_SAVER && run.m_saverAt < 0)
+            run.m_saverAt = clock.millis () / 3600000.0f;
+         applied = mode;
+      }
+      if (takeReadings ())
+      {
+         activeMs += POWER_SIM_READING_MS;
+         g_mqttPublisher.offer (g_lastSenUpdate, g_batteryLevel, clock.millis ());
+      }
+      HistPoint point;
+      while (g_histPoints.pop (point))
+      {
+         // How far the readings kept by the plan are from the probes
+         for (int i = 0; i < SENSOR_COUNT; i++)
+         {
+            float actual = curve (i, clock.millis ());
+            if (point.available (i) && !isnan (actual))
+            {
+               run.m_error += fabsf (point.m_temp[i] / 10.0f - actual);
+               run.m_errorSamples++;
+            }
+         }
+      }
+      g_mqttPublisher.service ();
+
+      unsigned long conversions = adc.conversions () - lastConversions;
+      unsigned long requests = thermocouples.requests () - lastRequests;
+      unsigned long reads = thermocouples.reads () - lastReads;
+      unsigned long messages = mqtt.published () - lastMessages;
+      lastConversions += conversions;
+      lastRequests += requests;
+      lastReads += reads;
+      lastMessages += messages;
+      run.m_conversions += conversions + reads;
+      run.m_messages += messages;
+      activeMs += conversions * POWER_SIM_CONVERSION_MS + reads * POWER_SIM_TC_READ_MS + messages * POWER_SIM_PUBLISH_MS;
+
+      // Full mode runs loop () flat out, the others pause between the passes.
+      uint32_t idle = powerLoopIdle (mode);
+      if (idle)
+         activeMs += SENSOR_TASK_PERIOD * POWER_SIM_LOOP_PASS_MS / (idle + POWER_SIM_LOOP_PASS_MS);
+      if (mode == POWER_FULL || activeMs > SENSOR_TASK_PERIOD)
+         activeMs = SENSOR_TASK_PERIOD;
+
+      bool slow = mode == POWER_SAVER;
+      float cpuActive = slow ? POWER_SIM_CPU_ACTIVE_SLOW_MA : POWER_SIM_CPU_ACTIVE_MA;
+      float cpuIdle = slow ? POWER_SIM_CPU_IDLE_SLOW_MA : POWER_SIM_CPU_IDLE_MA;
+      float radio = mode == POWER_FULL ? POWER_SIM_RADIO_LISTEN_MA : slow ? POWER_SIM_RADIO_SKIP_MA : POWER_SIM_RADIO_DTIM_MA;
+      double charge = (POWER_SIM_BOARD_MA + radio + cpuIdle) * SENSOR_TASK_PERIOD / 1000.0 + (cpuActive - cpuIdle) * activeMs / 1000.0;
+      // Messages sent together share the wake up of the modem.
+      if (messages)
+         charge += (mode == POWER_FULL ? POWER_SIM_PUBLISH_MAS : POWER_SIM_PUBLISH_WAKE_MAS) + (messages - 1) * POWER_SIM_PUBLISH_MAS;
+      charge += requests * POWER_SIM_TC_REQUEST_MAS;
+      run.m_chargeMas += charge;
+      run.m_activeMs += activeMs;
+
+      // Battery voltage follows the charge used, as batteryLevel () expects it.
+      float level = 1.0f - run.m_chargeMas / 3600.0f / POWER_SIM_CAPACITY_MAH;
+      battery.setVoltage (3.5f + 0.7f * fmaxf (0.0f, level));
+   }
+   return run;
+}
+
+int runPowerSimulation (float hours, TempCurve curve, const char* tracePath)
+{
+   s_curve = curve;
+   if (tracePath)
+   {
+      if (!loadTrace (tracePath))
+      {
+         printf ("power: cannot read the cook log %s\n", tracePath);
+         return 1;
+      }
+      s_tracing = true;
+      hours = (s_trace.back ().m_time - s_trace.front ().m_time) / 3600.0f;
+      printf ("power: %u samples, %.1f h from %s\n", (unsigned)s_trace.size (), hours, tracePath);
+   }
+
+   const PowerMode modes[] = {POWER_FULL, POWER_AUTO, POWER_SAVER};
+   float fullMa = 0;
+   float autoMa = 0;
+   for (PowerMode mode : modes)
+   {
+      PowerRun run = runMode (mode, hours);
+      float ma = run.averageMa ();
+      printf ("power %-5s: %5.1f%% cpu duty, %5.0f conversions/h, %4.0f mqtt messages/h, %.2f F mean error, %5.1f mA, %5.1f h per %.0f mAh", g_powerModeNames[mode], run.duty () * 100,
+              run.m_conversions / hours, run.m_messages / hours, run.m_errorSamples ? run.m_error / run.m_errorSamples : 0.0, ma, POWER_SIM_CAPACITY_MAH / ma, POWER_SIM_CAPACITY_MAH);
+      if (run.m_saverAt >= 0 && mode == POWER_AUTO)
+         printf (", saver from %.1f h", run.m_saverAt);
+      printf ("\n");
+      if (mode == POWER_FULL)
+         fullMa = ma;
+      else if (mode == POWER_AUTO)
+         autoMa = ma;
+   }
+   printf ("power: auto runs %.1fx longer per charge than full\n", fullMa / autoMa);
+
+   printf ("power: sample intervals at the end of the saver run:");
+   for (int i = 0; i < SENSOR_COUNT; i++)
+      printf (" %s %.1f s", g_channelNames[i], g_samplePlanner.interval (i) / 1000.0f);
+   printf ("\n");
+   return autoMa < fullMa ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+// Stress of the data shared between tasks: a sensor task thread adds history points as
+// fast as it can, a loop () thread publishes readings, and web handler threads read both
+// at the same time, through the response cache too. Every value written carries a pattern
+// a torn read would break. Fails when a reader that was told its copy is consistent saw
+// a broken pattern or records out of order. Build it with -fsanitize=thread (env
+// native_tsan) to also have ThreadSanitizer check the accesses themselves.
+//
+//    .pio/build/native_tsan/program 10 race
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+#include "FakeHal.h"
+#include "../BBQMaster/Sensors.h"
+#include "../BBQMaster/Network.h"
+#include "../BBQMaster/ResponseCache.h"
+
+// Start of the fake cook and the points added before the history starts over
+#define RACE_START_TIME 1700000000
+#define RACE_COOK_POINTS 20000
+// Threads reading the snapshots directly, besides the one serving through the cache
+#define RACE_READERS 2
+// Pause of the sensor task between points, so some history passes get through unchanged
+#define RACE_POINT_PAUSE_US 50
+
+static std::atomic<bool> s_stop (false);
+
+// Value of a channel at a time, constant over each 10 minute bucket so the rolled up
+// tiers carry it too, in 0.1 F
+static int16_t patternTenths (int32_t time, int channel)
+{
+   return (int16_t)(400 + channel * 100 + (time / HIST_TEN_MIN_PERIOD) % 50);
+}
+
+static bool recordIntact (const HistRecord& record)
+{
+   if (record.m_avail != 0xff)
+      return false;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      int16_t value = patternTenths (record.m_time, i);
+      if (record.m_avg[i] != value || record.m_min[i] != value || record.m_max[i] != value)
+         return false;
+   }
+   return true;
+}
+
+static bool measuresIntact (const Measures& measures)
+{
+   const DataPoint& reading = measures.m_reading;
+   // Nothing published yet
+   if (!reading.m_time)
+      return true;
+   for (int i = 0; i < SENSOR_COUNT; i++)
+   {
+      const Sensor& sensor = reading.m_sensors[i];
+      if (sensor.m_tempF != reading.m_time + i || sensor.m_ind != ((reading.m_time & 1) != 0) || sensor.m_name != g_channelNames[i])
+         return false;
+   }
+   return true;
+}
+
+// The sensor task: adds points, starting a new cook now and then.
+static void sensorTask (unsigned long& points)
+{
+   int32_t time = RACE_START_TIME;
+   while (!s_stop)
+   {
+      if (points % RACE_COOK_POINTS == 0)
+         g_tempHist.clear ();
+      HistPoint point;
+      point.m_time = time;
+      point.m_avail = 0xff;
+      for (int i = 0; i < SENSOR_COUNT; i++)
+         point.m_temp[i] = patternTenths (time, i);
+      g_tempHist.add (point);
+      time += HIST_INT / 1000;
+      points++;
+      std::this_thread::sleep_for (std::chrono::microseconds (RACE_POINT_PAUSE_US));
+   }
+}
+
+// loop (): publishes a new reading each time round.
+static void loopTask (unsigned long& published)
+{
+   for (int32_t count = 1; !s_stop; count++)
+   {
+      g_lastSenUpdate.m_time = count;
+      for (int i = 0; i < SENSOR_COUNT; i++)
+         g_lastSenUpdate.m_sensors[i] = Sensor ((count & 1) != 0, count + i, g_channelNames[i]);
+      publishMeasures ();
+      published++;
+   }
+}
+
+struct ReaderStats
+{
+   unsigned long m_measures;
+   unsigned long m_passes;
+   unsigned long m_retried;
+   unsigned long m_torn;
+};
+
+// A web handler reading the snapshots.
+static void readerTask (ReaderStats& stats)
+{
+   while (!s_stop)
+   {
+      if (!measuresIntact (g_measures.read ()))
+         stats.m_torn++;
+      stats.m_measures++;
+
+      HistoryStore::View hist (g_tempHist);
+      bool intact = true;
+      int32_t last = INT32_MIN;
+      for (size_t i = 0; i < hist.size (); i++)
+      {
+         HistRecord record = hist[i];
+         if (!recordIntact (record) || record.m_time <= last)
+            intact = false;
+         last = record.m_time;
+      }
+      if (!hist.consistent ())
+         stats.m_retried++;
+      else if (!intact)
+         stats.m_torn++;
+      stats.m_passes++;
+   }
+}
+
+// The async TCP task: the data endpoints through the response cache, and the whole
+// /history.json stream.
+static void cacheTask (ReaderStats& stats)
+{
+   while (!s_stop)
+   {
+      if (g_responseCache.get (DOC_MEASURES, 0))
+         stats.m_measures++;
+      g_responseCache.get (DOC_HISTORY_BIN, INT32_MIN);
+
+      HistoryJsonStream stream = HistoryJsonStream ();
+      stream.m_lastTime = INT32_MIN;
+      uint8_t segment[RESPONSE_BLOCK_SIZE];
+      while (fillHistoryChunk (stream, segment, sizeof (segment)) > 0)
+         ;
+      // A poll for the last minute, as the page does
+      g_responseCache.get (DOC_HISTORY_JSON, stream.m_lastTime - HIST_MIN_PERIOD);
+      stats.m_passes++;
+   }
+}
+
+int runRaceTest (float seconds)
+{
+   unsigned long points = 0;
+   unsigned long published = 0;
+   ReaderStats stats[RACE_READERS + 1] = {};
+
+   std::thread sensor (sensorTask, std::ref (points));
+   std::thread loop (loopTask, std::ref (published));
+   std::thread cache (cacheTask, std::ref (stats[RACE_READERS]));
+   std::thread readers[RACE_READERS];
+   for (int i = 0; i < RACE_READERS; i++)
+      readers[i] = std::thread (readerTask, std::ref (stats[i]));
+
+   std::this_thread::sleep_for (std::chrono::milliseconds ((long)(seconds * 1000)));
+   s_stop = true;
+   sensor.join ();
+   loop.join ();
+   cache.join ();
+   for (int i = 0; i < RACE_READERS; i++)
+      readers[i].join ();
+
+   ReaderStats total = {};
+   for (int i = 0; i <= RACE_READERS; i++)
+   {
+      total.m_measures += stats[i].m_measures;
+      total.m_passes += stats[i].m_passes;
+      total.m_retried += stats[i].m_retried;
+      total.m_torn += stats[i].m_torn;
+   }
+   printf ("race: %lu history points and %lu readings written, %lu readings and %lu history passes read, %lu history passes raced a change, %lu torn\n",
+           points, published, total.m_measures, total.m_passes, total.m_retried, total.m_torn);
+   // Some passes must have raced the writer and some not, or the check proved nothing.
+   bool ok = !total.m_torn && points && published && stats[RACE_READERS].m_passes && total.m_retried && total.m_retried < total.m_passes;
+   printf ("race: %s\n", ok ? "within bounds" : "OUT OF BOUNDS");
+   return ok ? 0 : 1;
+}
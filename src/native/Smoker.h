@@ -0,0 +1,51 @@
+#ifndef SMOKER_H
+#define SMOKER_H
+
+#include <math.h>
+
+// Ambient temperature around the smoker in F
+#define SMOKER_AMBIENT 70.0f
+// The fire follows the air flow with this time constant, in seconds
+#define SMOKER_FIRE_TAU 180.0f
+// Air drawn in by the chimney with the blower off, as a share of the full air flow
+#define SMOKER_DRAFT 0.15f
+// Pit temperature above ambient with the fire at full power
+#define SMOKER_MAX_RISE 380.0f
+// Time constant of the pit with the lid closed, in seconds
+#define SMOKER_PIT_TAU 600.0f
+// Heat loss multiplier while the lid is open
+#define SMOKER_LID_LOSS 6.0f
+
+// First order thermal model of a blower driven smoker, for the closed loop simulation.
+//
+// The fire burns in proportion to the air flow, the chimney draft plus the blower, and
+// settles with SMOKER_FIRE_TAU. The pit gains the heat of the fire and loses it to the
+// ambient air, much faster while the lid is open.
+class SmokerModel
+{
+public:
+   SmokerModel () : m_fire (0), m_pit (SMOKER_AMBIENT), m_lidOpenFor (0) {}
+
+   // Advance the model by dt seconds with the blower at duty (0-1).
+   void step (float duty, float dt)
+   {
+      float airflow = SMOKER_DRAFT + (1.0f - SMOKER_DRAFT) * duty;
+      m_fire += (airflow - m_fire) * dt / SMOKER_FIRE_TAU;
+      float loss = m_lidOpenFor > 0 ? SMOKER_LID_LOSS : 1.0f;
+      m_pit += (SMOKER_MAX_RISE * m_fire - loss * (m_pit - SMOKER_AMBIENT)) * dt / SMOKER_PIT_TAU;
+      if (m_lidOpenFor > 0)
+         m_lidOpenFor -= dt;
+   }
+   // Open the lid for a number of seconds.
+   void openLid (float seconds) { m_lidOpenFor = seconds; }
+
+   float pitTempF () const { return m_pit; }
+   bool lidOpen () const { return m_lidOpenFor > 0; }
+
+private:
+   float m_fire;
+   float m_pit;
+   float m_lidOpenFor;
+};
+
+#endif
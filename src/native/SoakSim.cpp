@@ -0,0 +1,532 @@
+// Soak and load test: a whole cook at accelerated time with web clients hammering the data
+// endpoints and a broker that drops out now and then. The sensor task and loop () run as
+// in the simulation of main.cpp, paced against the wall clock. A thread stands in for the
+// async TCP task: it runs the handlers of /measures.json, /history.json and /history.bin
+// as BBQMaster.cpp does, one at a time, and sends the responses a TCP segment at a time,
+// taking turns between them. Each client sends its next request once the last one is
+// answered, polling like the web page and loading the whole cook now and then.
+//
+// Reports the response latency of each endpoint, the spread of the sample interval and
+// the firmware steps, the heap used by the web side and whether every state queued for
+// MQTT reached the broker in order. Fails on a malformed response, a dropped reading, a
+// lost or reordered state, or heap left over once the clients are gone.
+//
+//    .pio/build/native/program [hours] soak [clients]
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "FakeHal.h"
+#include "Heap.h"
+#include "../BBQMaster/Sensors.h"
+#include "../BBQMaster/Network.h"
+#include "../BBQMaster/MqttPublisher.h"
+#include "../BBQMaster/MqttConnection.h"
+#include "../BBQMaster/Metrics.h"
+#include "../BBQMaster/Power.h"
+#include "../BBQMaster/ResponseCache.h"
+
+#define SOAK_START_TIME 1700000000
+// Simulated ms per wall clock ms, a 16 hour cook takes half a minute
+#define SOAK_SPEEDUP 2000
+// Simulated ms between two checks of the pace
+#define SOAK_PACE_PERIOD 1000
+#define SOAK_CLIENTS 10
+#define SOAK_CLIENTS_MAX 32
+// Requests of a client between two page loads
+#define SOAK_RELOAD_REQUESTS 400
+// Longest response a client takes
+#define SOAK_BODY_MAX (64 * 1024)
+// Broker outage, in hours into the cook, and shorter drops of the connection
+#define SOAK_OUTAGE_START 4
+#define SOAK_OUTAGE_END 5
+#define SOAK_DROP_PERIOD (150 * 60000u)
+#define SOAK_DROP_LENGTH 45000
+// Heap the web side may use: the cached bodies, the copy history.bin is encoded in, the streams and tickets
+#define SOAK_HEAP_MAX (64 * 1024)
+
+// Log-linear buckets: exact below 16, then 16 per power of two
+#define SOAK_SUB_BUCKETS 16
+#define SOAK_BUCKETS (29 * SOAK_SUB_BUCKETS)
+
+// Distribution of durations, without allocating.
+class LatencyHistogram
+{
+public:
+   LatencyHistogram () : m_counts (), m_count (0), m_max (0) {}
+
+   void add (uint32_t value)
+   {
+      m_counts[bucket (value)]++;
+      m_count++;
+      if (value > m_max)
+         m_max = value;
+   }
+
+   void merge (const LatencyHistogram& other)
+   {
+      for (int i = 0; i < SOAK_BUCKETS; i++)
+         m_counts[i] += other.m_counts[i];
+      m_count += other.m_count;
+      if (other.m_max > m_max)
+         m_max = other.m_max;
+   }
+
+   // Lowest value of the bucket holding the given fraction of the values, within 1/16.
+   uint32_t percentile (float fraction) const
+   {
+      unsigned long target = (unsigned long)(fraction * m_count + 0.5f);
+      unsigned long seen = 0;
+      for (int i = 0; i < SOAK_BUCKETS; i++)
+      {
+         seen += m_counts[i];
+         if (seen >= target && seen)
+            return lowest (i);
+      }
+      return m_max;
+   }
+
+   unsigned long count () const { return m_count; }
+   uint32_t max () const { return m_max; }
+
+private:
+   static int bucket (uint32_t value)
+   {
+      if (value < SOAK_SUB_BUCKETS)
+         return value;
+      int exponent = 31 - __builtin_clz (value);
+      return (exponent - 3) * SOAK_SUB_BUCKETS + ((value >> (exponent - 4)) & (SOAK_SUB_BUCKETS - 1));
+   }
+
+   static uint32_t lowest (int bucket)
+   {
+      if (bucket < SOAK_SUB_BUCKETS)
+         return bucket;
+      int exponent = bucket / SOAK_SUB_BUCKETS + 3;
+      return (uint32_t)(SOAK_SUB_BUCKETS + bucket % SOAK_SUB_BUCKETS) << (exponent - 4);
+   }
+
+   unsigned long m_counts[SOAK_BUCKETS];
+   unsigned long m_count;
+   uint32_t m_max;
+};
+
+enum SoakEndpoint
+{
+   SOAK_MEASURES,
+   SOAK_HISTORY_POLL,
+   SOAK_HISTORY_FULL,
+   SOAK_HISTORY_BIN,
+   SOAK_ENDPOINTS
+};
+
+static const char* const s_endpointNames[SOAK_ENDPOINTS] = {"/measures.json", "/history.json?since", "/history.json", "/history.bin"};
+
+// A browser, with one request at a time. The body is filled by the server thread and read
+// by the client once told the response is complete.
+struct SoakClient
+{
+   SoakClient () : m_finished (false), m_status (0), m_length (0), m_since (INT32_MIN), m_requests (0), m_busy (0), m_failed (0) {}
+
+   std::mutex m_lock;
+   std::condition_variable m_done;
+   bool m_finished;
+   int m_status;
+   size_t m_length;
+   char m_body[SOAK_BODY_MAX + 1];
+
+   // Time of the last history record received
+   int32_t m_since;
+   unsigned long m_requests;
+   unsigned long m_busy;
+   unsigned long m_failed;
+   LatencyHistogram m_latency[SOAK_ENDPOINTS];
+};
+
+struct SoakRequest
+{
+   int m_client;
+   SoakEndpoint m_endpoint;
+   int32_t m_since;
+};
+
+// Response being sent by the server thread
+struct SoakResponse
+{
+   bool m_active;
+   BodyRef m_body;
+   std::shared_ptr<HistoryJsonStream> m_stream;
+   std::shared_ptr<ResponseTicket> m_ticket;
+   size_t m_sent;
+};
+
+static std::unique_ptr<SoakClient[]> s_clients;
+static SoakResponse s_responses[SOAK_CLIENTS_MAX];
+
+// Requests not picked up by the server yet, at most one per client
+static std::mutex s_queueLock;
+static std::condition_variable s_queueReady;
+static SoakRequest s_queue[SOAK_CLIENTS_MAX];
+static int s_queueHead;
+static int s_queued;
+
+static std::atomic<bool> s_stopClients (false);
+static std::atomic<bool> s_stopServer (false);
+
+static uint32_t nanosSince (std::chrono::steady_clock::time_point start)
+{
+   return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now () - start).count ();
+}
+
+// Tell a client its response is complete.
+static void finishResponse (int client, int status)
+{
+   SoakResponse& response = s_responses[client];
+   response.m_active = false;
+   // The ticket goes with the response, as when the web server destroys it.
+   response.m_body.reset ();
+   response.m_stream.reset ();
+   response.m_ticket.reset ();
+
+   SoakClient& target = s_clients[client];
+   {
+      std::lock_guard<std::mutex> lock (target.m_lock);
+      target.m_status = status;
+      target.m_length = response.m_sent;
+      target.m_finished = true;
+   }
+   target.m_done.notify_one ();
+}
+
+// sendCached () of BBQMaster.cpp
+static void sendCached (int client, CachedDocument doc, int32_t since)
+{
+   SoakResponse& response = s_responses[client];
+   response.m_ticket = ResponseTicket::take ();
+   if (response.m_ticket)
+      response.m_body = g_responseCache.get (doc, since);
+   if (!response.m_body)
+   {
+      finishResponse (client, 503);
+      return;
+   }
+   response.m_active = true;
+}
+
+// The handlers of the data endpoints in BBQMaster.cpp
+static void handleRequest (const SoakRequest& request)
+{
+   SoakResponse& response = s_responses[request.m_client];
+   response.m_sent = 0;
+   switch (request.m_endpoint)
+   {
+   case SOAK_MEASURES:
+      countMetric (g_httpRequests[HTTP_MEASURES]);
+      sendCached (request.m_client, DOC_MEASURES, 0);
+      break;
+   case SOAK_HISTORY_POLL:
+   case SOAK_HISTORY_FULL:
+      countMetric (g_httpRequests[HTTP_HISTORY]);
+      if (historyJsonCacheable (request.m_since))
+      {
+         sendCached (request.m_client, DOC_HISTORY_JSON, request.m_since);
+         break;
+      }
+      response.m_ticket = ResponseTicket::take ();
+      if (!response.m_ticket)
+      {
+         finishResponse (request.m_client, 503);
+         break;
+      }
+      response.m_stream.reset (new HistoryJsonStream ());
+      response.m_stream->m_lastTime = request.m_since;
+      response.m_active = true;
+      break;
+   case SOAK_HISTORY_BIN:
+      countMetric (g_httpRequests[HTTP_HISTORY_BIN]);
+      sendCached (request.m_client, DOC_HISTORY_BIN, request.m_since);
+      break;
+   default:
+      break;
+   }
+}
+
+// Send the next segment of a response, into the body buffer of its client.
+static void sendSegment (int client)
+{
+   SoakResponse& response = s_responses[client];
+   uint8_t segment[RESPONSE_BLOCK_SIZE];
+   size_t len;
+   if (response.m_body)
+      len = response.m_body->read (response.m_sent, segment, sizeof (segment));
+   else
+   {
+      len = fillHistoryChunk (*response.m_stream, segment, sizeof (segment));
+      if (len == HIST_CHUNK_RETRY)
+         return;
+   }
+
+   SoakClient& target = s_clients[client];
+   if (response.m_sent < SOAK_BODY_MAX)
+      memcpy (target.m_body + response.m_sent, segment, std::min (len, (size_t)SOAK_BODY_MAX - response.m_sent));
+   response.m_sent += len;
+   if (!len || (response.m_body && response.m_sent == response.m_body->length ()))
+      finishResponse (client, 200);
+}
+
+// The async TCP task: takes the new requests, then sends a segment of every response under way.
+static void serverTask ()
+{
+   trackThreadHeap ();
+   for (;;)
+   {
+      bool active = false;
+      for (int i = 0; i < SOAK_CLIENTS_MAX; i++)
+         active = active || s_responses[i].m_active;
+
+      SoakRequest requests[SOAK_CLIENTS_MAX];
+      int count = 0;
+      {
+         std::unique_lock<std::mutex> lock (s_queueLock);
+         if (!active)
+            s_queueReady.wait (lock, [] { return s_queued > 0 || s_stopServer; });
+         if (!active && !s_queued)
+            return;
+         for (; s_queued; s_queued--, s_queueHead = (s_queueHead + 1) % SOAK_CLIENTS_MAX)
+            requests[count++] = s_queue[s_queueHead];
+      }
+      for (int i = 0; i < count; i++)
+         handleRequest (requests[i]);
+      for (int i = 0; i < SOAK_CLIENTS_MAX; i++)
+         if (s_responses[i].m_active)
+            sendSegment (i);
+   }
+}
+
+// Times of the history records in a /history.json body, in order and after since.
+static bool checkHistoryJson (SoakClient& client, int32_t since)
+{
+   static const char open[] = "{\"hist\":[";
+   if (client.m_length > SOAK_BODY_MAX || strncmp (client.m_body, open, sizeof (open) - 1) != 0 || client.m_length < 2 ||
+       strcmp (client.m_body + client.m_length - 2, "]}") != 0)
+      return false;
+   int32_t last = since;
+   for (const char* t = strstr (client.m_body, "{\"t\":"); t; t = strstr (t + 1, "{\"t\":"))
+   {
+      int32_t time = atol (t + 5);
+      if (time <= last)
+         return false;
+      last = time;
+   }
+   client.m_since = last;
+   return true;
+}
+
+// Send a request and wait for the whole response, as the browser does.
+static void request (int index, SoakEndpoint endpoint)
+{
+   SoakClient& client = s_clients[index];
+   int32_t since = endpoint == SOAK_HISTORY_POLL ? client.m_since : INT32_MIN;
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+   {
+      std::lock_guard<std::mutex> lock (s_queueLock);
+      SoakRequest& queued = s_queue[(s_queueHead + s_queued) % SOAK_CLIENTS_MAX];
+      queued.m_client = index;
+      queued.m_endpoint = endpoint;
+      queued.m_since = since;
+      s_queued++;
+   }
+   s_queueReady.notify_one ();
+   {
+      std::unique_lock<std::mutex> lock (client.m_lock);
+      client.m_done.wait (lock, [&client] { return client.m_finished; });
+      client.m_finished = false;
+   }
+   client.m_latency[endpoint].add (nanosSince (start));
+   client.m_requests++;
+
+   if (client.m_status == 503)
+   {
+      client.m_busy++;
+      return;
+   }
+   client.m_body[std::min (client.m_length, (size_t)SOAK_BODY_MAX)] = '\0';
+   bool ok = client.m_status == 200 && client.m_length > 0 && client.m_length <= SOAK_BODY_MAX;
+   if (ok && endpoint == SOAK_MEASURES)
+      ok = client.m_body[0] == '{' && client.m_body[client.m_length - 1] == '}';
+   else if (ok && endpoint != SOAK_HISTORY_BIN)
+      ok = checkHistoryJson (client, since);
+   if (!ok)
+      client.m_failed++;
+}
+
+// The web page: loads the whole cook, then polls the readings and the new history records.
+static void clientTask (int index)
+{
+   for (unsigned long count = 0; !s_stopClients; count++)
+   {
+      if (count % SOAK_RELOAD_REQUESTS == 0)
+      {
+         request (index, SOAK_HISTORY_BIN);
+         request (index, SOAK_HISTORY_FULL);
+      }
+      else
+         request (index, count & 1 ? SOAK_MEASURES : SOAK_HISTORY_POLL);
+   }
+}
+
+// Whether the broker is reachable at a time of the cook.
+static bool brokerReachable (uint32_t millis)
+{
+   if (millis >= SOAK_OUTAGE_START * 3600000u && millis < SOAK_OUTAGE_END * 3600000u)
+      return false;
+   return millis % SOAK_DROP_PERIOD >= SOAK_DROP_LENGTH || millis < SOAK_DROP_PERIOD;
+}
+
+static void printLatency (const char* name, const LatencyHistogram& latency)
+{
+   printf ("soak %-20s %7lu requests, p50 %7.1f us, p99 %7.1f us, max %8.1f us\n", name, latency.count (), latency.percentile (0.5f) / 1000.0f,
+           latency.percentile (0.99f) / 1000.0f, latency.max () / 1000.0f);
+}
+
+int runSoakTest (float hours, TempCurve curve, int clients)
+{
+   srand (1);
+   if (clients < 1 || clients > SOAK_CLIENTS_MAX)
+      clients = SOAK_CLIENTS;
+
+   FakeClock clock;
+   ScriptedAdc adc (clock, curve, ntcCalibrationFromBeta (NTC_BCOEFFICIENT, NTC_SMP_TMP, NTC_SMP_RES));
+   ScriptedThermocouples thermocouples (clock, curve);
+   FakeBattery battery (3.9f);
+   RecordingMqtt mqtt;
+
+   g_clock = &clock;
+   g_probeAdc = &adc;
+   g_thermoCouples = &thermocouples;
+   g_battery = &battery;
+   g_mqtt = &mqtt;
+
+   defaultNtcCalibration ();
+   defaultFilterConfigs ();
+   buildNtcTables ();
+   applyFilterConfigs ();
+   g_cookLog.begin ();
+   g_epochOffset = SOAK_START_TIME;
+   setupMqttTopics ();
+   snprintf (g_uniqueId, 5, "0000");
+   // The page is open, every channel at the base interval.
+   g_samplePlanner.setSetting (POWER_FULL);
+
+   s_clients.reset (new SoakClient[clients]);
+   std::thread server (serverTask);
+   std::unique_ptr<std::thread[]> threads (new std::thread[clients]);
+   for (int i = 0; i < clients; i++)
+      threads[i] = std::thread (clientTask, i);
+
+   // Sensor task and loop () interleaved on one thread, at SOAK_SPEEDUP times real time.
+   uint32_t totalTicks = hours * 3600000.0f / SENSOR_TASK_PERIOD;
+   unsigned long readings = 0;
+   unsigned long queued = 0;
+   uint32_t lastReading = 0;
+   uint32_t behind = 0;
+   LatencyHistogram jitter;
+   LatencyHistogram steps;
+   DataPoint reading;
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+   for (uint32_t ticks = 0; ticks < totalTicks; ticks++)
+   {
+      clock.advance (SENSOR_TASK_PERIOD);
+      uint32_t ms = clock.millis ();
+      if (ms % SOAK_PACE_PERIOD == 0)
+      {
+         std::chrono::steady_clock::time_point due = start + std::chrono::microseconds ((uint64_t)ms * 1000 / SOAK_SPEEDUP);
+         std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now ();
+         if (now < due)
+            std::this_thread::sleep_until (due);
+         else
+            behind = std::max (behind, (uint32_t)std::chrono::duration_cast<std::chrono::microseconds> (now - due).count ());
+      }
+
+      std::chrono::steady_clock::time_point stepStart = std::chrono::steady_clock::now ();
+      sensorTick (ticks, reading);
+      mqtt.setReachable (brokerReachable (ms));
+      g_mqttConnection.service (ms);
+      if (takeReadings ())
+      {
+         if (readings)
+            jitter.add (abs ((int)(ms - lastReading) - SENSOR_READ_INT));
+         lastReading = ms;
+         readings++;
+         // States queued, counted apart from the broker. A full queue drops one for each new one.
+         size_t backlog = g_mqttPublisher.backlog ();
+         uint32_t dropped = g_mqttBacklogDropped;
+         g_mqttPublisher.offer (g_lastSenUpdate, g_batteryLevel, ms);
+         queued += g_mqttPublisher.backlog () - backlog + (g_mqttBacklogDropped - dropped);
+      }
+      HistPoint point;
+      while (g_histPoints.pop (point))
+         ;
+      if (g_mqttConnection.online ())
+         g_mqttPublisher.service ();
+      steps.add (nanosSince (stepStart));
+   }
+   float seconds = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start).count () / 1000.0f;
+
+   s_stopClients = true;
+   for (int i = 0; i < clients; i++)
+      threads[i].join ();
+   {
+      std::lock_guard<std::mutex> lock (s_queueLock);
+      s_stopServer = true;
+   }
+   s_queueReady.notify_one ();
+   server.join ();
+   // Every response is sent, what the cache holds is all the web side should still have.
+   g_responseCache.clear ();
+   HeapUse heap = heapUse ();
+
+   LatencyHistogram latency[SOAK_ENDPOINTS];
+   unsigned long requests = 0;
+   unsigned long busy = 0;
+   unsigned long failed = 0;
+   for (int i = 0; i < clients; i++)
+   {
+      for (int e = 0; e < SOAK_ENDPOINTS; e++)
+         latency[e].merge (s_clients[i].m_latency[e]);
+      requests += s_clients[i].m_requests;
+      busy += s_clients[i].m_busy;
+      failed += s_clients[i].m_failed;
+   }
+
+   unsigned long dropped = g_readings.dropped () + g_histPoints.dropped ();
+   printf ("soak: %.1f h cook in %.1f s, %d clients, %lu requests, %lu readings, %lu dropped\n", hours, seconds, clients, requests, readings, dropped);
+   for (int e = 0; e < SOAK_ENDPOINTS; e++)
+      printLatency (s_endpointNames[e], latency[e]);
+   printf ("soak responses: %lu busy (503), %lu malformed, %u cache hits, %u bodies serialized\n", busy, failed, (unsigned)g_responseCacheHits.load (),
+           (unsigned)g_responseCacheBuilds.load ());
+   printf ("soak sampling: interval off by p99 %u ms, max %u ms, firmware step p50 %.1f us, p99 %.1f us, max %.1f us, at most %.1f ms behind schedule\n",
+           jitter.percentile (0.99f), jitter.max (), steps.percentile (0.5f) / 1000.0f, steps.percentile (0.99f) / 1000.0f, steps.max () / 1000.0f, behind / 1000.0f);
+   printf ("soak heap: web side peak %u bytes, largest block %u bytes, %lu allocations, %u bytes left once the cache is cleared\n", (unsigned)heap.m_peak,
+           (unsigned)heap.m_largest, heap.m_count, (unsigned)heap.m_live);
+
+   unsigned long delivered = mqtt.states () + mqtt.backlog ();
+   printf ("soak mqtt: %lu states queued, %lu delivered (%.2f%%), %lu replayed after the drops, %u lost, %lu out of order, longest gap %ld s, %lu connection attempts\n",
+           queued, delivered, queued ? 100.0f * delivered / queued : 0.0f, mqtt.backlog (), (unsigned)g_mqttBacklogDropped.load (), mqtt.outOfOrder (),
+           mqtt.maxStateGap (), mqtt.attempts ());
+
+   bool ok = !failed && !dropped && !heap.m_live && heap.m_peak <= SOAK_HEAP_MAX && delivered + g_mqttPublisher.backlog () == queued && !g_mqttBacklogDropped && !mqtt.outOfOrder ();
+   ok = ok && mqtt.maxStateGap () <= MQTT_MAX_PUBLISH_PERIOD / 1000;
+   for (int e = 0; e < SOAK_ENDPOINTS; e++)
+      ok = ok && latency[e].count ();
+   ok = ok && jitter.max () < SENSOR_TASK_PERIOD;
+   printf ("soak: %s\n", ok ? "within bounds" : "OUT OF BOUNDS");
+   return ok ? 0 : 1;
+}
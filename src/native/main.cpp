@@ -0,0 +1,344 @@
+// Host build of the firmware logic. Runs a simulated cook through the sensor, history,
+// cook log, JSON and MQTT code against scripted hardware, faster than real time.
+//
+//    pio run -e native && .pio/build/native/program [hours] [pid | power [cook.log] | boot]
+//    .pio/build/native/program [seconds] race
+//    .pio/build/native/program [hours] soak [clients]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "FakeHal.h"
+#include "Heap.h"
+#include "../BBQMaster/Sensors.h"
+#include "../BBQMaster/Network.h"
+#include "../BBQMaster/HistoryCodec.h"
+#include "../BBQMaster/MqttPublisher.h"
+#include "../BBQMaster/MqttConnection.h"
+#include "../BBQMaster/Metrics.h"
+#include "../BBQMaster/Alarms.h"
+#include "../BBQMaster/Estimator.h"
+
+// Seconds since the epoch at the start of the simulation
+#define SIM_START_TIME 1700000000
+// Broker outage, in hours into the cook
+#define SIM_OUTAGE_START 4
+#define SIM_OUTAGE_END 5
+// NTC1 sits at 160 F between these hours, then climbs to the target
+#define SIM_STALL_FROM 3.0f
+#define SIM_STALL_TO 6.0f
+// The time to target has to be this close, in hours, from this long into the cook until the target is reached
+#define SIM_ETA_FROM 7.5f
+#define SIM_ETA_TOLERANCE 0.25f
+// Time to target estimates kept for the check, one every half hour
+#define SIM_ETA_MAX 64
+
+MemoryFileSystem g_memoryFs;
+CookLog g_cookLog (g_memoryFs);
+
+// Uniform noise in [-amplitude, amplitude]
+static float noise (float amplitude)
+{
+   return amplitude * (2.0f * rand () / RAND_MAX - 1.0f);
+}
+
+// Pit on TC1 and meat on NTC1 with a stall around 160 F, NTC2 plugged in after an hour and
+// pulled out after 12. The pit flares up to 320 F after 7 hours and the fire dies down after 10.
+static float cookCurve (int channel, uint32_t millis)
+{
+   float hours = millis / 3600000.0f;
+   switch (channel)
+   {
+   case 0:
+   {
+      float temp = 40.0f + 180.0f * (1.0f - expf (-hours / 2.0f));
+      if (temp >= 160.0f)
+         temp = 160.0f + 12.0f * fmaxf (0.0f, hours - 6.0f);
+      return fminf (temp, 203.0f) + noise (0.5f);
+   }
+   case 1:
+      return hours < 1.0f || hours >= 12.0f ? NAN : 70.0f + 10.0f * hours + noise (0.5f);
+   case NTC_CHANNELS:
+   {
+      float temp = 70.0f + 180.0f * (1.0f - expf (-hours * 4.0f));
+      if (hours >= 7.0f && hours < 7.5f)
+         temp += 70.0f * sinf ((hours - 7.0f) * 2.0f * (float)M_PI);
+      else if (hours >= 10.0f && hours < 10.75f)
+         temp -= 50.0f * sinf ((hours - 10.0f) / 0.75f * (float)M_PI);
+      return temp + noise (3.0f);
+   }
+   default:
+      return NAN;
+   }
+}
+
+static size_t s_replayed;
+
+// Time to target of NTC1 every half hour, in hours into the cook
+struct EtaSample
+{
+   float m_at;
+   float m_doneAt;
+   bool m_valid;
+   bool m_stalled;
+};
+static EtaSample s_etas[SIM_ETA_MAX];
+static size_t s_etaCount;
+
+// Closed loop pit control against the smoker model, in PitSim.cpp
+int runPitSimulation (float hours);
+// Energy use of each power mode, in PowerSim.cpp
+int runPowerSimulation (float hours, TempCurve curve, const char* tracePath);
+// Reboot in the middle of the cook, in BootSim.cpp
+int runBootSimulation (TempCurve curve);
+// Tasks sharing the readings and the history, in RaceSim.cpp
+int runRaceTest (float seconds);
+// Web clients and broker drops over a whole cook, in SoakSim.cpp
+int runSoakTest (float hours, TempCurve curve, int clients);
+// Checks of the building blocks, in Checks.cpp
+bool runChecks ();
+
+// Alarm rules of the simulated cook, as configured from the web page.
+static void setupAlarms ()
+{
+   AlarmRule rule;
+   makeAlarmRule ("target", "NTC1", 203, 2, ALARM_DEFAULT_WINDOW, rule);
+   g_alarms.setRule (0, rule);
+   makeAlarmRule ("high", "TC1", 275, 5, ALARM_DEFAULT_WINDOW, rule);
+   g_alarms.setRule (1, rule);
+   makeAlarmRule ("low", "TC1", 225, 5, ALARM_DEFAULT_WINDOW, rule);
+   g_alarms.setRule (2, rule);
+   makeAlarmRule ("rise", "TC1", 3, 1, 600, rule);
+   g_alarms.setRule (3, rule);
+   makeAlarmRule ("disconnect", "NTC2", 0, 0, ALARM_DEFAULT_WINDOW, rule);
+   g_alarms.setRule (4, rule);
+}
+
+// Alarm the simulated cook has to raise, with the hours into the cook its rule goes off in.
+// The rules listed must not go off at any other time.
+struct ExpectedAlarm
+{
+   uint8_t m_rule;
+   float m_from;
+   float m_to;
+};
+
+static const ExpectedAlarm s_expectedAlarms[] = {
+   {1, 7.0f, 7.5f},     // TC1 above 275 F while the fire flares up
+   {0, 9.0f, 10.0f},    // NTC1 at 203 F once the stall is over
+   {2, 10.0f, 10.75f},  // TC1 below 225 F while the fire dies down
+   {4, 12.0f, 12.1f},   // NTC2 pulled out
+};
+#define EXPECTED_ALARM_COUNT (sizeof (s_expectedAlarms) / sizeof (s_expectedAlarms[0]))
+
+// Hours into the cook each expected alarm went off, negative until it does
+static float s_alarmAt[EXPECTED_ALARM_COUNT] = {-1.0f, -1.0f, -1.0f, -1.0f};
+static unsigned long s_misplacedAlarms;
+
+static void checkAlarmEvent (const AlarmEvent& event)
+{
+   if (!event.m_active)
+      return;
+   float at = (event.m_time - SIM_START_TIME) / 3600.0f;
+   for (size_t i = 0; i < EXPECTED_ALARM_COUNT; i++)
+   {
+      const ExpectedAlarm& expected = s_expectedAlarms[i];
+      if (expected.m_rule != event.m_rule)
+         continue;
+      if (at < expected.m_from || at > expected.m_to)
+         s_misplacedAlarms++;
+      else if (s_alarmAt[i] < 0)
+         s_alarmAt[i] = at;
+   }
+}
+
+// Every expected alarm within a cook of this length went off, and none at the wrong time.
+static bool alarmsAsExpected (float hours)
+{
+   bool ok = s_misplacedAlarms == 0;
+   for (size_t i = 0; i < EXPECTED_ALARM_COUNT; i++)
+   {
+      if (s_expectedAlarms[i].m_to <= hours && s_alarmAt[i] < 0)
+      {
+         printf ("alarm missing: rule %u between %.2f h and %.2f h\n", (unsigned)s_expectedAlarms[i].m_rule, s_expectedAlarms[i].m_from, s_expectedAlarms[i].m_to);
+         ok = false;
+      }
+   }
+   if (s_misplacedAlarms)
+      printf ("alarms outside their window: %lu\n", s_misplacedAlarms);
+   return ok;
+}
+
+// Hours into the cook the rule went off, negative when it did not.
+static float alarmAt (uint8_t rule)
+{
+   for (size_t i = 0; i < EXPECTED_ALARM_COUNT; i++)
+      if (s_expectedAlarms[i].m_rule == rule)
+         return s_alarmAt[i];
+   return -1.0f;
+}
+
+// The stall was seen, and once the climb is under way the estimates point at the time the target alarm went off.
+static bool etaConverged (float hours)
+{
+   bool stalled = false;
+   float worst = 0.0f;
+   bool valid = true;
+   float doneAt = alarmAt (0);
+   for (size_t i = 0; i < s_etaCount; i++)
+   {
+      const EtaSample& eta = s_etas[i];
+      if (eta.m_at >= SIM_STALL_FROM && eta.m_at <= SIM_STALL_TO)
+         stalled = stalled || eta.m_stalled;
+      if (doneAt >= 0 && eta.m_at >= SIM_ETA_FROM && eta.m_at < doneAt)
+      {
+         valid = valid && eta.m_valid;
+         if (eta.m_valid)
+            worst = fmaxf (worst, fabsf (eta.m_doneAt - doneAt));
+      }
+   }
+   printf ("eta: stall %s, estimates off by at most %.2f h from %.1f h until the target\n", stalled ? "reported" : "NOT REPORTED", worst, SIM_ETA_FROM);
+   bool ok = valid && worst <= SIM_ETA_TOLERANCE;
+   if (hours >= SIM_STALL_TO)
+      ok = ok && stalled;
+   return ok;
+}
+
+int main (int argc, char** argv)
+{
+   float hours = argc > 1 ? atof (argv[1]) : 16.0f;
+   if (argc > 2 && strcmp (argv[2], "pid") == 0)
+      return runPitSimulation (hours);
+   if (argc > 2 && strcmp (argv[2], "power") == 0)
+      return runPowerSimulation (hours, cookCurve, argc > 3 ? argv[3] : nullptr);
+   if (argc > 2 && strcmp (argv[2], "boot") == 0)
+      return runBootSimulation (cookCurve);
+   if (argc > 2 && strcmp (argv[2], "race") == 0)
+      return runRaceTest (hours);
+   if (argc > 2 && strcmp (argv[2], "soak") == 0)
+      return runSoakTest (hours, cookCurve, argc > 3 ? atoi (argv[3]) : 0);
+   srand (1);
+
+   FakeClock clock;
+   ScriptedAdc adc (clock, cookCurve, ntcCalibrationFromBeta (NTC_BCOEFFICIENT, NTC_SMP_TMP, NTC_SMP_RES));
+   ScriptedThermocouples thermocouples (clock, cookCurve);
+   FakeBattery battery (3.9f);
+   RecordingMqtt mqtt;
+
+   g_clock = &clock;
+   g_probeAdc = &adc;
+   g_thermoCouples = &thermocouples;
+   g_battery = &battery;
+   g_mqtt = &mqtt;
+
+   defaultNtcCalibration ();
+   defaultFilterConfigs ();
+   buildNtcTables ();
+   applyFilterConfigs ();
+   g_cookLog.begin ();
+   g_epochOffset = SIM_START_TIME;
+
+   setupMqttTopics ();
+   snprintf (g_uniqueId, 5, "0000");
+   setupAlarms ();
+
+   // Sensor task and loop () interleaved on one thread. Past setup the sampling, /measures.json
+   // and MQTT code must not touch the heap; the fakes do not count.
+   trackThreadHeap ();
+   uint32_t totalTicks = hours * 3600000.0f / SENSOR_TASK_PERIOD;
+   unsigned long readings = 0;
+   unsigned long histPoints = 0;
+   unsigned long alarmEvents = 0;
+   DataPoint reading;
+   for (uint32_t ticks = 0; ticks < totalTicks; ticks++)
+   {
+      clock.advance (SENSOR_TASK_PERIOD);
+      sensorTick (ticks, reading);
+
+      if (clock.millis () == SIM_OUTAGE_START * 3600000u)
+         mqtt.setReachable (false);
+      if (clock.millis () == SIM_OUTAGE_END * 3600000u)
+         mqtt.setReachable (true);
+      g_mqttConnection.service (clock.millis ());
+
+      if (takeReadings ())
+      {
+         readings++;
+         // Time to target of the meat probe every half hour
+         if (clock.millis () % 1800000 < SENSOR_READ_INT && g_estimator.hasTarget (0))
+         {
+            const Eta& eta = g_estimator.eta (0);
+            float now = clock.millis () / 3600000.0f;
+            if (s_etaCount < SIM_ETA_MAX)
+               s_etas[s_etaCount++] = {now, now + eta.m_seconds / 3600.0f, eta.m_valid, eta.m_stalled};
+            if (eta.m_valid)
+               printf ("eta at %.1f h: NTC1 %.1f F, done at %.1f h, %u%% confidence\n", now, g_lastSenUpdate.m_sensors[0].m_tempF, now + eta.m_seconds / 3600.0f, (unsigned)eta.m_confidence);
+            else
+               printf ("eta at %.1f h: NTC1 %.1f F, %s\n", now, g_lastSenUpdate.m_sensors[0].m_tempF, eta.m_stalled ? "stalled" : "no estimate");
+         }
+         char measures[SENSOR_JSON_MAX];
+         formatSensorJson (measures, SENSOR_JSON_MAX);
+         g_mqttPublisher.offer (g_lastSenUpdate, g_batteryLevel, clock.millis ());
+      }
+      HistPoint point;
+      while (g_histPoints.pop (point))
+         histPoints++;
+      AlarmEvent event;
+      while (g_alarms.popEvent (event))
+      {
+         char json[ALARM_EVENT_JSON_MAX];
+         formatAlarmEvent (json, ALARM_EVENT_JSON_MAX, event, g_alarms.rule (event.m_rule));
+         printf ("alarm at %.2f h: %s\n", (event.m_time - SIM_START_TIME) / 3600.0f, json);
+         checkAlarmEvent (event);
+         if (g_mqttConnection.online ())
+            publishAlarm (json);
+         alarmEvents++;
+      }
+      if (g_mqttConnection.online ())
+         g_mqttPublisher.service ();
+   }
+
+   HeapUse heap = heapUse ();
+   printf ("simulated %.1f h: %lu readings, %lu history points, %u dropped\n", hours, readings, histPoints, (unsigned)(g_readings.dropped () + g_histPoints.dropped ()));
+   printf ("heap: %lu allocations during the cook\n", heap.m_count);
+
+   char alarms[ALARM_RULES_JSON_MAX];
+   formatAlarmRules (alarms, ALARM_RULES_JSON_MAX, g_alarms);
+   printf ("alarms: %lu events, /alarms %s\n", alarmEvents, alarms);
+
+   char measures[SENSOR_JSON_MAX];
+   formatSensorJson (measures, SENSOR_JSON_MAX);
+   printf ("/measures.json %s\n", measures);
+
+   HistoryStore::View hist (g_tempHist);
+   HistoryJsonStream stream = HistoryJsonStream ();
+   stream.m_lastTime = INT32_MIN;
+   uint8_t chunk[1024];
+   size_t jsonSize = 0;
+   size_t len;
+   while ((len = fillHistoryChunk (stream, chunk, sizeof (chunk))) > 0)
+      jsonSize += len;
+   printf ("history: %u records, %u bytes JSON, %u bytes binary\n", (unsigned)hist.size (), (unsigned)jsonSize, (unsigned)encodeHistoryBin (hist, INT32_MIN, nullptr, 0));
+
+   printf ("mqtt: %lu messages, %lu bytes, %lu states, %lu replayed after the outage, %u lost, %lu out of order, longest gap %ld s\n", mqtt.published (), mqtt.bytes (), mqtt.states (), mqtt.backlog (), (unsigned)g_mqttBacklogDropped.load (), mqtt.outOfOrder (), mqtt.maxStateGap ());
+   printf ("mqtt connection attempts: %lu\n", mqtt.attempts ());
+   printf ("mqtt last: %s %s\n", mqtt.lastTopic ().c_str (), mqtt.lastPayload ().c_str ());
+
+   // Restart and restore the cook from the log.
+   g_cookLog.flush ();
+   size_t before = hist.size ();
+   g_tempHist.clear ();
+   CookLog restored (g_memoryFs);
+   restored.begin ();
+   restored.replay ([](const HistPoint& point) { g_tempHist.add (point); s_replayed++; });
+   size_t after = HistoryStore::View (g_tempHist).size ();
+   printf ("cook log: %u bytes written, %u points replayed, %u of %u records restored\n", (unsigned)g_cookLog.bytesWritten (), (unsigned)s_replayed, (unsigned)after, (unsigned)before);
+
+   bool ok = after == before && heap.m_count == 0;
+   ok = alarmsAsExpected (hours) && ok;
+   ok = etaConverged (hours) && ok;
+   ok = runChecks () && ok;
+   printf ("cook: %s\n", ok ? "within bounds" : "OUT OF BOUNDS");
+   return ok ? 0 : 1;
+}